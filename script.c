@@ -1,3 +1,8 @@
+// NOTE: For posix_memalign and clock_gettime
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -6,6 +11,7 @@ extern "C" {
 #include "hashmap.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <stdarg.h>
@@ -13,12 +19,47 @@ extern "C" {
 #include <stdint.h>
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
+
+// NOTE: Define SCRIPT_PARALLEL_MARK to let full collections mark on several
+// threads (see script_gc_set_threads); it needs pthreads and the GCC
+// __atomic builtins. Define SCRIPT_BACKGROUND_SWEEP to free garbage on a
+// separate thread (see script_gc_set_background_sweep); it needs pthreads.
+#ifdef SCRIPT_PARALLEL_MARK
+#if !defined(__GNUC__)
+#error "SCRIPT_PARALLEL_MARK needs the GCC __atomic builtins"
+#endif
+#include <sched.h>
+#endif
+
+#if defined(SCRIPT_PARALLEL_MARK) || defined(SCRIPT_BACKGROUND_SWEEP)
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #define MAX_LEX_CHARS 256
 #define STACK_SIZE 256
-#define INIT_GC_THRESH 64
+#define MAX_STACK_SIZE (1 << 22)
+#define FRAME_CAPACITY 64
+#define MAX_FRAMES (1 << 20)
+// NOTE: Stack traces only show this many of the innermost frames
+#define MAX_TRACE_FRAMES 64
+// NOTE: Defaults for script_gc_config_t
+#define GC_DEFAULT_INITIAL_BYTES	(256 * 1024)
+#define GC_DEFAULT_GROWTH_FACTOR	2.0
+#define GC_DEFAULT_MIN_BYTES		(256 * 1024)
 #define INVALID_VAR_DECL_INDEX -9999
 
+// NOTE: Threaded dispatch using the labels-as-values extension; define
+// SCRIPT_NO_COMPUTED_GOTO to force the portable switch-based loop
+#if defined(__GNUC__) && !defined(SCRIPT_NO_COMPUTED_GOTO)
+#define SCRIPT_COMPUTED_GOTO
+#endif
+
 typedef unsigned char word;
 
 struct func_decl;
@@ -470,6 +511,7 @@ static const char* g_warning_format[NUM_WARNINGS] = {
 // NOTE: Used for file and line debug info optimization
 static int g_last_compiled_line = 0;
 static const char* g_last_compiled_file = NULL;
+static int g_last_compiled_file_index = -1;
 
 static void warn_c(context_t ctx, script_warning_t warning, ...)
 {
@@ -573,65 +615,212 @@ static void error_exit_e(expr_t* exp, const char* fmt, ...)
 	exit(1);
 }
 
-static void write_value(script_value_t* val, char quote)
+// NOTE: Value encoding (see script_value_t). Immediates hold their kind
+// in bits 32-39 and their payload in the low 32 bits.
+#define VALUE_IMMEDIATE_TAG		(1ULL << 48)
+#define VALUE_NUMBER_OFFSET		(1ULL << 49)
+#define VALUE_CANONICAL_NAN		0x7FF8000000000000ULL
+
+#define IMM_BOOL				1
+#define IMM_CHAR				2
+#define IMM_FUNC				3
+#define IMM_EXTERN_FUNC			4
+
+#define NULL_VALUE				((script_value_t)0)
+#define IMMEDIATE(kind, payload)	(VALUE_IMMEDIATE_TAG | ((uint64_t)(kind) << 32) | (uint32_t)(payload))
+#define BOOL_VALUE(bv)			IMMEDIATE(IMM_BOOL, (bv) ? 1 : 0)
+#define CHAR_VALUE(c)			IMMEDIATE(IMM_CHAR, (unsigned char)(c))
+#define OBJECT_VALUE(obj)		((script_value_t)(uintptr_t)(obj))
+
+#define IS_NUMBER(v)			((v) >= VALUE_NUMBER_OFFSET)
+#define IS_OBJECT(v)			((v) != NULL_VALUE && (v) < VALUE_IMMEDIATE_TAG)
+#define IS_IMMEDIATE(v, kind)	(((v) >> 32) == ((VALUE_IMMEDIATE_TAG >> 32) | (kind)))
+
+#define AS_BOOL(v)				((char)((v) & 1))
+#define AS_CHAR(v)				((char)((v) & 0xFF))
+#define AS_OBJECT(v)			((script_object_t*)(uintptr_t)(v))
+
+typedef union
+{
+	uint64_t bits;
+	double number;
+} number_bits_t;
+
+static inline script_value_t number_value(double number)
+{
+	number_bits_t nb;
+	nb.number = number;
+
+	// NOTE: NaNs can have any payload (and sign) and would run past the
+	// top of the encoding otherwise
+	if(number != number)
+		nb.bits = VALUE_CANONICAL_NAN;
+
+	return nb.bits + VALUE_NUMBER_OFFSET;
+}
+
+static inline double as_number(script_value_t val)
+{
+	number_bits_t nb;
+	nb.bits = val - VALUE_NUMBER_OFFSET;
+
+	return nb.number;
+}
+
+static inline script_value_t function_value(char is_extern, int index)
+{
+	return IMMEDIATE(is_extern ? IMM_EXTERN_FUNC : IMM_FUNC, index);
+}
+
+static inline script_function_t as_function(script_value_t val)
+{
+	script_function_t function;
+
+	function.is_extern = IS_IMMEDIATE(val, IMM_EXTERN_FUNC);
+	function.index = (int)(uint32_t)val;
+
+	return function;
+}
+
+static inline script_value_type_t get_value_type(script_value_t val)
 {
-	if(!val)
+	if(IS_NUMBER(val)) return VAL_NUMBER;
+	if(val == NULL_VALUE) return VAL_NULL;
+	if(val < VALUE_IMMEDIATE_TAG) return AS_OBJECT(val)->type;
+
+	switch((val >> 32) & 0xFF)
 	{
-		printf("null");
-		return;
+		case IMM_BOOL: return VAL_BOOL;
+		case IMM_CHAR: return VAL_CHAR;
+		default: return VAL_FUNC;
 	}
-	
-	switch(val->type)
+}
+
+static void write_value(script_value_t val, char quote)
+{
+	script_object_t* obj = IS_OBJECT(val) ? AS_OBJECT(val) : NULL;
+
+	switch(get_value_type(val))
 	{
 		case VAL_NULL: printf("null"); break;
-		case VAL_BOOL: printf("%s", val->boolean ? "true" : "false"); break;
-		case VAL_CHAR: printf("%c", val->code); break;
-		case VAL_NUMBER: printf("%g", val->number); break;
-		case VAL_STRING: quote ? printf("\"%s\"", val->string.data) : printf("%s", val->string.data); break;
-		case VAL_FUNC: printf("func (extern: %s, index: %d)", val->function.is_extern ? "true" : "false", val->function.index); break;
+		case VAL_BOOL: printf("%s", AS_BOOL(val) ? "true" : "false"); break;
+		case VAL_CHAR: printf("%c", AS_CHAR(val)); break;
+		case VAL_NUMBER: printf("%g", as_number(val)); break;
+		case VAL_STRING: quote ? printf("\"%s\"", obj->string.data) : printf("%s", obj->string.data); break;
+		case VAL_FUNC: printf("func (extern: %s, index: %d)", as_function(val).is_extern ? "true" : "false", as_function(val).index); break;
 		case VAL_ARRAY:
 		{
 			printf("[");
-			for(int i = 0; i < val->array.length; ++i)
+			for(int i = 0; i < obj->array->length; ++i)
 			{
-				script_value_t* mem = vec_get_value(&val->array, i, script_value_t*);
+				script_value_t mem = vec_get_value(obj->array, i, script_value_t);
 				if (val == mem)
 					printf("__self__");
 				else
 					write_value(mem, quote);
-				if(i + 1 < val->array.length) printf(", ");
+				if(i + 1 < obj->array->length) printf(", ");
 			}
 			printf("]");
 		} break;
 		case VAL_STRUCT_INSTANCE:
 		{
 			printf("{ ");
-			for(int i = 0; i < val->ds.members.length; ++i)
+			for(int i = 0; i < obj->ds->members.length; ++i)
 			{
-				script_value_t* mem = vec_get_value(&val->ds.members, i, script_value_t*);
+				script_value_t mem = vec_get_value(&obj->ds->members, i, script_value_t);
 				if (val == mem)
 					printf("__self__");
 				else
 					write_value(mem, quote);
-				if(i + 1 < val->ds.members.length) printf(", ");
+				if(i + 1 < obj->ds->members.length) printf(", ");
 			}
 			printf(" }");
 		} break;
 		case VAL_NATIVE:
 		{
-			printf("native 0x%lX", (unsigned long)val->nat.value);
+			printf("native 0x%lX", (unsigned long)obj->nat->value);
 		} break;
+		default: break;
+	}
+}
+
+static void link_code(script_t* script);
+
+// NOTE: Looks up the source position of instruction 'pc' in script->line_info
+static void get_source_position(script_t* script, int pc, const char** file, int* line)
+{
+	*file = "unknown";
+	*line = 0;
+
+	link_code(script);
+	if (pc < 0 || pc >= script->instr_offsets.length)
+		return;
+
+	int offset = vec_get_value(&script->instr_offsets, pc, int);
+
+	// NOTE: Find the last entry at or before offset
+	int lo = 0;
+	int hi = script->line_info.length;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (vec_get_value(&script->line_info, mid, script_line_info_t).pc <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	if (lo == 0)
+		return;
+
+	script_line_info_t* info = vec_get(&script->line_info, lo - 1);
+
+	if (info->file >= 0)
+		*file = vec_get_value(&script->strings, info->file, script_string_t).data;
+	*line = info->line;
+}
+
+// NOTE: Returns the pc of the instruction being executed
+static int get_call_site_pc(script_t* script)
+{
+	// NOTE: While an extern is running the pc already points past the call
+	return script->in_extern ? script->pc - 1 : script->pc;
+}
+
+// NOTE: Updates cur_file and cur_line for the current pc
+static void update_source_position(script_t* script)
+{
+	int pc = get_call_site_pc(script);
+
+	if (pc >= 0)
+		get_source_position(script, pc, &script->cur_file, &script->cur_line);
 }
 
 static void print_stack_trace(script_t* script)
 {
 	fprintf(stderr, "Trace:\n");
-	for(int i = script->call_records.length - 1; i >= 0; --i)
+	for(int i = script->frame_count - 1; i >= 0; --i)
 	{
-		script_call_record_t* record = vec_get(&script->call_records, i);
+		if(script->frame_count - i > MAX_TRACE_FRAMES)
+		{
+			fprintf(stderr, "... %d more frames\n", i + 1);
+			break;
+		}
 
-		fprintf(stderr, "(%s, %d): ", record->file, record->line);
+		script_frame_t* record = &script->frames[i];
+
+		const char* file;
+		int line;
+
+		// NOTE: Calls made by the host don't have a call site
+		if (record->pc > 0)
+		{
+			get_source_position(script, record->pc - 1, &file, &line);
+			fprintf(stderr, "(%s, %d): ", file, line);
+		}
+		else
+			fprintf(stderr, "(host): ");
 		
 		if (record->function.is_extern)
 			fprintf(stderr, "extern %s(", vec_get_value(&script->extern_names, record->function.index, char*));
@@ -648,7 +837,7 @@ static void print_stack_trace(script_t* script)
 			// to stderr
 			for (int i = args_start; i < args_start + record->nargs; ++i)
 			{
-				write_value(vec_get_value(&script->stack, i, script_value_t*), 1);
+				write_value(vec_get_value(&script->stack, i, script_value_t), 1);
 				if (i + 1 < args_start + record->nargs)
 					fprintf(stderr, ", ");
 			}
@@ -664,10 +853,16 @@ static void print_stack_trace(script_t* script)
 // MODULES ARE ADDED
 static script_module_t* get_executing_module(script_t* script)
 {
+	if (script->pc < 0 || script->pc >= script->instr_offsets.length)
+		return NULL;
+
+	// NOTE: module pcs are offsets into the unlinked code
+	int offset = vec_get_value(&script->instr_offsets, script->pc, int);
+
 	for (int i = 0; i < script->modules.length; ++i)
 	{
 		script_module_t* m = vec_get(&script->modules, i);
-		if (m->start_pc <= script->pc && m->end_pc >= script->pc)
+		if (m->start_pc <= offset && m->end_pc >= offset)
 			return m;
 	}
 
@@ -706,12 +901,16 @@ static void print_current_script_line(script_t* script)
 }
 
 static void execute_cycle(script_t* script);
+static void execute_until(script_t* script, int depth);
+static int get_linked_pc(script_t* script, int offset);
 
 static void compile_module(script_t* script, script_module_t* module);
 static void destroy_module(void* p_module);
 static void parse_program(script_t* script, vector_t* expr_list);
 static void debug_script(script_t* script)
 {
+	update_source_position(script);
+
 	printf("\n");
 
 	if (script->pc >= 0)
@@ -775,14 +974,14 @@ static void debug_script(script_t* script)
 		}
 		else if (strcmp(cmdbuf, "local\n") == 0)
 		{
-			script_call_record_t* record;
-			if (script->call_records.length <= 0)
+			script_frame_t* record;
+			if (script->frame_count <= 0)
 			{
 				printf("Not inside function.\n");
 				continue;
 			}
 
-			record = vec_get(&script->call_records, script->call_records.length - 1);
+			record = &script->frames[script->frame_count - 1];
 
 			printf("local name: ");
 			
@@ -828,7 +1027,7 @@ static void debug_script(script_t* script)
 			printf("local offset = %d\n", local->index);
 			printf("local value = ");
 
-			script_value_t* val = vec_get_value(&script->stack, script->fp + local->index, script_value_t*);
+			script_value_t val = vec_get_value(&script->stack, script->fp + local->index, script_value_t);
 			
 			write_value(val, 1);
 			printf("\n");
@@ -856,9 +1055,10 @@ static void debug_script(script_t* script)
 			compile_module(script, module);
 
 			int pc = script->pc;
-			script->pc = module->start_pc;
+			int end_pc = get_linked_pc(script, module->end_pc);
+			script->pc = get_linked_pc(script, module->start_pc);
 
-			while (script->pc >= 0 && script->pc < module->end_pc)
+			while (script->pc >= 0 && script->pc < end_pc)
 				script_execute_cycle(script);
 
 			script->pc = pc;
@@ -868,11 +1068,11 @@ static void debug_script(script_t* script)
 		}
 		else if (strcmp(cmdbuf, "stack\n") == 0)
 		{
-			script_call_record_t* record;
-			if (script->call_records.length <= 0)
+			script_frame_t* record;
+			if (script->frame_count <= 0)
 				record = NULL;
 			else
-				record = vec_get(&script->call_records, script->call_records.length - 1);
+				record = &script->frames[script->frame_count - 1];
 
 			func_decl_t* decl = NULL;
 
@@ -908,7 +1108,7 @@ static void debug_script(script_t* script)
 					}
 				}
 
-				write_value(vec_get_value(&script->stack, stackIndex, script_value_t*), 1);
+				write_value(vec_get_value(&script->stack, stackIndex, script_value_t), 1);
 				printf("\n");
 			}
 		}
@@ -919,6 +1119,8 @@ static void debug_script(script_t* script)
 
 static void error_exit_script(script_t* script, const char* fmt, ...)
 {
+	update_source_position(script);
+
 	fprintf(stderr, "\nError (%s:%i):\n", script->cur_file, script->cur_line);
 	
 	va_list args;
@@ -1453,6 +1655,9 @@ static func_decl_t* declare_function(script_t* script, const char* name)
 	
 	int undef_pc = -1;
 	vec_push_back(&script->function_pcs, &undef_pc);
+
+	int stack_size = 0;
+	vec_push_back(&script->function_stack_sizes, &stack_size);
 	
 	decl->has_return = 0;
 
@@ -2873,6 +3078,7 @@ static void debug_expr(script_t* script, expr_t* exp)
 static inline void append_code(script_t* script, word w)
 {
 	vec_push_back(&script->code, &w);
+	script->linked = 0;
 }
 
 static inline void append_int(script_t* script, int v)
@@ -2887,6 +3093,7 @@ static inline void patch_int(script_t* script, int loc, int v)
 	word* vp = (word*)(&v);
 	for(int i = 0; i < sizeof(int) / sizeof(word); ++i)
 		vec_set(&script->code, loc + i, vp++);
+	script->linked = 0;
 }
 
 static void flatten_expr(vector_t* expr_list, expr_t* exp)
@@ -3269,6 +3476,7 @@ static var_decl_t* get_root_var_decl(expr_t* exp)
 static int get_struct_type_member_index(type_tag_t* tag, const char* name);
 // TODO: Add type names to error messages
 // NOTE: resolve_symbols before this
+static void check_extern_signature(script_t* script, expr_t* exp);
 static void resolve_type_tags(script_t* script, void* vexp)
 {
 	expr_t* exp = vexp;
@@ -3543,7 +3751,15 @@ static void resolve_type_tags(script_t* script, void* vexp)
 		} break;
 		
 		case EXP_EXTERN:
-		case EXP_EXTERN_LIST: break;
+		{
+			check_extern_signature(script, exp);
+		} break;
+
+		case EXP_EXTERN_LIST:
+		{
+			for(int i = 0; i < exp->extern_array.length; ++i)
+				resolve_type_tags(script, vec_get_value(&exp->extern_array, i, expr_t*));
+		} break;
 		
 		case EXP_ARRAY_LITERAL:
 		{
@@ -3638,7 +3854,9 @@ static void resolve_type_tags(script_t* script, void* vexp)
 }
 
 static void compile_value_expr(script_t* script, expr_t* exp);
-static void compile_call(script_t* script, expr_t* exp)
+// NOTE: 'tail' compiles an OP_TAIL_CALL, which reuses the calling
+// function's frame (for 'return f(...)')
+static void compile_call(script_t* script, expr_t* exp, char tail)
 {
 	int nargs = exp->callx.args.length;
 
@@ -3656,7 +3874,7 @@ static void compile_call(script_t* script, expr_t* exp)
 
 	compile_value_expr(script, exp->callx.func);
 	
-	append_code(script, OP_CALL);
+	append_code(script, tail ? OP_TAIL_CALL : OP_CALL);
 	append_code(script, nargs);
 }
 
@@ -3676,29 +3894,303 @@ static int get_struct_type_member_index(type_tag_t* tag, const char* name)
 	return -1;
 }
 
-static void compile_file_line_info(script_t* script, expr_t* exp, char ignore_last)
+// NOTE: Source positions are kept out of the instruction stream; an entry
+// is added to script->line_info whenever the position changes and the
+// position of any instruction is that of the last entry at or before it
+static void compile_file_line_info(script_t* script, expr_t* exp)
 {
+	char file_changed = 0;
+
 	if (exp->ctx.file)
 	{
-		if (ignore_last || !g_last_compiled_file || strcmp(g_last_compiled_file, exp->ctx.file) != 0)
+		if (!g_last_compiled_file || strcmp(g_last_compiled_file, exp->ctx.file) != 0)
 		{
-			append_code(script, OP_FILE);
-			append_int(script, register_string(script, exp->ctx.file));
+			g_last_compiled_file_index = register_string(script, exp->ctx.file);
+			file_changed = 1;
 		}
 		g_last_compiled_file = exp->ctx.file;
 	}
 
-	if(ignore_last || g_last_compiled_line != exp->ctx.line)
+	if(!file_changed && g_last_compiled_line == exp->ctx.line)
+		return;
+	g_last_compiled_line = exp->ctx.line;
+
+	script_line_info_t info;
+
+	info.pc = script->code.length;
+	info.file = g_last_compiled_file_index;
+	info.line = exp->ctx.line;
+
+	// NOTE: Nothing was compiled since the last entry so it's superseded
+	if(script->line_info.length > 0)
+	{
+		script_line_info_t* last = vec_get(&script->line_info, script->line_info.length - 1);
+		if(last->pc == info.pc)
+		{
+			*last = info;
+			return;
+		}
+	}
+
+	vec_push_back(&script->line_info, &info);
+}
+
+// NOTE: Dynamic doesn't count here; the type has to be known exactly
+static char has_exact_tag(expr_t* exp, tag_t type)
+{
+	return exp->tag && exp->tag->type == type;
+}
+
+// NOTE: Returns the type specialized opcode for binary expression 'exp'
+// if the types of both operands are known, -1 otherwise.
+// For TOK_NOTEQUAL this returns the equality op (which should be followed by OP_NOT).
+static int get_specialized_op(expr_t* exp)
+{
+	expr_t* lhs = exp->binx.lhs;
+	expr_t* rhs = exp->binx.rhs;
+
+	if(has_exact_tag(lhs, TAG_NUMBER) && has_exact_tag(rhs, TAG_NUMBER))
+	{
+		switch(exp->binx.op)
+		{
+			case TOK_PLUS: return OP_ADD_NUM;
+			case TOK_MINUS: return OP_SUB_NUM;
+			case TOK_MUL: return OP_MUL_NUM;
+			case TOK_DIV: return OP_DIV_NUM;
+			case TOK_MOD: return OP_MOD_NUM;
+
+			case TOK_LT: return OP_LT_NUM;
+			case TOK_GT: return OP_GT_NUM;
+			case TOK_LTE: return OP_LTE_NUM;
+			case TOK_GTE: return OP_GTE_NUM;
+
+			case TOK_EQUALS:
+			case TOK_NOTEQUAL: return OP_EQU_NUM;
+
+			default: break;
+		}
+	}
+	else if(has_exact_tag(lhs, TAG_STRING) && has_exact_tag(rhs, TAG_STRING))
+	{
+		if(exp->binx.op == TOK_EQUALS || exp->binx.op == TOK_NOTEQUAL)
+			return OP_EQU_STR;
+	}
+
+	return -1;
+}
+
+// NOTE: Register codegen state for the function currently being compiled.
+// Temporaries are frame slots allocated after the function's locals;
+// they're released in stack order as soon as the instruction using
+// them has been emitted. g_reg_max_temps is how many slots OP_RESERVE
+// has to allocate in the function's prologue.
+static char g_reg_enabled = 0;
+static int g_reg_first_temp = 0;
+static int g_reg_num_temps = 0;
+static int g_reg_max_temps = 0;
+
+static int alloc_reg_temp()
+{
+	int slot = g_reg_first_temp + g_reg_num_temps;
+	
+	++g_reg_num_temps;
+	if(g_reg_num_temps > g_reg_max_temps)
+		g_reg_max_temps = g_reg_num_temps;
+
+	return slot;
+}
+
+static expr_t* strip_parens(expr_t* exp)
+{
+	while(exp->type == EXP_PAREN)
+		exp = exp->paren;
+	return exp;
+}
+
+static int get_reg_op(expr_t* exp)
+{
+	exp = strip_parens(exp);
+	
+	if(exp->type == EXP_UNARY)
+		return exp->unaryx.op == TOK_MINUS ? OP_REG_NEG : -1;
+	
+	if(exp->type != EXP_BINARY)
+		return -1;
+
+	switch(exp->binx.op)
+	{
+		case TOK_PLUS: return OP_REG_ADD;
+		case TOK_MINUS: return OP_REG_SUB;
+		case TOK_MUL: return OP_REG_MUL;
+		case TOK_DIV: return OP_REG_DIV;
+		case TOK_MOD: return OP_REG_MOD;
+
+		case TOK_LT: return OP_REG_LT;
+		case TOK_GT: return OP_REG_GT;
+		case TOK_LTE: return OP_REG_LTE;
+		case TOK_GTE: return OP_REG_GTE;
+
+		default: return -1;
+	}
+}
+
+// NOTE: Operands which can be used in place; only locals qualify (as
+// opposed to globals) since nothing evaluated in between can assign to them
+static char is_reg_direct(expr_t* exp)
+{
+	exp = strip_parens(exp);
+	
+	if(exp->type == EXP_NUMBER) return 1;
+	return exp->type == EXP_VAR && exp->varx.decl && exp->varx.decl->parent;
+}
+
+// NOTE: How many fewer instructions the register form of 'exp' needs
+// compared to the stack form, not counting moving the result anywhere.
+// Every direct operand saves a push, every operand which has to be
+// computed on the stack costs a SETLOCAL into a temporary.
+static int get_reg_savings(expr_t* exp)
+{
+	exp = strip_parens(exp);
+	
+	expr_t* operands[2];
+	int num_operands = 0;
+
+	if(exp->type == EXP_UNARY)
+		operands[num_operands++] = exp->unaryx.rhs;
+	else
+	{
+		operands[num_operands++] = exp->binx.lhs;
+		operands[num_operands++] = exp->binx.rhs;
+	}
+
+	int savings = 0;
+	for(int i = 0; i < num_operands; ++i)
+	{
+		if(is_reg_direct(operands[i]))
+			savings += 1;
+		else if(get_reg_op(operands[i]) >= 0)
+		{
+			int s = get_reg_savings(operands[i]);
+			savings += s > -1 ? s : -1;
+		}
+		else
+			savings -= 1;
+	}
+
+	return savings;
+}
+
+static void compile_reg_expr(script_t* script, expr_t* exp, int dest);
+
+// NOTE: Returns the operand encoding for 'exp', computing it into
+// a temporary first if necessary
+static int compile_reg_operand(script_t* script, expr_t* exp)
+{
+	exp = strip_parens(exp);
+
+	if(is_reg_direct(exp))
+	{
+		// NOTE: Same position info as the stack code would have had
+		compile_file_line_info(script, exp);
+		
+		if(exp->type == EXP_NUMBER)
+			return SCRIPT_REG_CONST + exp->number_index;
+		return exp->varx.decl->index;
+	}
+
+	int temp = alloc_reg_temp();
+
+	if(get_reg_op(exp) >= 0 && get_reg_savings(exp) >= -1)
+		compile_reg_expr(script, exp, temp);
+	else
+	{
+		compile_value_expr(script, exp);
+		append_code(script, OP_SETLOCAL);
+		append_int(script, temp);
+	}
+
+	return temp;
+}
+
+// NOTE: Computes 'exp' (for which get_reg_op is valid) into frame slot 'dest'.
+// The right hand side is evaluated before the left to match the stack code.
+static void compile_reg_expr(script_t* script, expr_t* exp, int dest)
+{
+	exp = strip_parens(exp);
+
+	int op = get_reg_op(exp);
+	int num_temps = g_reg_num_temps;
+	
+	if(op == OP_REG_NEG)
+	{
+		int rhs = compile_reg_operand(script, exp->unaryx.rhs);
+		
+		append_code(script, op);
+		append_int(script, dest);
+		append_int(script, rhs);
+	}
+	else
+	{
+		int rhs = compile_reg_operand(script, exp->binx.rhs);
+		int lhs = compile_reg_operand(script, exp->binx.lhs);
+
+		append_code(script, op);
+		append_int(script, dest);
+		append_int(script, lhs);
+		append_int(script, rhs);
+	}
+
+	g_reg_num_temps = num_temps;
+}
+
+// NOTE: Register form of an expression in value context. The result is
+// computed into a temporary and then pushed, so this is only used if that
+// saves at least the extra GETLOCAL. Returns 0 if nothing was compiled.
+static char compile_reg_value(script_t* script, expr_t* exp)
+{
+	if(!g_reg_enabled || get_reg_op(exp) < 0 || get_reg_savings(exp) < 1)
+		return 0;
+
+	int temp = alloc_reg_temp();
+	compile_reg_expr(script, exp, temp);
+	--g_reg_num_temps;
+
+	append_code(script, OP_GETLOCAL);
+	append_int(script, temp);
+
+	return 1;
+}
+
+// NOTE: Compiles a branch on 'cond' being false and returns the location
+// of the jump target so it can be patched
+static int compile_cond_jump(script_t* script, expr_t* cond)
+{
+	if(g_reg_enabled && get_reg_op(cond) >= 0 && get_reg_savings(cond) >= 0)
+	{
+		compile_file_line_info(script, cond);
+		
+		int temp = alloc_reg_temp();
+		compile_reg_expr(script, cond, temp);
+		--g_reg_num_temps;
+
+		append_code(script, OP_REG_GOTOZ);
+		append_int(script, temp);
+	}
+	else
 	{
-		append_code(script, OP_LINE);
-		append_int(script, exp->ctx.line);
+		compile_value_expr(script, cond);
+		append_code(script, has_exact_tag(cond, TAG_BOOL) ? OP_GOTOZ_BOOL : OP_GOTOZ);
 	}
-	g_last_compiled_line = exp->ctx.line;	
+
+	int loc = script->code.length;
+	append_int(script, 0);
+
+	return loc;
 }
 
 static void compile_value_expr(script_t* script, expr_t* exp)
 {
-	compile_file_line_info(script, exp, 0);
+	compile_file_line_info(script, exp);
 	
 	switch(exp->type)
 	{
@@ -3867,6 +4359,8 @@ static void compile_value_expr(script_t* script, expr_t* exp)
 		
 		case EXP_UNARY:
 		{
+			if(compile_reg_value(script, exp)) break;
+			
 			compile_value_expr(script, exp->unaryx.rhs);
 			switch(exp->unaryx.op)
 			{
@@ -3878,8 +4372,19 @@ static void compile_value_expr(script_t* script, expr_t* exp)
 		
 		case EXP_BINARY:
 		{
+			if(compile_reg_value(script, exp)) break;
+			
 			compile_value_expr(script, exp->binx.rhs);
 			compile_value_expr(script, exp->binx.lhs);
+
+			int op = get_specialized_op(exp);
+			if(op >= 0)
+			{
+				append_code(script, op);
+				if(exp->binx.op == TOK_NOTEQUAL)
+					append_code(script, OP_NOT);
+				break;
+			}
 			
 			switch(exp->binx.op)
 			{
@@ -3906,11 +4411,8 @@ static void compile_value_expr(script_t* script, expr_t* exp)
 		
 		case EXP_CALL:
 		{
-			compile_call(script, exp);
+			compile_call(script, exp, 0);
 			append_code(script, OP_PUSH_RETVAL);
-			
-			// NOTE: because branching
-			compile_file_line_info(script, exp, 1);
 		} break;
 		
 		default:
@@ -3960,9 +4462,105 @@ static void compile_assign(script_t* script, expr_t* exp)
 	};
 }
 
+static int get_operand_size(word op);
+
+// NOTE: How many values an instruction in script->code leaves on the stack
+// (negative when it takes them off). Calls only count the function and its
+// arguments since the callee reserves its own space.
+static int get_stack_effect(const word* code)
+{
+	int operands[2] = { 0 };
+
+	switch(code[0])
+	{
+		case OP_PUSH_NULL:
+		case OP_PUSH_TRUE:
+		case OP_PUSH_FALSE:
+		case OP_PUSH_CHAR:
+		case OP_PUSH_NUMBER:
+		case OP_PUSH_STRING:
+		case OP_PUSH_FUNC:
+		case OP_PUSH_EXTERN_FUNC:
+		case OP_PUSH_RETVAL:
+		case OP_GET:
+		case OP_GETLOCAL:
+		case OP_READ: return 1;
+
+		case OP_STRING_GET:
+		case OP_ARRAY_GET:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_MOD:
+		case OP_LT:
+		case OP_GT:
+		case OP_LTE:
+		case OP_GTE:
+		case OP_LAND:
+		case OP_LOR:
+		case OP_EQU:
+		case OP_ADD_NUM:
+		case OP_SUB_NUM:
+		case OP_MUL_NUM:
+		case OP_DIV_NUM:
+		case OP_MOD_NUM:
+		case OP_LT_NUM:
+		case OP_GT_NUM:
+		case OP_LTE_NUM:
+		case OP_GTE_NUM:
+		case OP_EQU_NUM:
+		case OP_EQU_STR:
+		case OP_WRITE:
+		case OP_GOTOZ:
+		case OP_GOTOZ_BOOL:
+		case OP_SET:
+		case OP_SETLOCAL:
+		case OP_RETURN_VALUE: return -1;
+
+		case OP_STRUCT_SET: return -2;
+		case OP_ARRAY_SET: return -3;
+
+		case OP_CALL:
+		case OP_TAIL_CALL: return -(code[1] + 1);
+
+		case OP_PUSH_ARRAY_BLOCK:
+		case OP_PUSH_STRUCT:
+		case OP_RESERVE:
+		{
+			memcpy(operands, &code[1], get_operand_size(code[0]));
+
+			if(code[0] == OP_PUSH_ARRAY_BLOCK) return 1 - operands[0];
+			if(code[0] == OP_PUSH_STRUCT) return 1 - operands[1] * 2;
+			return operands[0];
+		}
+
+		default: return 0;
+	}
+}
+
+// NOTE: The most values the code between the given offsets has on the
+// stack at once. Statements leave the stack as they found it, so the depth
+// is the same on both sides of every jump and a straight walk through the
+// code finds it.
+static int get_stack_size(script_t* script, int start, int end)
+{
+	int depth = 0;
+	int max_depth = 0;
+
+	for(int offset = start; offset < end; offset += 1 + get_operand_size(script->code.data[offset]))
+	{
+		depth += get_stack_effect(&script->code.data[offset]);
+		if(depth > max_depth)
+			max_depth = depth;
+	}
+
+	return max_depth;
+}
+
 static void compile_expr(script_t* script, expr_t* exp)
 {
-	compile_file_line_info(script, exp, 0);
+	compile_file_line_info(script, exp);
 	
 	switch(exp->type)
 	{
@@ -3996,18 +4594,27 @@ static void compile_expr(script_t* script, expr_t* exp)
 				append_code(script, OP_RETURN);
 			else
 			{
-				compile_value_expr(script, exp->retx.value);
+				expr_t* value = strip_parens(exp->retx.value);
+
+				// NOTE: Every return is compiled on its own, so this catches
+				// the calls in tail position of every branch of an if.
+				// Tail calls to externs can't reuse the frame; they just call
+				// and fall through to the usual return below.
+				if(value->type == EXP_CALL)
+				{
+					compile_call(script, value, 1);
+					append_code(script, OP_PUSH_RETVAL);
+				}
+				else
+					compile_value_expr(script, exp->retx.value);
+
 				append_code(script, OP_RETURN_VALUE);
 			}
 		} break;
 		
 		case EXP_IF:
 		{
-			compile_value_expr(script, exp->ifx.cond);
-			
-			append_code(script, OP_GOTOZ);
-			int loc = script->code.length;
-			append_int(script, 0);
+			int loc = compile_cond_jump(script, exp->ifx.cond);
 			
 			compile_expr(script, exp->ifx.body);
 			
@@ -4025,11 +4632,7 @@ static void compile_expr(script_t* script, expr_t* exp)
 		case EXP_WHILE:
 		{
 			int jump = script->code.length;
-			compile_value_expr(script, exp->whilex.cond);
-			
-			append_code(script, OP_GOTOZ);
-			int loc = script->code.length;
-			append_int(script, 0);
+			int loc = compile_cond_jump(script, exp->whilex.cond);
 			
 			compile_expr(script, exp->whilex.body);
 			append_code(script, OP_GOTO);
@@ -4042,11 +4645,7 @@ static void compile_expr(script_t* script, expr_t* exp)
 		{
 			compile_expr(script, exp->forx.init);
 			int jump = script->code.length;
-			compile_value_expr(script, exp->forx.cond);
-
-			append_code(script, OP_GOTOZ);
-			int loc = script->code.length;
-			append_int(script, 0);
+			int loc = compile_cond_jump(script, exp->forx.cond);
 
 			compile_expr(script, exp->forx.body);
 			compile_expr(script, exp->forx.step);
@@ -4065,12 +4664,46 @@ static void compile_expr(script_t* script, expr_t* exp)
 			
 			vec_set(&script->function_pcs, exp->funcx.decl->index, &script->code.length);
 			
-			for(int i = 0; i < exp->funcx.decl->locals.length; ++i)
-				append_code(script, OP_PUSH_NULL);
-			
-			compile_expr(script, exp->funcx.body);
+			if(script->codegen == SCRIPT_CODEGEN_REGISTER)
+			{
+				char enabled = g_reg_enabled;
+				int first_temp = g_reg_first_temp;
+				int num_temps = g_reg_num_temps;
+				int max_temps = g_reg_max_temps;
+
+				g_reg_enabled = 1;
+				g_reg_first_temp = exp->funcx.decl->locals.length;
+				g_reg_num_temps = 0;
+				g_reg_max_temps = 0;
+
+				// NOTE: The number of temporaries is only known once the body
+				// has been compiled, so the count is patched in afterwards
+				append_code(script, OP_RESERVE);
+				int reserve_loc = script->code.length;
+				append_int(script, 0);
+
+				compile_expr(script, exp->funcx.body);
+
+				patch_int(script, reserve_loc, exp->funcx.decl->locals.length + g_reg_max_temps);
+
+				g_reg_enabled = enabled;
+				g_reg_first_temp = first_temp;
+				g_reg_num_temps = num_temps;
+				g_reg_max_temps = max_temps;
+			}
+			else
+			{
+				for(int i = 0; i < exp->funcx.decl->locals.length; ++i)
+					append_code(script, OP_PUSH_NULL);
+				
+				compile_expr(script, exp->funcx.body);
+			}
 			
 			append_code(script, OP_RETURN);
+
+			int stack_size = get_stack_size(script, vec_get_value(&script->function_pcs, exp->funcx.decl->index, int), script->code.length);
+			vec_set(&script->function_stack_sizes, exp->funcx.decl->index, &stack_size);
+
 			patch_int(script, loc, script->code.length);
 		} break;
 		
@@ -4079,16 +4712,34 @@ static void compile_expr(script_t* script, expr_t* exp)
 			if(exp->binx.op != TOK_ASSIGN)
 				error_exit_e(exp, "Value expression used in non-value context\n");
 			
+			if(g_reg_enabled && exp->binx.lhs->type == EXP_VAR && is_reg_direct(exp->binx.lhs))
+			{
+				int dest = exp->binx.lhs->varx.decl->index;
+				expr_t* rhs = strip_parens(exp->binx.rhs);
+
+				// NOTE: Compiling straight into the local saves the SETLOCAL
+				if(get_reg_op(rhs) >= 0 && get_reg_savings(rhs) >= -1)
+				{
+					compile_reg_expr(script, rhs, dest);
+					break;
+				}
+				
+				if(rhs->type == EXP_VAR && is_reg_direct(rhs))
+				{
+					append_code(script, OP_REG_MOVE);
+					append_int(script, dest);
+					append_int(script, rhs->varx.decl->index);
+					break;
+				}
+			}
+			
 			compile_value_expr(script, exp->binx.rhs);
 			compile_assign(script, exp->binx.lhs);
 		} break;
 		
 		case EXP_CALL:
 		{
-			compile_call(script, exp);
-			
-			// NOTE: because branching
-			compile_file_line_info(script, exp, 1);
+			compile_call(script, exp, 0);
 		} break;
 		
 		case EXP_WRITE:
@@ -4104,10 +4755,7 @@ static void compile_expr(script_t* script, expr_t* exp)
 
 static void allocate_globals(script_t* script)
 {
-	static script_value_t null_val;
-	null_val.type = VAL_NULL;
-
-	script_value_t* pv = &null_val;
+	script_value_t null_value = NULL_VALUE;
 
 	int num_globals = 0;
 	for (int i = 0; i < script->modules.length; ++i)
@@ -4116,7 +4764,7 @@ static void allocate_globals(script_t* script)
 		num_globals += module->globals.length;
 	}
 
-	vec_resize(&script->globals, num_globals, &pv);
+	vec_resize(&script->globals, num_globals, &null_value);
 }
 
 void script_bind_extern(script_t* script, const char* name, script_extern_t ext)
@@ -4124,13 +4772,90 @@ void script_bind_extern(script_t* script, const char* name, script_extern_t ext)
 	char* name_copy = estrdup(name);
 	vec_push_back(&script->extern_names, &name_copy);
 	vec_push_back(&script->externs, &ext);
+
+	char* signature = NULL;
+	script_typed_extern_t typed = NULL;
+
+	vec_push_back(&script->extern_signatures, &signature);
+	vec_push_back(&script->typed_externs, &typed);
+}
+
+void script_bind_extern_typed(script_t* script, const char* name, script_typed_extern_t ext, const char* signature)
+{
+	const char* ret = strchr(signature, '>');
+	
+	if(!ret || ret - signature > SCRIPT_MAX_TYPED_ARGS || strspn(signature, "nbcsp") != (size_t)(ret - signature) ||
+	   strlen(ret) != 2 || !strchr("nbcspv", ret[1]))
+		error_exit("Invalid signature '%s' for extern '%s'\n", signature, name);
+
+	script_bind_extern(script, name, NULL);
+
+	char* signature_copy = estrdup(signature);
+	vec_set(&script->extern_signatures, script->externs.length - 1, &signature_copy);
+	vec_set(&script->typed_externs, script->externs.length - 1, &ext);
+}
+
+// NOTE: Signature character for a type tag (see script_bind_extern_typed)
+static char get_signature_char(type_tag_t* tag)
+{
+	switch(tag->type)
+	{
+		case TAG_VOID: return 'v';
+		case TAG_BOOL: return 'b';
+		case TAG_CHAR: return 'c';
+		case TAG_NUMBER: return 'n';
+		case TAG_STRING: return 's';
+		case TAG_NATIVE: return 'p';
+		default: return '?';
+	}
+}
+
+// NOTE: Typed externs are called with their arguments unboxed straight
+// from the stack, so their declarations have to agree with how they were bound
+static void check_extern_signature(script_t* script, expr_t* exp)
+{
+	func_decl_t* decl = exp->extern_decl;
+	const char* signature = vec_get_value(&script->extern_signatures, decl->index, char*);
+
+	if(!signature) return;
+
+	vector_t* arg_types = &decl->tag->func.arg_types;
+	char match = strchr(signature, '>') - signature == arg_types->length;
+
+	for(int i = 0; match && i < arg_types->length; ++i)
+		match = get_signature_char(vec_get_value(arg_types, i, type_tag_t*)) == signature[i];
+
+	if(!match || get_signature_char(decl->tag->func.return_type) != signature[arg_types->length + 1])
+		error_defer_e(exp, "Declaration of extern '%s' doesn't match the signature it was bound with (%s)\n", decl->name, signature);
 }
 
 // DEFAULT EXTERNS
 
-static script_value_t* new_value(script_t* script, script_value_type_t type);
+static script_object_t* new_object(script_t* script, script_value_type_t type);
+static void account_payload(script_t* script, script_object_t* obj);
+static void account_growth(script_t* script, script_object_t* obj, size_t bytes);
+static inline int get_frame_base(script_t* script);
+static inline void lower_stack_mark(script_t* script, int index);
+static script_value_t new_native_value(script_t* script, void* value, script_native_callback_t on_mark, script_native_callback_t on_delete);
 
-static void push_value(script_t* script, script_value_t* val);
+static void push_value(script_t* script, script_value_t val);
+
+// NOTE: Pushes val onto the end of the array or struct the handle refers
+// to; for building up values in externs which can collect (see
+// script_handle_scope_open)
+static void append_to_handle(script_t* script, script_handle_t handle, script_value_t val)
+{
+	script_value_t container = script_get_handle(script, handle);
+	script_object_t* obj = AS_OBJECT(container);
+
+	vector_t* values = obj->type == VAL_ARRAY ? obj->array : &obj->ds->members;
+	size_t capacity = values->capacity;
+
+	script_write_barrier(script, container, val);
+	vec_push_back(values, &val);
+
+	account_growth(script, obj, (values->capacity - capacity) * sizeof(script_value_t));
+}
 
 // NOTE: Description format
 // b = char										-> bool
@@ -4144,7 +4869,7 @@ static void push_value(script_t* script, script_value_t* val);
 // p{any of the above} = struct	*				-> dynamic (a struct but retrieved from a pointer in mem)
 // [any *one* of the above]	= vector_t of any	-> array-dynamic
 // & = void*									-> native (stores the current address in memory)
-static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pmem)
+static script_value_t unmarshal(script_t* script, const char** pdesc, char** pmem)
 {
 #define ALIGN(m, type) (*m = (char*)((intptr_t)(*m) + (ALIGNOF(type) - 1) & -ALIGNOF(type)))
 #define ALIGNOF(type) ((size_t)&((struct { char c; type d; } *)0)->d)
@@ -4157,9 +4882,7 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 		{
 			ALIGN(pmem, char);
 				
-			script_value_t* val = new_value(script, VAL_BOOL);
-
-			val->boolean = (char)*(char*)(*pmem);
+			script_value_t val = BOOL_VALUE(*(char*)(*pmem));
 
 			*pmem += sizeof(char);
 			*pdesc += 1;
@@ -4171,8 +4894,7 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 		{
 			ALIGN(pmem, int);
 
-			script_value_t* val = new_value(script, VAL_NUMBER);
-			val->number = (double)*(int*)(*pmem);
+			script_value_t val = number_value((double)*(int*)(*pmem));
 
 			*pmem += sizeof(int);
 			*pdesc += 1;
@@ -4184,8 +4906,7 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 		{
 			ALIGN(pmem, double);
 
-			script_value_t* val = new_value(script, VAL_NUMBER);
-			val->number = *(double*)(*pmem);
+			script_value_t val = number_value(*(double*)(*pmem));
 
 			*pmem += sizeof(double);
 			*pdesc += 1;
@@ -4202,19 +4923,20 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 			*pdesc += 1;
 
 			if (!str)
-				return new_value(script, VAL_NULL);
+				return NULL_VALUE;
 			else
 			{
-				script_value_t* val = new_value(script, VAL_STRING);
+				script_object_t* obj = new_object(script, VAL_STRING);
 
-				val->string.length = strlen(str);
-				val->string.data = emalloc(val->string.length + 1);
+				obj->string.length = strlen(str);
+				obj->string.data = emalloc(obj->string.length + 1);
 
-				strcpy(val->string.data, str);
+				strcpy(obj->string.data, str);
+				account_payload(script, obj);
 
 				*pmem += sizeof(const char*);
 
-				return val;
+				return OBJECT_VALUE(obj);
 			}
 		} break;
 
@@ -4236,8 +4958,7 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 
 			if (n == 1)
 			{
-				script_value_t* val = new_value(script, VAL_CHAR);
-				val->code = *(char*)(*pmem);
+				script_value_t val = CHAR_VALUE(*(char*)(*pmem));
 
 				*pmem += 1;
 
@@ -4245,19 +4966,20 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 			}
 			else if (n > 1)
 			{
-				script_value_t* val = new_value(script, VAL_STRING);
+				script_object_t* obj = new_object(script, VAL_STRING);
 
 				// TODO: Maybe check for buffer overflow etc
 				const char* str = (const char*)(*pmem);
 
-				val->string.length = strlen(str);
-				val->string.data = emalloc(n);
+				obj->string.length = strlen(str);
+				obj->string.data = emalloc(n);
 
-				strcpy(val->string.data, str);
+				strcpy(obj->string.data, str);
+				account_payload(script, obj);
 
 				*pmem += n;
 
-				return val;
+				return OBJECT_VALUE(obj);
 			}
 
 			assert(0);
@@ -4273,22 +4995,19 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 				if (*pmem)
 				{
 					char* mem = *(char**)(*pmem);
-					script_value_t* val = unmarshal(script, pdesc, &mem);
+					script_value_t val = unmarshal(script, pdesc, &mem);
 					return val;
 				}
 
 				*pmem += sizeof(char*);
 
-				return new_value(script, VAL_NULL);
+				return NULL_VALUE;
 			}
 			else
 			{
 				ALIGN(pmem, void*);
 
-				script_value_t* val = new_value(script, VAL_NATIVE);
-
-				val->nat.value = *(void**)(*pmem);
-				val->nat.on_mark = val->nat.on_delete = NULL;
+				script_value_t val = new_native_value(script, *(void**)(*pmem), NULL, NULL);
 					
 				*pmem += sizeof(void*);
 				*pdesc += 1;
@@ -4314,7 +5033,7 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 				{
 					printf("'unmarshal' exceeded maximum description length.\n");
 					*pdesc += i + 1;
-					return new_value(script, VAL_NULL);
+					return NULL_VALUE;
 				}
 				
 				if (desc[i] == '{' || desc[i] == '[')
@@ -4332,18 +5051,20 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 
 			char* ndp = nestedDesc;
 
+			// NOTE: Unmarshalling the members can collect so the result is
+			// only ever looked at through a handle
+			script_handle_scope_t scope = script_handle_scope_open(script);
+			script_handle_t result;
+
 			if (!is_array)
 			{
-				script_value_t* result = new_value(script, VAL_STRUCT_INSTANCE);
-				vec_init(&result->ds.members, sizeof(script_value_t*));
+				script_object_t* obj = new_object(script, VAL_STRUCT_INSTANCE);
+				vec_init(&obj->ds->members, sizeof(script_value_t));
 
-				while(*ndp)
-				{
-					script_value_t* val = unmarshal(script, &ndp, pmem);
-					vec_push_back(&result->ds.members, &val);
-				}
+				result = script_new_handle(script, OBJECT_VALUE(obj));
 
-				return result;
+				while(*ndp)
+					append_to_handle(script, result, unmarshal(script, &ndp, pmem));
 			}
 			else
 			{
@@ -4351,29 +5072,30 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 
 				vector_t* vec = (vector_t*)(*pmem);
 
-				script_value_t* result = new_value(script, VAL_ARRAY);
-				vec_init(&result->array, sizeof(script_value_t*));
+				script_object_t* obj = new_object(script, VAL_ARRAY);
+				vec_init(obj->array, sizeof(script_value_t));
+
+				result = script_new_handle(script, OBJECT_VALUE(obj));
 
 				for(int i = 0; i < vec->length; ++i)
 				{
 					void* mem = vec_get(vec, i);
 
-					script_value_t* val = unmarshal(script, &ndp, &mem);
-					vec_push_back(&result->array, &val);
+					append_to_handle(script, result, unmarshal(script, &ndp, &mem));
 
 					ndp = nestedDesc;
 				}
-
-				return result;
 			}
+
+			script_value_t val = script_get_handle(script, result);
+			script_handle_scope_close(script, scope);
+
+			return val;
 		} break;
 
 		case '&':
 		{
-			script_value_t* val = new_value(script, VAL_NATIVE);
-
-			val->nat.value = *pmem;
-			val->nat.on_mark = val->nat.on_delete = NULL;
+			script_value_t val = new_native_value(script, *pmem, NULL, NULL);
 
 			*pdesc += 1;
 
@@ -4384,41 +5106,36 @@ static script_value_t* unmarshal(script_t* script, const char** pdesc, char** pm
 #undef ALIGNOF
 #undef ALIGN
 
-	return NULL;
+	return NULL_VALUE;
 }
 
 static void ext_unmarshal(script_t* script, vector_t* args)
 {
-	script_value_t* desc_val = script_get_arg(args, 0);
-	script_value_t* mem_val = script_get_arg(args, 1);
+	script_value_t desc_val = script_get_arg(args, 0);
+	script_value_t mem_val = script_get_arg(args, 1);
 
-	const char* desc = desc_val->string.data;
-	char* mem = (char*)mem_val->nat.value;
+	const char* desc = script_to_string(desc_val).data;
+	char* mem = (char*)script_to_native(mem_val)->value;
 	
-	script_value_t* val = unmarshal(script, &desc, &mem);
-	if (!val)
-	{
-		script_push_null(script);
-		script_return_top(script);
-	}
-	else
-	{
-		push_value(script, val);
-		script_return_top(script);
-	}
+	// NOTE: desc and mem don't move when the heap is collected
+	script_handle_scope_t scope = script_handle_scope_open(script);
+
+	push_value(script, unmarshal(script, &desc, &mem));
+
+	script_handle_scope_close(script, scope);
+	script_return_top(script);
 }
 
-static void pop_call_record(script_t* script);
 static void ext_debug_break(script_t* script, vector_t* args)
 {
-	// NOTE: HACK: pop call record off because we want to be
+	// NOTE: HACK: hide this extern's frame because we want to be
 	// in the scope of the enclosing function
-	script_call_record_t record = vec_get_value(&script->call_records, script->call_records.length - 1, script_call_record_t);
-	pop_call_record(script);
+	--script->frame_count;
+	lower_stack_mark(script, get_frame_base(script));
 
 	debug_script(script);
 	
-	vec_push_back(&script->call_records, &record);
+	++script->frame_count;
 }
 
 // NOTE: Fancy compile-time externs
@@ -4430,11 +5147,11 @@ static void ext_debug_break(script_t* script, vector_t* args)
 
 static void ext_add_module(script_t* script, vector_t* args)
 {
-	script_value_t* name_val = script_get_arg(args, 0);
-	script_value_t* code_val = script_get_arg(args, 1);
+	script_value_t name_val = script_get_arg(args, 0);
+	script_value_t code_val = script_get_arg(args, 1);
 	
-	const char* name = name_val->string.data;
-	const char* code = code_val->string.data;
+	const char* name = script_to_string(name_val).data;
+	const char* code = script_to_string(code_val).data;
 	
 	script_parse_code(script, code, NULL, name);
 	script_push_number(script, script->modules.length - 1);
@@ -4443,11 +5160,11 @@ static void ext_add_module(script_t* script, vector_t* args)
 
 static void ext_load_module(script_t* script, vector_t* args)
 {
-	script_value_t* name_val = script_get_arg(args, 0);
-	script_value_t* path_val = script_get_arg(args, 1);
+	script_value_t name_val = script_get_arg(args, 0);
+	script_value_t path_val = script_get_arg(args, 1);
 
-	const char* name = name_val->string.data;
-	const char* path = path_val->string.data;
+	const char* name = script_to_string(name_val).data;
+	const char* path = script_to_string(path_val).data;
 
 	script_load_parse_file(script, path, name);
 	script_push_number(script, script->modules.length - 1);
@@ -4459,8 +5176,8 @@ static void ext_compile_module(script_t* script, vector_t* args)
 {
 	append_code(script, OP_HALT);
 	
-	script_value_t* idx_val = script_get_arg(args, 0);
-	int module_index = (int)idx_val->number;
+	script_value_t idx_val = script_get_arg(args, 0);
+	int module_index = (int)script_to_number(idx_val);
 	
 	script_module_t* module = vec_get(&script->modules, module_index);
 	compile_module(script, module);
@@ -4468,8 +5185,8 @@ static void ext_compile_module(script_t* script, vector_t* args)
 
 static void ext_run_module(script_t* script, vector_t* args)
 {
-	script_value_t* idx_val = script_get_arg(args, 0);
-	int module_index = (int)idx_val->number;
+	script_value_t idx_val = script_get_arg(args, 0);
+	int module_index = (int)script_to_number(idx_val);
 	
 	script_module_t* module = vec_get(&script->modules, module_index);
 
@@ -4477,9 +5194,10 @@ static void ext_run_module(script_t* script, vector_t* args)
 		error_exit_script(script, "Attempting to run an uncompiled module '%s'\n", module->name);
 
 	int pc = script->pc;
-	script->pc = module->start_pc;
+	int end_pc = get_linked_pc(script, module->end_pc);
+	script->pc = get_linked_pc(script, module->start_pc);
 	
-	while (script->pc >= 0 && script->pc < module->end_pc)
+	while (script->pc >= 0 && script->pc < end_pc)
 		script_execute_cycle(script);
 
 	script->pc = pc;
@@ -4489,14 +5207,15 @@ static void ext_get_current_module_index(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_current_module_index");
 	script_push_number(script, g_cur_module_index);
+	script_return_top(script);
 }
 
 static void ext_get_module_source_code(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_module_source_code");
 	
-	script_value_t* val = script_get_arg(args, 0);
-	int module_index = (int)val->number;
+	script_value_t val = script_get_arg(args, 0);
+	int module_index = (int)script_to_number(val);
 	
 	script_module_t* module = vec_get(&script->modules, module_index);
 	script_push_cstr(script, module->source_code);
@@ -4507,16 +5226,22 @@ static void ext_get_module_expr_list(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_module_expr_list");
 	
-	script_value_t* val = script_get_arg(args, 0);
-	script_value_t* flatten_val = script_get_arg(args, 1);
+	script_value_t val = script_get_arg(args, 0);
+	script_value_t flatten_val = script_get_arg(args, 1);
 
-	int module_index = (int)val->number;
-	char flatten = flatten_val->boolean;
+	int module_index = (int)script_to_number(val);
+	char flatten = script_to_bool(flatten_val);
 
 	script_module_t* module = vec_get(&script->modules, module_index);
-	vector_t expr_list;
 
-	vec_init(&expr_list, sizeof(script_value_t*));	
+	// NOTE: Creating the natives can collect, so the list they go into has
+	// to be rooted
+	script_handle_scope_t scope = script_handle_scope_open(script);
+
+	script_object_t* obj = new_object(script, VAL_ARRAY);
+	vec_init(obj->array, sizeof(script_value_t));
+
+	script_handle_t expr_list = script_new_handle(script, OBJECT_VALUE(obj));
 
 	for(int i = 0; i < module->expr_list.length; ++i)
 	{
@@ -4528,30 +5253,20 @@ static void ext_get_module_expr_list(script_t* script, vector_t* args)
 			flatten_expr(&flat, vec_get_value(&module->expr_list, i, expr_t*));
 
 			for (int i = 0; i < flat.length; ++i)
-			{
-				script_value_t* exp_val = new_value(script, VAL_NATIVE);
-
-				exp_val->nat.value = vec_get_value(&flat, i, expr_t*);
-				exp_val->nat.on_mark = exp_val->nat.on_delete = NULL;
-
-				vec_push_back(&expr_list, &exp_val);
-			}
+				append_to_handle(script, expr_list, new_native_value(script, vec_get_value(&flat, i, expr_t*), NULL, NULL));
 
 			vec_destroy(&flat);
 		}
 		else
 		{
 			// TODO: make script_create_native, et al and use those instead
-			script_value_t* exp_val = new_value(script, VAL_NATIVE);
-
-			exp_val->nat.value = vec_get_value(&module->expr_list, i, expr_t*);
-			exp_val->nat.on_mark = exp_val->nat.on_delete = NULL;
-
-			vec_push_back(&expr_list, &exp_val);
+			append_to_handle(script, expr_list, new_native_value(script, vec_get_value(&module->expr_list, i, expr_t*), NULL, NULL));
 		}
 	}
 
-	script_push_premade_array(script, expr_list);
+	push_value(script, script_get_handle(script, expr_list));
+	script_handle_scope_close(script, scope);
+
 	script_return_top(script);
 }
 
@@ -4561,9 +5276,9 @@ static void ext_parse_code(script_t* script, vector_t* args)
 	EXT_CHECK_IF_CT("parse_code");
 	
 	script_module_t* module = vec_get(&script->modules, g_cur_module_index);
-	script_value_t* code_val = script_get_arg(args, 0);
+	script_value_t code_val = script_get_arg(args, 0);
 	
-	const char* code = code_val->string.data;
+	const char* code = script_to_string(code_val).data;
 
 	g_file = "parse_code";
 	g_code = code;
@@ -4574,26 +5289,26 @@ static void ext_parse_code(script_t* script, vector_t* args)
 
 	parse_program(script, &expr_list);
 
-	vector_t expr_nat_list;
-	vec_init(&expr_nat_list, sizeof(script_value_t*));
+	// NOTE: Creating the natives can collect (code_val isn't used after this)
+	script_handle_scope_t scope = script_handle_scope_open(script);
+
+	script_object_t* obj = new_object(script, VAL_ARRAY);
+	vec_init(obj->array, sizeof(script_value_t));
+
+	script_handle_t expr_nat_list = script_new_handle(script, OBJECT_VALUE(obj));
 
 	for (int i = 0; i < expr_list.length; ++i)
 	{
 		expr_t* exp = vec_get_value(&expr_list, i, expr_t*);
 
-		script_value_t* val = new_value(script, VAL_NATIVE);
-		
-		val->nat.on_mark = NULL;
-		val->nat.on_delete = NULL;
-		
-		val->nat.value = exp;
-
-		vec_push_back(&expr_nat_list, &val);
+		append_to_handle(script, expr_nat_list, new_native_value(script, exp, NULL, NULL));
 	}
 
 	vec_destroy(&expr_list);
 
-	script_push_premade_array(script, expr_nat_list);
+	push_value(script, script_get_handle(script, expr_nat_list));
+	script_handle_scope_close(script, scope);
+
 	script_return_top(script);
 }
 
@@ -4601,8 +5316,8 @@ static void ext_get_expr_kind(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_expr_kind");
 	
-	script_value_t* exp_val = script_get_arg(args, 0);
-	expr_t* exp = exp_val->nat.value;
+	script_value_t exp_val = script_get_arg(args, 0);
+	expr_t* exp = script_to_native(exp_val)->value;
 	
 	script_push_number(script, exp->type);
 	script_return_top(script);
@@ -4612,8 +5327,8 @@ static void ext_make_num_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_num_expr");
 	
-	script_value_t* val = script_get_arg(args, 0);
-	double number = val->number;
+	script_value_t val = script_get_arg(args, 0);
+	double number = script_to_number(val);
 	
 	expr_t* exp = create_expr(EXP_NUMBER);
 	exp->number_index = register_number(script, number);
@@ -4626,8 +5341,8 @@ static void ext_make_string_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_num_expr");
 	
-	script_value_t* val = script_get_arg(args, 0);
-	const char* string = val->string.data;
+	script_value_t val = script_get_arg(args, 0);
+	const char* string = script_to_string(val).data;
 	
 	expr_t* exp = create_expr(EXP_STRING);
 	exp->string_index = register_string(script, string);
@@ -4640,10 +5355,10 @@ static void ext_make_write_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_write_expr");
 	
-	script_value_t* val = script_get_arg(args, 0);
+	script_value_t val = script_get_arg(args, 0);
 	
 	expr_t* exp = create_expr(EXP_WRITE);
-	exp->write = val->nat.value;
+	exp->write = script_to_native(val)->value;
 	
 	script_push_native(script, exp, NULL, NULL);
 	script_return_top(script); 
@@ -4653,6 +5368,7 @@ static void ext_create_bool_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_bool_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 	
@@ -4664,6 +5380,7 @@ static void ext_create_char_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_char_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4675,6 +5392,7 @@ static void ext_create_number_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_number_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4686,6 +5404,7 @@ static void ext_create_string_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_string_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4697,11 +5416,12 @@ static void ext_create_array_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_array_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
-	script_value_t* contained_val = script_get_arg(args, 0);
-	type_tag_t* contained = contained_val->nat.value;
+	script_value_t contained_val = script_get_arg(args, 0);
+	type_tag_t* contained = script_to_native(contained_val)->value;
 	
 	type_tag_t* array = create_type_tag(script, TAG_ARRAY);
 	array->contained = contained;
@@ -4714,18 +5434,19 @@ static void ext_create_function_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_function_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
-	script_value_t* return_type_val = script_get_arg(args, 0);
-	script_value_t* arg_types_val = script_get_arg(args, 1);
+	script_value_t return_type_val = script_get_arg(args, 0);
+	script_value_t arg_types_val = script_get_arg(args, 1);
 	
 	type_tag_t* tag = create_type_tag(script, TAG_FUNC);
-	tag->func.return_type = return_type_val->nat.value;
-	for(int i = 0; i < arg_types_val->array.length; ++i)
+	tag->func.return_type = script_to_native(return_type_val)->value;
+	for(int i = 0; i < script_to_array(arg_types_val)->length; ++i)
 	{
-		script_value_t* arg_type_val = vec_get_value(&arg_types_val->array, i, script_value_t*);
-		type_tag_t* arg_tag = arg_type_val->nat.value;
+		script_value_t arg_type_val = vec_get_value(script_to_array(arg_types_val), i, script_value_t);
+		type_tag_t* arg_tag = script_to_native(arg_type_val)->value;
 		
 		vec_push_back(&tag->func.arg_types, &arg_tag);
 	}
@@ -4738,6 +5459,7 @@ static void ext_create_native_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_native_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4749,6 +5471,7 @@ static void ext_create_dynamic_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_dynamic_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4760,6 +5483,7 @@ static void ext_create_void_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("create_void_type");
 
+	update_source_position(script);
 	g_file = script->cur_file;
 	g_line = script->cur_line;
 
@@ -4769,11 +5493,11 @@ static void ext_create_void_type(script_t* script, vector_t* args)
 
 static void ext_compare_types(script_t* script, vector_t* args)
 {
-	script_value_t* a_val = script_get_arg(args, 0);
-	script_value_t* b_val = script_get_arg(args, 1);
+	script_value_t a_val = script_get_arg(args, 0);
+	script_value_t b_val = script_get_arg(args, 1);
 	
-	type_tag_t* a = a_val->nat.value;
-	type_tag_t* b = b_val->nat.value;
+	type_tag_t* a = script_to_native(a_val)->value;
+	type_tag_t* b = script_to_native(b_val)->value;
 
 	script_push_bool(script, compare_type_tags(a, b));
 	script_return_top(script);
@@ -4783,8 +5507,8 @@ static void ext_get_array_type_contained_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_array_type_contained_type");
 
-	script_value_t* type_val = script_get_arg(args, 0);
-	type_tag_t* array_tag = type_val->nat.value;
+	script_value_t type_val = script_get_arg(args, 0);
+	type_tag_t* array_tag = script_to_native(type_val)->value;
 
 	script_push_native(script, array_tag->contained, NULL, NULL);
 	script_return_top(script);
@@ -4794,8 +5518,8 @@ static void ext_reference_func(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("reference_func");
 	
-	script_value_t* name_val = script_get_arg(args, 0);
-	const char* name = name_val->string.data;
+	script_value_t name_val = script_get_arg(args, 0);
+	const char* name = script_to_string(name_val).data;
 	
 	func_decl_t* decl = reference_function(script, name);
 	if(decl)
@@ -4809,8 +5533,8 @@ static void ext_get_func_decl_name(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_func_decl_name");
 	
-	script_value_t* decl_val = script_get_arg(args, 0);
-	func_decl_t* decl = decl_val->nat.value;
+	script_value_t decl_val = script_get_arg(args, 0);
+	func_decl_t* decl = script_to_native(decl_val)->value;
 	
 	script_push_cstr(script, decl->name);
 	script_return_top(script);
@@ -4820,20 +5544,20 @@ static void ext_declare_variable(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("declare_variable");
 	
-	script_value_t* name_val = script_get_arg(args, 0);
-	script_value_t* type_val = script_get_arg(args, 1);
-	script_value_t* func_decl_val = script_get_arg(args, 2);
-	script_value_t* scope_val = script_get_arg(args, 3);
+	script_value_t name_val = script_get_arg(args, 0);
+	script_value_t type_val = script_get_arg(args, 1);
+	script_value_t func_decl_val = script_get_arg(args, 2);
+	script_value_t scope_val = script_get_arg(args, 3);
 	
-	const char* name = name_val->string.data;
-	type_tag_t* tag = type_val->nat.value;
+	const char* name = script_to_string(name_val).data;
+	type_tag_t* tag = script_to_native(type_val)->value;
 	func_decl_t* decl = NULL;
 	int scope = 0;
 	
-	if(func_decl_val->type != VAL_NULL)
+	if(script_get_type(func_decl_val) != VAL_NULL)
 	{
-		decl = func_decl_val->nat.value;
-		scope = (int)scope_val->number;
+		decl = script_to_native(func_decl_val)->value;
+		scope = (int)script_to_number(scope_val);
 	}
 
 	g_cur_func = decl;
@@ -4847,18 +5571,18 @@ static void ext_reference_variable(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("reference_variable");
 	
-	script_value_t* name_val = script_get_arg(args, 0);
-	script_value_t* func_decl_val = script_get_arg(args, 1);
-	script_value_t* scope_val = script_get_arg(args, 2);
+	script_value_t name_val = script_get_arg(args, 0);
+	script_value_t func_decl_val = script_get_arg(args, 1);
+	script_value_t scope_val = script_get_arg(args, 2);
 	
-	const char* name = name_val->string.data;
+	const char* name = script_to_string(name_val).data;
 	func_decl_t* decl = NULL;
 	int scope = 0;
 	
-	if(func_decl_val->type != VAL_NULL)
+	if(script_get_type(func_decl_val) != VAL_NULL)
 	{
-		decl = func_decl_val->nat.value;
-		scope = (int)scope_val->number;
+		decl = script_to_native(func_decl_val)->value;
+		scope = (int)script_to_number(scope_val);
 	}
 
 	g_cur_func = decl;
@@ -4876,8 +5600,8 @@ static void ext_get_expr_type(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_expr_type");
 
-	script_value_t* exp_val = script_get_arg(args, 0);
-	expr_t* exp = exp_val->nat.value;
+	script_value_t exp_val = script_get_arg(args, 0);
+	expr_t* exp = script_to_native(exp_val)->value;
 
 	// TODO: make script_create_native etc
 	script_push_native(script, exp->tag, NULL, NULL);
@@ -4888,8 +5612,8 @@ static void ext_get_var_expr_name(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_var_expr_name");
 
-	script_value_t* exp_val = script_get_arg(args, 0);
-	expr_t* exp = exp_val->nat.value;
+	script_value_t exp_val = script_get_arg(args, 0);
+	expr_t* exp = script_to_native(exp_val)->value;
 
 	script_push_cstr(script, exp->varx.name);
 	script_return_top(script);
@@ -4899,8 +5623,8 @@ static void ext_resolve_expr_symbols(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("resolve_expr_symbols");
 
-	script_value_t* exp_val = script_get_arg(args, 0);
-	resolve_symbols(script, exp_val->nat.value);
+	script_value_t exp_val = script_get_arg(args, 0);
+	resolve_symbols(script, script_to_native(exp_val)->value);
 
 	script_push_bool(script, !g_has_error);
 	g_has_error = 0;
@@ -4911,8 +5635,8 @@ static void ext_resolve_expr_types(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("resolve_expr_types");
 
-	script_value_t* exp_val = script_get_arg(args, 0);
-	resolve_type_tags(script, exp_val->nat.value);
+	script_value_t exp_val = script_get_arg(args, 0);
+	resolve_type_tags(script, script_to_native(exp_val)->value);
 	
 	script_push_bool(script, !g_has_error);
 	g_has_error = 0;
@@ -4923,8 +5647,8 @@ static void ext_make_var_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_var_expr");
 	
-	script_value_t* decl_val = script_get_arg(args, 0);
-	var_decl_t* decl = decl_val->nat.value;
+	script_value_t decl_val = script_get_arg(args, 0);
+	var_decl_t* decl = script_to_native(decl_val)->value;
 	
 	expr_t* exp = create_expr(EXP_VAR);
 	
@@ -4939,11 +5663,11 @@ static void ext_make_undeclared_var_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_undeclared_var_expr");
 	
-	script_value_t* name_val = script_get_arg(args, 0);
+	script_value_t name_val = script_get_arg(args, 0);
 	expr_t* exp = create_expr(EXP_VAR);
 	
 	exp->varx.decl = NULL;
-	exp->varx.name = estrdup(name_val->string.data);
+	exp->varx.name = estrdup(script_to_string(name_val).data);
 	
 	script_push_native(script, exp, NULL, NULL);
 	script_return_top(script);
@@ -4953,13 +5677,13 @@ static void ext_make_bin_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_bin_expr");
 	
-	script_value_t* lhs_val = script_get_arg(args, 0);
-	script_value_t* rhs_val = script_get_arg(args, 1);
-	script_value_t* op_val = script_get_arg(args, 2);
+	script_value_t lhs_val = script_get_arg(args, 0);
+	script_value_t rhs_val = script_get_arg(args, 1);
+	script_value_t op_val = script_get_arg(args, 2);
 
-	expr_t* lhs = lhs_val->nat.value;
-	expr_t* rhs = rhs_val->nat.value;
-	const char* op = op_val->string.data;
+	expr_t* lhs = script_to_native(lhs_val)->value;
+	expr_t* rhs = script_to_native(rhs_val)->value;
+	const char* op = script_to_string(op_val).data;
 	
 	expr_t* exp = create_expr(EXP_BINARY);
 	exp->binx.lhs = lhs;
@@ -4976,17 +5700,17 @@ static void ext_make_call_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_call_expr");
 	
-	script_value_t* func_val = script_get_arg(args, 0);
-	script_value_t* args_val = script_get_arg(args, 1);
+	script_value_t func_val = script_get_arg(args, 0);
+	script_value_t args_val = script_get_arg(args, 1);
 	
 	expr_t* exp = create_expr(EXP_CALL);
 	vec_init(&exp->callx.args, sizeof(expr_t*));
-	exp->callx.func = func_val->nat.value;
+	exp->callx.func = script_to_native(func_val)->value;
 	
-	for(int i = 0; i < args_val->array.length; ++i)
+	for(int i = 0; i < script_to_array(args_val)->length; ++i)
 	{
-		script_value_t* arg_exp_val = vec_get_value(&args_val->array, i, script_value_t*);
-		vec_push_back(&exp->callx.args, &arg_exp_val->nat.value);
+		script_value_t arg_exp_val = vec_get_value(script_to_array(args_val), i, script_value_t);
+		vec_push_back(&exp->callx.args, &script_to_native(arg_exp_val)->value);
 	}
 	
 	script_push_native(script, exp, NULL, NULL);
@@ -4997,12 +5721,12 @@ static void ext_make_array_index_expr(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("make_array_index_expr");
 	
-	script_value_t* array_exp_val = script_get_arg(args, 0);
-	script_value_t* index_exp_val = script_get_arg(args, 1);
+	script_value_t array_exp_val = script_get_arg(args, 0);
+	script_value_t index_exp_val = script_get_arg(args, 1);
 	
 	expr_t* exp = create_expr(EXP_ARRAY_INDEX);
-	exp->array_index.array = array_exp_val->nat.value;
-	exp->array_index.index = index_exp_val->nat.value;
+	exp->array_index.array = script_to_native(array_exp_val)->value;
+	exp->array_index.index = script_to_native(index_exp_val)->value;
 	
 	script_push_native(script, exp, NULL, NULL);
 	script_return_top(script);
@@ -5012,8 +5736,8 @@ static void ext_get_func_expr_decl(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("get_func_expr_decl");
 	
-	script_value_t* exp_val = script_get_arg(args, 0);
-	expr_t* exp = exp_val->nat.value;
+	script_value_t exp_val = script_get_arg(args, 0);
+	expr_t* exp = script_to_native(exp_val)->value;
 	
 	if(exp->type != EXP_FUNC) error_exit_script(script, "Passed non-func expression into 'get_func_expr_decl'\n");
 	
@@ -5025,11 +5749,11 @@ static void ext_add_expr_to_module(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("add_expr_to_module");
 	
-	script_value_t* mod_val = script_get_arg(args, 0);
-	script_value_t* exp_val = script_get_arg(args, 1);
+	script_value_t mod_val = script_get_arg(args, 0);
+	script_value_t exp_val = script_get_arg(args, 1);
 	
-	int module_index = (int)mod_val->number;
-	expr_t* exp = exp_val->nat.value;
+	int module_index = (int)script_to_number(mod_val);
+	expr_t* exp = script_to_native(exp_val)->value;
 	
 	script_module_t* module = vec_get(&script->modules, module_index);
 	vec_push_back(&module->expr_list, &exp);
@@ -5039,13 +5763,13 @@ static void ext_insert_expr_into_module(script_t* script, vector_t* args)
 {
 	EXT_CHECK_IF_CT("insert_expr_into_module");
 	
-	script_value_t* mod_val = script_get_arg(args, 0);
-	script_value_t* exp_val = script_get_arg(args, 1);
-	script_value_t* loc_val = script_get_arg(args, 2);
+	script_value_t mod_val = script_get_arg(args, 0);
+	script_value_t exp_val = script_get_arg(args, 1);
+	script_value_t loc_val = script_get_arg(args, 2);
 	
-	int module_index = (int)mod_val->number;
-	expr_t* exp = exp_val->nat.value;
-	int location = (int)loc_val->number;
+	int module_index = (int)script_to_number(mod_val);
+	expr_t* exp = script_to_native(exp_val)->value;
+	int location = (int)script_to_number(loc_val);
 	
 	script_module_t* module = vec_get(&script->modules, module_index);
 	vec_insert(&module->expr_list, &exp, location);
@@ -5053,12 +5777,12 @@ static void ext_insert_expr_into_module(script_t* script, vector_t* args)
 
 static void ext_make_array_of_length(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	int length = (int)val->number;
+	script_value_t val = script_get_arg(args, 0);
+	int length = (int)script_to_number(val);
 	
 	vector_t array;
-	vec_init(&array, sizeof(script_value_t*));
-	script_value_t* null_value = NULL;
+	vec_init(&array, sizeof(script_value_t));
+	script_value_t null_value = NULL_VALUE;
 	vec_resize(&array, length, &null_value);
 	
 	script_push_premade_array(script, array);
@@ -5067,22 +5791,24 @@ static void ext_make_array_of_length(script_t* script, vector_t* args)
 
 static void ext_array_push(script_t* script, vector_t* args)
 {
-	script_value_t* array_val = script_get_arg(args, 0);
-	script_value_t* value_val = script_get_arg(args, 1);
+	script_value_t array_val = script_get_arg(args, 0);
+	script_value_t value_val = script_get_arg(args, 1);
 
-	vector_t* array = &array_val->array;
+	vector_t* array = script_to_array(array_val);
+	size_t capacity = array->capacity;
 	
+	script_write_barrier(script, array_val, value_val);
 	vec_push_back(array, &value_val);
-}
 
-static void push_value(script_t* script, script_value_t* value);
+	account_growth(script, AS_OBJECT(array_val), (array->capacity - capacity) * sizeof(script_value_t));
+}
 
 static void ext_array_pop(script_t* script, vector_t* args)
 {
-	script_value_t* array_val = script_get_arg(args, 0);
-	script_value_t* value;
+	script_value_t array_val = script_get_arg(args, 0);
+	script_value_t value;
 
-	vector_t* array = &array_val->array;
+	vector_t* array = script_to_array(array_val);
 
 	vec_pop_back(array, &value);
 
@@ -5090,26 +5816,26 @@ static void ext_array_pop(script_t* script, vector_t* args)
 	script_return_top(script);
 }
 
-static void ext_char_to_number(script_t* script, vector_t* args)
+static script_typed_value_t ext_char_to_number(script_t* script, const script_typed_value_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	script_push_number(script, val->code);
-	script_return_top(script);
+	script_typed_value_t result;
+	result.number = args[0].code;
+	return result;
 }
 
-static void ext_number_to_char(script_t* script, vector_t* args)
+static script_typed_value_t ext_number_to_char(script_t* script, const script_typed_value_t* args)
 {
-	script_value_t* val = vec_get_value(args, 0, script_value_t*);
-	script_push_char(script, (char)val->number);
-	script_return_top(script);
+	script_typed_value_t result;
+	result.code = (char)args[0].number;
+	return result;
 }
 
 static void ext_number_to_string(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
+	script_value_t val = script_get_arg(args, 0);
 	
 	static char buf[256]; // TODO: don't use a magic number here
-	sprintf(buf, "%g", val->number);
+	sprintf(buf, "%g", script_to_number(val));
 	
 	script_push_cstr(script, buf);
 	script_return_top(script);
@@ -5117,34 +5843,132 @@ static void ext_number_to_string(script_t* script, vector_t* args)
 
 static void ext_string_to_number(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	script_push_number(script, strtod(val->string.data, NULL));
+	script_value_t val = script_get_arg(args, 0);
+	script_push_number(script, strtod(script_to_string(val).data, NULL));
+	script_return_top(script);
+}
+
+static script_typed_value_t ext_read_char(script_t* script, const script_typed_value_t* args)
+{
+	script_typed_value_t result;
+	result.code = getc(stdin);
+	return result;
+}
+
+static script_typed_value_t ext_print_char(script_t* script, const script_typed_value_t* args)
+{
+	script_typed_value_t result;
+	putchar(args[0].code);
+	result.native = NULL;
+	return result;
+}
+
+static script_typed_value_t ext_floor(script_t* script, const script_typed_value_t* args)
+{
+	script_typed_value_t result;
+	result.number = (long)args[0].number;
+	return result;
+}
+
+static script_typed_value_t ext_ceil(script_t* script, const script_typed_value_t* args)
+{
+	script_typed_value_t result;
+	result.number = (long)args[0].number + 1;
+	return result;
+}
+
+static void push_number_array(script_t* script, const double* values, int length)
+{
+	vector_t array;
+	vec_init(&array, sizeof(script_value_t));
+
+	for(int i = 0; i < length; ++i)
+	{
+		script_value_t val = script_number_value(values[i]);
+		vec_push_back(&array, &val);
+	}
+
+	script_push_premade_array(script, array);
+}
+
+static void ext_gc_collections(script_t* script, vector_t* args)
+{
+	script_push_number(script, script->gc_collections);
+	script_return_top(script);
+}
+
+static void ext_gc_pause_total(script_t* script, vector_t* args)
+{
+	script_push_number(script, script->gc_pause_total_us);
+	script_return_top(script);
+}
+
+static void ext_gc_pause_max(script_t* script, vector_t* args)
+{
+	script_push_number(script, script->gc_pause_max_us);
+	script_return_top(script);
+}
+
+static void ext_gc_pause_histogram(script_t* script, vector_t* args)
+{
+	double counts[SCRIPT_GC_PAUSE_BUCKETS];
+
+	for(int i = 0; i < SCRIPT_GC_PAUSE_BUCKETS; ++i)
+		counts[i] = script->gc_pause_histogram[i];
+
+	push_number_array(script, counts, SCRIPT_GC_PAUSE_BUCKETS);
+	script_return_top(script);
+}
+
+static void ext_gc_live_objects(script_t* script, vector_t* args)
+{
+	script_heap_stats_t stats;
+	script_heap_stats(script, &stats);
+
+	double counts[NUM_VALUE_TYPES];
+
+	for(int i = 0; i < NUM_VALUE_TYPES; ++i)
+		counts[i] = stats.objects[i];
+
+	push_number_array(script, counts, NUM_VALUE_TYPES);
 	script_return_top(script);
 }
 
-static void ext_read_char(script_t* script, vector_t* args)
+static void ext_gc_live_bytes(script_t* script, vector_t* args)
 {
-	script_push_char(script, getc(stdin));
+	script_heap_stats_t stats;
+	script_heap_stats(script, &stats);
+
+	double bytes[NUM_VALUE_TYPES];
+
+	for(int i = 0; i < NUM_VALUE_TYPES; ++i)
+		bytes[i] = (double)stats.bytes[i];
+
+	push_number_array(script, bytes, NUM_VALUE_TYPES);
 	script_return_top(script);
 }
 
-static void ext_print_char(script_t* script, vector_t* args)
+static void ext_gc_heap_blocks(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	putchar(val->code);
+	script_heap_stats_t stats;
+	script_heap_stats(script, &stats);
+
+	script_push_number(script, stats.num_blocks);
+	script_return_top(script);
 }
 
-static void ext_floor(script_t* script, vector_t* args)
+static void ext_gc_heap_occupancy(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	script_push_number(script, (long)(val->number));
+	script_heap_stats_t stats;
+	script_heap_stats(script, &stats);
+
+	script_push_number(script, stats.occupancy);
 	script_return_top(script);
 }
 
-static void ext_ceil(script_t* script, vector_t* args)
+static void ext_gc_allocation_rate(script_t* script, vector_t* args)
 {
-	script_value_t* val = script_get_arg(args, 0);
-	script_push_number(script, (long)(val->number) + 1);
+	script_push_number(script, script->gc_allocation_rate);
 	script_return_top(script);
 }
 
@@ -5165,30 +5989,32 @@ static void ext_create_u8_buffer(script_t* script, vector_t* args)
 
 static void ext_u8_buffer_clear(script_t* script, vector_t* args)
 {
-	script_native_t* nat = &script_get_arg(args, 0)->nat;
+	script_native_t* nat = script_to_native(script_get_arg(args, 0));
 	vec_clear(nat->value);
 }
 
 static void ext_u8_buffer_length(script_t* script, vector_t* args)
 {
-	script_native_t* nat = &script_get_arg(args, 0)->nat;
+	script_native_t* nat = script_to_native(script_get_arg(args, 0));
 	script_push_number(script, ((vector_t*)nat->value)->length);
 	script_return_top(script);
 }
 
 static void ext_u8_buffer_push(script_t* script, vector_t* args)
 {
-	script_native_t* nat = &script_get_arg(args, 0)->nat;
-	script_value_t* val = script_get_arg(args, 1);
+	script_native_t* nat = script_to_native(script_get_arg(args, 0));
+	script_value_t val = script_get_arg(args, 1);
 	
-	uint8_t value = (uint8_t)val->number;
+	uint8_t value = (uint8_t)script_to_number(val);
+	vector_t* buf = nat->value;
 	
-	vec_push_back(nat->value, &value);
+	vec_push_back(buf, &value);
+	script_set_native_size(script, nat, buf->capacity);
 }
 
 static void ext_u8_buffer_pop(script_t* script, vector_t* args)
 {
-	script_native_t* nat = &script_get_arg(args, 0)->nat;
+	script_native_t* nat = script_to_native(script_get_arg(args, 0));
 	uint8_t value;
 	vec_pop_back(nat->value, &value);
 	
@@ -5198,7 +6024,7 @@ static void ext_u8_buffer_pop(script_t* script, vector_t* args)
 
 static void ext_u8_buffer_to_string(script_t* script, vector_t* args)
 {
-	script_native_t* nat = &script_get_arg(args, 0)->nat;
+	script_native_t* nat = script_to_native(script_get_arg(args, 0));
 	vector_t* buf = nat->value;
 	unsigned char null_terminator = '\0';
 	vec_push_back(buf, &null_terminator);
@@ -5272,16 +6098,16 @@ static void bind_default_externs(script_t* script)
 	script_bind_extern(script, "array_push", ext_array_push);
 	script_bind_extern(script, "array_pop", ext_array_pop);
 	
-	script_bind_extern(script, "char_to_number", ext_char_to_number);
-	script_bind_extern(script, "number_to_char", ext_number_to_char);
+	script_bind_extern_typed(script, "char_to_number", ext_char_to_number, "c>n");
+	script_bind_extern_typed(script, "number_to_char", ext_number_to_char, "n>c");
 	script_bind_extern(script, "number_to_string", ext_number_to_string);
 	script_bind_extern(script, "string_to_number", ext_string_to_number);
 	
-	script_bind_extern(script, "read_char", ext_read_char);
-	script_bind_extern(script, "print_char", ext_print_char);
+	script_bind_extern_typed(script, "read_char", ext_read_char, ">c");
+	script_bind_extern_typed(script, "print_char", ext_print_char, "c>v");
 	
-	script_bind_extern(script, "floor", ext_floor);
-	script_bind_extern(script, "ceil", ext_ceil);
+	script_bind_extern_typed(script, "floor", ext_floor, "n>n");
+	script_bind_extern_typed(script, "ceil", ext_ceil, "n>n");
 	
 	script_bind_extern(script, "create_u8_buffer", ext_create_u8_buffer);
 	script_bind_extern(script, "u8_buffer_clear", ext_u8_buffer_clear);
@@ -5289,23 +6115,171 @@ static void bind_default_externs(script_t* script)
 	script_bind_extern(script, "u8_buffer_push", ext_u8_buffer_push);
 	script_bind_extern(script, "u8_buffer_pop", ext_u8_buffer_pop);
 	script_bind_extern(script, "u8_buffer_to_string", ext_u8_buffer_to_string);
+
+	script_bind_extern(script, "gc_collections", ext_gc_collections);
+	script_bind_extern(script, "gc_pause_total", ext_gc_pause_total);
+	script_bind_extern(script, "gc_pause_max", ext_gc_pause_max);
+	script_bind_extern(script, "gc_pause_histogram", ext_gc_pause_histogram);
+	script_bind_extern(script, "gc_live_objects", ext_gc_live_objects);
+	script_bind_extern(script, "gc_live_bytes", ext_gc_live_bytes);
+	script_bind_extern(script, "gc_heap_blocks", ext_gc_heap_blocks);
+	script_bind_extern(script, "gc_heap_occupancy", ext_gc_heap_occupancy);
+	script_bind_extern(script, "gc_allocation_rate", ext_gc_allocation_rate);
+}
+
+// NOTE: The block header has to fit in the space SCRIPT_HEAP_BLOCK_SIZE leaves for it
+typedef char heap_block_fits[sizeof(script_heap_block_t) <= SCRIPT_HEAP_BLOCK_BYTES ? 1 : -1];
+
+// NOTE: Blocks are aligned to SCRIPT_HEAP_BLOCK_BYTES (see get_object_block)
+// but only as big as their capacity needs
+static script_heap_block_t* alloc_heap_block(int capacity)
+{
+	void* mem;
+	size_t size = offsetof(script_heap_block_t, objects) + capacity * sizeof(script_object_t);
+
+#ifdef _WIN32
+	mem = _aligned_malloc(size, SCRIPT_HEAP_BLOCK_BYTES);
+#else
+	if(posix_memalign(&mem, SCRIPT_HEAP_BLOCK_BYTES, size) != 0)
+		mem = NULL;
+#endif
+
+	if(!mem) error_exit("Out of memory!\n");
+	return mem;
+}
+
+static void free_heap_block(script_heap_block_t* block)
+{
+#ifdef _WIN32
+	_aligned_free(block);
+#else
+	free(block);
+#endif
+}
+
+// NOTE: Blocks with free slots are kept in a doubly linked list apart from
+// heap_head so that allocating never has to look through full blocks
+static void push_free_block(script_t* script, script_heap_block_t* block)
+{
+	if(block->on_free_list) return;
+
+	block->prev_free = NULL;
+	block->next_free = script->free_blocks;
+
+	if(script->free_blocks)
+		script->free_blocks->prev_free = block;
+
+	script->free_blocks = block;
+	block->on_free_list = 1;
+}
+
+static void remove_free_block(script_t* script, script_heap_block_t* block)
+{
+	if(!block->on_free_list) return;
+
+	if(block->prev_free)
+		block->prev_free->next_free = block->next_free;
+	else
+		script->free_blocks = block->next_free;
+
+	if(block->next_free)
+		block->next_free->prev_free = block->prev_free;
+
+	block->on_free_list = 0;
 }
 
 static void add_heap_block(script_t* script)
 {
-	script_heap_block_t* block = emalloc(sizeof(script_heap_block_t));
+	script_heap_block_t* block = alloc_heap_block(script->heap_block_size);
 	
 	block->next = script->heap_head;
-	block->num_free = SCRIPT_HEAP_BLOCK_SIZE;
-	for (int i = 0; i < block->num_free; ++i)
-	{
-		block->free_indices[i] = block->num_free - i - 1;
+	block->capacity = script->heap_block_size;
+	block->num_free = block->capacity;
 
-		block->values[i].block = block;
-		block->values[i].block_index = i;
-	}
+	memset(block->live, 0, sizeof(block->live));
+	memset(block->marked, 0, sizeof(block->marked));
+	memset(block->remembered, 0, sizeof(block->remembered));
+
+	block->unswept = 0;
+	block->evacuating = 0;
+
+	block->on_free_list = 0;
+	push_free_block(script, block);
 
 	script->heap_head = block;
+	++script->num_empty_blocks;
+}
+
+// NOTE: Where an incremental collection (SCRIPT_GC_INCREMENTAL) is at; it
+// goes from GC_IDLE to GC_MARK once the heap has grown enough, to GC_SWEEP
+// when there's nothing gray left and back to GC_IDLE after every block
+// has been swept
+enum
+{
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP
+};
+
+// NOTE: An entry on the mark stack (script->gray); index is how many of the
+// object's values have been shaded already, since incremental steps scan
+// big arrays and structs a piece at a time
+typedef struct
+{
+	script_object_t* obj;
+	int index;
+} gray_object_t;
+
+// NOTE: How many objects are marked or swept for every object allocated
+// while an incremental cycle is running; it has to be well over 1 for the
+// cycle to finish before the heap grows too much
+#define GC_WORK_PER_ALLOC	8
+
+// NOTE: How much work script_gc_step does between looking at the clock
+#define GC_STEP_WORK		256
+
+// NOTE: Elapsed (monotonic wall clock) time for the pause stats and the
+// script_gc_step budget; clock() is the CPU time of the whole process,
+// which would count the marking and sweeping threads too. On Windows
+// clock() is wall clock time already.
+static double clock_us(void)
+{
+#if !defined(_WIN32) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#else
+	return (double)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+static inline script_heap_block_t* get_object_block(script_object_t* obj)
+{
+	return (script_heap_block_t*)((uintptr_t)obj & ~(uintptr_t)(SCRIPT_HEAP_BLOCK_BYTES - 1));
+}
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
+
+// NOTE: Index of the lowest set bit; bits can't be 0
+static inline int lowest_bit(uint32_t bits)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(bits);
+#else
+	int index = 0;
+	while(!(bits & 1))
+	{
+		bits >>= 1;
+		++index;
+	}
+
+	return index;
+#endif
 }
 
 static void init_debug_env(script_debug_env_t* env)
@@ -5325,42 +6299,110 @@ void script_init(script_t* script)
 	
 	script->userdata = NULL;
 	script->in_extern = 0;
+	script->extern_unrooted = 0;
+
+	vec_init(&script->handles, sizeof(script_value_t));
+	script->extern_handle_scopes = 0;
+
+	script->codegen = SCRIPT_CODEGEN_STACK;
 	
 	script->cur_file = "unknown";
 	script->cur_line = 0;
 	
 	script->heap_head = NULL;
+	script->free_blocks = NULL;
+	script->num_empty_blocks = 0;
+	script->heap_block_size = SCRIPT_HEAP_BLOCK_SIZE;
+	script->max_empty_blocks = SCRIPT_MAX_EMPTY_BLOCKS;
 	add_heap_block(script);
 
-	script->gc_head = NULL;
-	script->ret_val = NULL;
+	script->gc_mode = SCRIPT_GC_MARK_SWEEP;
+	script->nursery = NULL;
+	script->nursery_top = 0;
+
+	vec_init(&script->remembered, sizeof(script_object_t*));
+	vec_init(&script->remembered_globals, sizeof(int));
+	vec_init(&script->promoted, sizeof(script_object_t*));
+
+	script->gc_phase = GC_IDLE;
+	vec_init(&script->gray, sizeof(gray_object_t));
+	script->gc_stack_low = 0;
+
+	script->gc_threads = 1;
+
+	script->gc_background_sweep = 0;
+	vec_init(&script->dead, sizeof(script_object_t));
+	vec_init(&script->finalize, sizeof(script_native_t*));
+	script->sweeper = NULL;
+	script->sweep_link = NULL;
+
+	script->ret_val = NULL_VALUE;
 	
 	script->num_objects = 0;
-	script->max_objects_until_gc = INIT_GC_THRESH;
+
+	script->gc_config.initial_bytes = GC_DEFAULT_INITIAL_BYTES;
+	script->gc_config.growth_factor = GC_DEFAULT_GROWTH_FACTOR;
+	script->gc_config.min_bytes = GC_DEFAULT_MIN_BYTES;
+	script->gc_config.max_bytes = 0;
+
+	script->heap_bytes = 0;
+	script->live_bytes = 0;
+	script->marked_bytes = 0;
+	script->gc_threshold = script->gc_config.initial_bytes;
+
+	script->gc_collections = 0;
+	script->gc_compacted_blocks = 0;
+	script->gc_compact = 0;
+	script->gc_minor_collections = 0;
+	script->gc_pause_total_us = 0;
+	script->gc_pause_max_us = 0;
+	memset(script->gc_pause_histogram, 0, sizeof(script->gc_pause_histogram));
+	script->allocated_bytes = 0;
+	script->gc_allocation_rate = 0;
+	script->gc_last_allocated_bytes = 0;
+	script->gc_last_end_us = clock_us();
+	script->on_gc_start = NULL;
+	script->on_gc_end = NULL;
+	script->gc_callback_data = NULL;
+	script->alloc_profile = NULL;
+
 	script->pc = -1;
 	script->fp = 0;
 	
 	script->indir_depth = 0;
 
-	vec_init(&script->call_records, sizeof(script_call_record_t));
+	script->frames = emalloc(sizeof(script_frame_t) * FRAME_CAPACITY);
+	script->frame_count = 0;
+	script->frame_capacity = FRAME_CAPACITY;
 
-	vec_init(&script->globals, sizeof(script_value_t*));
+	vec_init(&script->globals, sizeof(script_value_t));
 	
-	vec_init(&script->stack, sizeof(script_value_t*));
+	vec_init(&script->stack, sizeof(script_value_t));
 	vec_reserve(&script->stack, STACK_SIZE);
-
-	vec_init(&script->indir, sizeof(int));
+	script->global_stack_size = 0;
 	
 	vec_init(&script->code, sizeof(word));
+
+	script->linked = 0;
+	vec_init(&script->instrs, sizeof(script_instr_t));
+	vec_init(&script->instr_offsets, sizeof(int));
+	vec_init(&script->linked_function_pcs, sizeof(int));
+	vec_init(&script->line_info, sizeof(script_line_info_t));
 	
 	vec_init(&script->numbers, sizeof(double));
 	vec_init(&script->strings, sizeof(script_string_t));
 
+	vec_init(&script->string_values, sizeof(script_object_t*));
+	script->constant_blocks = NULL;
+
 	vec_init(&script->extern_names, sizeof(char*));
 	vec_init(&script->externs, sizeof(script_extern_t));
+	vec_init(&script->extern_signatures, sizeof(char*));
+	vec_init(&script->typed_externs, sizeof(script_typed_extern_t));
 	
 	vec_init(&script->function_names, sizeof(char*));
 	vec_init(&script->function_pcs, sizeof(int));
+	vec_init(&script->function_stack_sizes, sizeof(int));
 
 	vec_init(&script->modules, sizeof(script_module_t));
 
@@ -5410,55 +6452,474 @@ void script_init(script_t* script)
 	}
 #endif
 
-static void delete_value(script_t* script, script_value_t* val)
-{	
-	switch(val->type)
+// NOTE: Marks an object which was moved out of the nursery; its type is
+// overwritten and 'forward' points to where it is now
+#define VAL_FORWARDED NUM_VALUE_TYPES
+
+// NOTE: Heap size accounting (see script_gc_config_t); the fixed part of an
+// object is counted when it's created and what its string/vector holds is
+// counted once that's filled in (account_payload). After every collection
+// heap_bytes is set to what was marked.
+static size_t fixed_bytes(script_value_type_t type)
+{
+	switch(type)
 	{
-		case VAL_NULL:
-		case VAL_BOOL:
-		case VAL_CHAR:
-		case VAL_NUMBER:
-		case VAL_FUNC: break;
-		
-		case VAL_STRING: free(val->string.data); val->string.data = NULL; break;
-		case VAL_ARRAY: vec_destroy(&val->array); break;
-		case VAL_STRUCT_INSTANCE: vec_destroy(&val->ds.members); break;
-		case VAL_NATIVE: if(val->nat.on_delete) val->nat.on_delete(val->nat.value); break;
+		case VAL_ARRAY: return sizeof(script_object_t) + sizeof(vector_t);
+		case VAL_STRUCT_INSTANCE: return sizeof(script_object_t) + sizeof(script_struct_t);
+		case VAL_NATIVE: return sizeof(script_object_t) + sizeof(script_native_t);
+		default: return sizeof(script_object_t);
 	}
-	
-	val->block->free_indices[val->block->num_free++] = val->block_index;
 }
 
-static void destroy_all_values(script_t* script)
+static size_t payload_bytes(script_object_t* obj)
 {
-	script_heap_block_t* block = script->heap_head;
-	while (block)
+	switch(obj->type)
 	{
-		script_heap_block_t* next = block->next;
-		free(block);
-		block = next;
+		case VAL_STRING: return obj->string.length + 1;
+		case VAL_ARRAY: return obj->array->capacity * obj->array->datum_size;
+		case VAL_STRUCT_INSTANCE: return obj->ds->members.capacity * sizeof(script_value_t);
+		case VAL_NATIVE: return obj->nat->size;
+		default: return 0;
 	}
+}
 
-	script->gc_head = NULL;
+static inline size_t object_bytes(script_object_t* obj)
+{
+	return fixed_bytes(obj->type) + payload_bytes(obj);
 }
 
-static void destroy_module(void* p_module)
+static inline void count_allocated(script_t* script, size_t bytes)
 {
-	script_module_t* module = p_module;
+	script->heap_bytes += bytes;
+	script->allocated_bytes += bytes;
 
-	vec_destroy(&module->referenced_modules);
+	// NOTE: Whatever is allocated while marking survives the cycle
+	if(script->gc_phase == GC_MARK)
+		script->marked_bytes += bytes;
+}
 
-	free(module->local_path);
-	free(module->name);
-	free(module->source_code);
+// NOTE: Allocation profiling (see script_set_alloc_profiling). An allocation
+// site is the instruction that allocated, the type it allocated and the
+// functions on the call stack (from the frames) at the time; every object
+// remembers the site it came from.
+#define ALLOC_PROFILE_BUCKETS	4096
 
-	for(int i = 0; i < module->expr_list.length; ++i)
-		delete_expr(vec_get_value(&module->expr_list, i, expr_t*));
-	vec_destroy(&module->expr_list);
+typedef struct
+{
+	int pc;
+	script_value_type_t type;
 
-	vec_destroy(&module->compile_time_blocks);
+	// NOTE: Range of the profile's frames (outermost first)
+	int first_frame;
+	int num_frames;
 
-	vec_destroy(&module->globals);
+	uint32_t hash;
+	int next;		// NOTE: Next site in the same bucket
+
+	size_t count;
+	size_t bytes;
+
+	// NOTE: As of the end of the last full collection
+	size_t survived_count;
+	size_t survived_bytes;
+} alloc_site_t;
+
+typedef struct
+{
+	vector_t sites;		// NOTE: array of alloc_site_t
+	vector_t frames;	// NOTE: array of script_function_t
+	int buckets[ALLOC_PROFILE_BUCKETS];
+} alloc_profile_t;
+
+static inline uint32_t hash_int(uint32_t hash, int value)
+{
+	return (hash ^ (uint32_t)value) * 16777619U;
+}
+
+static char same_site(alloc_profile_t* profile, alloc_site_t* site, script_t* script, int pc, script_value_type_t type)
+{
+	if(site->pc != pc || site->type != type || site->num_frames != script->frame_count)
+		return 0;
+
+	for(int i = 0; i < site->num_frames; ++i)
+	{
+		script_function_t* frame = vec_get(&profile->frames, site->first_frame + i);
+		script_frame_t* record = &script->frames[i];
+
+		if(frame->is_extern != record->function.is_extern || frame->index != record->function.index)
+			return 0;
+	}
+
+	return 1;
+}
+
+// NOTE: Returns the index of the site allocating an object of the given type right now
+static int record_alloc(script_t* script, script_value_type_t type)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+
+	int pc = get_call_site_pc(script);
+
+	uint32_t hash = hash_int(hash_int(2166136261U, pc), type);
+
+	for(int i = 0; i < script->frame_count; ++i)
+	{
+		script_frame_t* record = &script->frames[i];
+		hash = hash_int(hash_int(hash, record->function.is_extern), record->function.index);
+	}
+
+	int* bucket = &profile->buckets[hash % ALLOC_PROFILE_BUCKETS];
+	int index = *bucket;
+
+	while(index >= 0)
+	{
+		alloc_site_t* site = vec_get(&profile->sites, index);
+
+		if(site->hash == hash && same_site(profile, site, script, pc, type))
+			break;
+
+		index = site->next;
+	}
+
+	if(index < 0)
+	{
+		alloc_site_t site;
+
+		site.pc = pc;
+		site.type = type;
+		site.first_frame = profile->frames.length;
+		site.num_frames = script->frame_count;
+		site.hash = hash;
+		site.next = *bucket;
+		site.count = site.bytes = 0;
+		site.survived_count = site.survived_bytes = 0;
+
+		for(int i = 0; i < script->frame_count; ++i)
+			vec_push_back(&profile->frames, &script->frames[i].function);
+
+		index = *bucket = profile->sites.length;
+		vec_push_back(&profile->sites, &site);
+	}
+
+	alloc_site_t* site = vec_get(&profile->sites, index);
+
+	site->count += 1;
+	site->bytes += fixed_bytes(type);
+
+	return index;
+}
+
+static inline alloc_site_t* get_alloc_site(script_t* script, script_object_t* obj)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+
+	if(!profile || obj->site < 0 || obj->site >= profile->sites.length)
+		return NULL;
+
+	return vec_get(&profile->sites, obj->site);
+}
+
+// NOTE: For when an object's payload is filled in or grows after it's created
+static void account_growth(script_t* script, script_object_t* obj, size_t bytes)
+{
+	count_allocated(script, bytes);
+
+	alloc_site_t* site = get_alloc_site(script, obj);
+	if(site) site->bytes += bytes;
+}
+
+static void account_payload(script_t* script, script_object_t* obj)
+{
+	account_growth(script, obj, payload_bytes(obj));
+}
+
+// NOTE: Calls fn on every object in the block heap and the nursery
+static void walk_heap(script_t* script, void (*fn)(script_t* script, script_object_t* obj, void* data), void* data)
+{
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+	{
+		for(int i = 0; i < (block->capacity + 31) / 32; ++i)
+		{
+			for(uint32_t live = block->live[i]; live; live &= live - 1)
+				fn(script, &block->objects[i * 32 + lowest_bit(live)], data);
+		}
+	}
+
+	for(int i = 0; i < script->nursery_top; ++i)
+	{
+		if(script->nursery[i].type != VAL_FORWARDED)
+			fn(script, &script->nursery[i], data);
+	}
+}
+
+static void count_survivor(script_t* script, script_object_t* obj, void* data)
+{
+	alloc_site_t* site = get_alloc_site(script, obj);
+
+	if(site)
+	{
+		site->survived_count += 1;
+		site->survived_bytes += object_bytes(obj);
+	}
+}
+
+// NOTE: Right after a full collection everything allocated survived it
+static void count_survivors(script_t* script)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+
+	for(int i = 0; i < profile->sites.length; ++i)
+	{
+		alloc_site_t* site = vec_get(&profile->sites, i);
+		site->survived_count = site->survived_bytes = 0;
+	}
+
+	walk_heap(script, count_survivor, NULL);
+}
+
+// NOTE: What the threshold is after a collection leaves live_bytes behind
+static size_t next_gc_threshold(script_t* script, size_t live_bytes)
+{
+	script_gc_config_t* config = &script->gc_config;
+
+	size_t threshold = (size_t)(live_bytes * config->growth_factor);
+
+	if(threshold < config->min_bytes)
+		threshold = config->min_bytes;
+
+	// NOTE: If what's live is already over max_bytes, collecting every time
+	// anything is allocated would get nowhere
+	if(config->max_bytes > 0 && threshold > config->max_bytes)
+		threshold = live_bytes + config->min_bytes > config->max_bytes ? live_bytes + config->min_bytes : config->max_bytes;
+
+	return threshold;
+}
+
+// NOTE: Frees what the object owns; its slot is released by the caller
+static void delete_object(script_t* script, script_object_t* obj)
+{	
+	switch(obj->type)
+	{
+		case VAL_STRING: free(obj->string.data); obj->string.data = NULL; break;
+		case VAL_ARRAY: vec_destroy(obj->array); free(obj->array); break;
+		case VAL_STRUCT_INSTANCE: vec_destroy(&obj->ds->members); free(obj->ds); break;
+		case VAL_NATIVE: if(obj->nat->on_delete) obj->nat->on_delete(obj->nat->value); free(obj->nat); break;
+		default: break;
+	}
+}
+
+// NOTE: How many deferred frees/finalizers are done each time the script
+// allocates (see script_gc_set_background_sweep)
+#define GC_RELEASE_BATCH	16
+
+// NOTE: With background sweeping, a collection only takes the slots back;
+// what the garbage owns is put in script->dead (or script->finalize for
+// natives, whose on_delete has to run on the script's thread) and
+// released afterwards
+static void defer_delete(script_t* script, script_object_t* obj)
+{
+	if(obj->type == VAL_NATIVE)
+		vec_push_back(&script->finalize, &obj->nat);
+	else
+		vec_push_back(&script->dead, obj);
+}
+
+// NOTE: Runs/frees up to 'max' of the deferred natives and objects
+static void release_deferred(script_t* script, int max)
+{
+	for(int i = 0; i < max && script->finalize.length > 0; ++i)
+	{
+		script_object_t obj;
+
+		obj.type = VAL_NATIVE;
+		vec_pop_back(&script->finalize, &obj.nat);
+
+		delete_object(script, &obj);
+	}
+
+	for(int i = 0; i < max && script->dead.length > 0; ++i)
+	{
+		script_object_t obj;
+		vec_pop_back(&script->dead, &obj);
+
+		delete_object(script, &obj);
+	}
+}
+
+#ifdef SCRIPT_BACKGROUND_SWEEP
+typedef struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	// NOTE: array of script_object_t's waiting to be freed
+	vector_t pending;
+
+	char quit;
+} script_sweeper_t;
+
+static void* sweeper_main(void* p)
+{
+	script_sweeper_t* sweeper = p;
+
+	vector_t batch;
+	vec_init(&batch, sizeof(script_object_t));
+
+	pthread_mutex_lock(&sweeper->lock);
+
+	for(;;)
+	{
+		while(sweeper->pending.length == 0 && !sweeper->quit)
+			pthread_cond_wait(&sweeper->wake, &sweeper->lock);
+
+		// NOTE: Everything that was handed over gets freed before quitting
+		if(sweeper->pending.length == 0) break;
+
+		vector_t temp = batch;
+		batch = sweeper->pending;
+		sweeper->pending = temp;
+
+		pthread_mutex_unlock(&sweeper->lock);
+
+		script_object_t* objs = (script_object_t*)batch.data;
+		for(int i = 0; i < batch.length; ++i)
+			delete_object(NULL, &objs[i]);
+
+		batch.length = 0;
+
+		pthread_mutex_lock(&sweeper->lock);
+	}
+
+	pthread_mutex_unlock(&sweeper->lock);
+
+	vec_destroy(&batch);
+	return NULL;
+}
+
+// NOTE: Hands script->dead to the sweeper thread (starting it if needed);
+// if it can't be started they're released a batch at a time as usual
+static void flush_dead(script_t* script)
+{
+	if(script->dead.length == 0) return;
+
+	script_sweeper_t* sweeper = script->sweeper;
+
+	if(!sweeper)
+	{
+		sweeper = emalloc(sizeof(script_sweeper_t));
+
+		pthread_mutex_init(&sweeper->lock, NULL);
+		pthread_cond_init(&sweeper->wake, NULL);
+		vec_init(&sweeper->pending, sizeof(script_object_t));
+		sweeper->quit = 0;
+
+		if(pthread_create(&sweeper->thread, NULL, sweeper_main, sweeper) != 0)
+		{
+			pthread_mutex_destroy(&sweeper->lock);
+			pthread_cond_destroy(&sweeper->wake);
+			vec_destroy(&sweeper->pending);
+			free(sweeper);
+			return;
+		}
+
+		script->sweeper = sweeper;
+	}
+
+	pthread_mutex_lock(&sweeper->lock);
+	vec_copy_region(&sweeper->pending, &script->dead, sweeper->pending.length, 0, script->dead.length);
+	pthread_cond_signal(&sweeper->wake);
+	pthread_mutex_unlock(&sweeper->lock);
+
+	vec_clear(&script->dead);
+}
+
+// NOTE: Waits for the sweeper to free everything it has and stops it
+static void stop_sweeper(script_t* script)
+{
+	script_sweeper_t* sweeper = script->sweeper;
+	if(!sweeper) return;
+
+	pthread_mutex_lock(&sweeper->lock);
+	sweeper->quit = 1;
+	pthread_cond_signal(&sweeper->wake);
+	pthread_mutex_unlock(&sweeper->lock);
+
+	pthread_join(sweeper->thread, NULL);
+
+	pthread_mutex_destroy(&sweeper->lock);
+	pthread_cond_destroy(&sweeper->wake);
+	vec_destroy(&sweeper->pending);
+	free(sweeper);
+
+	script->sweeper = NULL;
+}
+#else
+static void flush_dead(script_t* script)
+{
+}
+
+static void stop_sweeper(script_t* script)
+{
+}
+#endif
+
+static void release_nursery(script_t* script);
+static void destroy_all_values(script_t* script)
+{
+	release_nursery(script);
+
+	vec_clear(&script->remembered);
+	vec_clear(&script->remembered_globals);
+
+	script->free_blocks = NULL;
+	script->num_empty_blocks = 0;
+
+	// NOTE: Drop whatever cycle was in progress
+	script->gc_phase = GC_IDLE;
+	vec_clear(&script->gray);
+	script->gc_stack_low = 0;
+	script->sweep_link = NULL;
+
+	release_deferred(script, INT_MAX);
+
+	script_heap_block_t* block = script->heap_head;
+	while (block)
+	{
+		script_heap_block_t* next = block->next;
+
+		for(int i = 0; i < SCRIPT_HEAP_BITMAP_WORDS; ++i)
+		{
+			uint32_t live = block->live[i];
+			while(live)
+			{
+				delete_object(script, &block->objects[i * 32 + lowest_bit(live)]);
+				live &= live - 1;
+			}
+		}
+
+		free_heap_block(block);
+		block = next;
+	}
+}
+
+static void destroy_module(void* p_module)
+{
+	script_module_t* module = p_module;
+
+	vec_destroy(&module->referenced_modules);
+
+	free(module->local_path);
+	free(module->name);
+	free(module->source_code);
+
+	for(int i = 0; i < module->expr_list.length; ++i)
+		delete_expr(vec_get_value(&module->expr_list, i, expr_t*));
+	vec_destroy(&module->expr_list);
+
+	vec_destroy(&module->compile_time_blocks);
+
+	vec_destroy(&module->globals);
 	vec_destroy(&module->functions);
 
 	vec_traverse(&module->all_type_tags, destroy_type_tag);
@@ -5478,161 +6939,1671 @@ void script_reset(script_t* script)
 	add_heap_block(script);
 
 	script->in_extern = 0;
+	script->extern_unrooted = 0;
+
+	vec_clear(&script->handles);
+	script->extern_handle_scopes = 0;
 	
 	script->num_objects = 0;
-	script->max_objects_until_gc = INIT_GC_THRESH;
+
+	script->heap_bytes = 0;
+	script->live_bytes = 0;
+	script->gc_threshold = script->gc_config.initial_bytes;
 	
 	script->pc = -1;
 	script->fp = 0;
 
-	script->gc_head = NULL;
-	script->ret_val = NULL;
+	script->ret_val = NULL_VALUE;
 
 	script->indir_depth = 0;
+	script->frame_count = 0;
 
 	vec_clear(&script->globals);
 	
 	vec_clear(&script->stack);
-	vec_clear(&script->indir);
 	
 	vec_clear(&script->code);
+
+	script->linked = 0;
+	vec_clear(&script->instrs);
+	vec_clear(&script->instr_offsets);
+	vec_clear(&script->linked_function_pcs);
+	vec_clear(&script->line_info);
 	
 	vec_clear(&script->function_names);
 	vec_clear(&script->function_pcs);
-}
+	vec_clear(&script->function_stack_sizes);
 
-static int read_int(script_t* script)
-{
-	int value = 0;
-	word* vp = (word*)(&value);
-	
-	for(int i = 0; i < sizeof(int) / sizeof(word); ++i)
-		*vp++ = vec_get_value(&script->code, script->pc++, word);
-	
-	return value;
+	script->global_stack_size = 0;
 }
 
-static void mark(script_value_t* value)
+// NOTE: Whatever is live but wasn't marked is garbage; the marked
+// objects are all that's live afterwards. Returns how many objects were freed.
+static int sweep_block(script_t* script, script_heap_block_t* block)
 {
-	if(!value) return;
-	if(value->marked) return;
-	
-	value->marked = 1;
-	
-	if(value->type == VAL_ARRAY)
-	{
-		for(int i = 0; i < value->array.length; ++i)
-		{	
-			script_value_t* v = vec_get_value(&value->array, i, script_value_t*); 
-			mark(v);
-		}
-	}
-	else if(value->type == VAL_STRUCT_INSTANCE)
+	int freed = 0;
+	int words = (block->capacity + 31) / 32;
+
+	for(int i = 0; i < words; ++i)
 	{
-		for(int i = 0; i < value->ds.members.length; ++i)
+		uint32_t unreached = block->live[i] & ~block->marked[i];
+		while(unreached)
 		{
-			script_value_t* v = vec_get_value(&value->ds.members, i, script_value_t*); 
-			mark(v);
+			script_object_t* obj = &block->objects[i * 32 + lowest_bit(unreached)];
+
+			if(script->gc_background_sweep)
+				defer_delete(script, obj);
+			else
+				delete_object(script, obj);
+
+			unreached &= unreached - 1;
+			++freed;
 		}
+
+		block->live[i] = block->marked[i];
+		block->marked[i] = 0;
 	}
-	else if(value->type == VAL_NATIVE)
+
+	block->num_free += freed;
+	script->num_objects -= freed;
+
+	block->unswept = 0;
+
+	if(freed > 0)
 	{
-		if(value->nat.on_mark)
-			value->nat.on_mark(value->nat.value);
+		push_free_block(script, block);
+
+		if(block->num_free == block->capacity)
+			++script->num_empty_blocks;
 	}
+
+	return freed;
 }
 
-static void mark_all(script_t* script)
+// NOTE: Frees the block *link refers to (and unlinks it) if nothing in it
+// is allocated and more than max_empty_blocks blocks are empty; returns
+// whether it did
+static char release_if_empty(script_t* script, script_heap_block_t** link)
 {
-	if(script->ret_val)
-		mark(script->ret_val);
-	for(int i = 0; i < script->stack.length; ++i)
-	{
-		script_value_t* val = vec_get_value(&script->stack, i, script_value_t*);
-		mark(val);
-	}
-	
-	for(int i = 0; i < script->globals.length; ++i)
-	{
-		script_value_t* val = vec_get_value(&script->globals, i, script_value_t*);
-		mark(val);
-	}
+	script_heap_block_t* block = *link;
+
+	if(block->num_free < block->capacity) return 0;
+	if(script->num_empty_blocks <= script->max_empty_blocks) return 0;
+
+	*link = block->next;
+
+	remove_free_block(script, block);
+	free_heap_block(block);
+
+	--script->num_empty_blocks;
+
+	return 1;
 }
 
 static void sweep(script_t* script)
 {
-	script_value_t** val = &script->gc_head;
-	
-	while(*val)
+	script_heap_block_t** link = &script->heap_head;
+
+	while(*link)
 	{
-		if(!(*val)->marked)
-		{
-			script_value_t* unreached = *val;
-			*val = unreached->next;
-			--script->num_objects;
-			delete_value(script, unreached);
-		}
-		else
-		{
-			(*val)->marked = 0;
-			val = &(*val)->next;
-		}
+		sweep_block(script, *link);
+
+		if(!release_if_empty(script, link))
+			link = &(*link)->next;
 	}
 }
 
-static void collect_garbage(script_t* script)
+// NOTE: Lazy sweeping. With background sweeping, a full collection leaves
+// every block unswept and each one is swept when the script needs slots
+// (see get_heap_object) or has time for it (script_gc_step), so the pause
+// doesn't include sweeping. Incremental cycles sweep the same way once
+// marking is over. The next collection sweeps whatever is left first,
+// since marking reuses the mark bits.
+static void begin_lazy_sweep(script_t* script)
 {
-	mark_all(script);
-	sweep(script);
-	script->max_objects_until_gc = script->num_objects * 2;
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+		block->unswept = 1;
+
+	script->sweep_link = &script->heap_head;
 }
 
-static script_value_t* get_heap_value(script_t* script)
+// NOTE: Sweeps the next unswept block after sweep_link (releasing it if
+// it's one too many empty blocks); returns 0 once there are none left
+static char sweep_next_block(script_t* script)
 {
-	script_heap_block_t* block = script->heap_head;
-	while(block)
+	if(!script->sweep_link) return 0;
+
+	while(*script->sweep_link)
 	{
-		if (block->num_free > 0)
-		{
-			int index = block->free_indices[--block->num_free];
-			return &block->values[index];
-		}
+		script_heap_block_t* block = *script->sweep_link;
+		char swept = block->unswept;
+
+		// NOTE: Blocks swept for their slots already or added since
+		// marking finished only need looking at for release_if_empty
+		if(swept)
+			sweep_block(script, block);
 
-		block = block->next;
+		if(!release_if_empty(script, script->sweep_link))
+			script->sweep_link = &block->next;
+
+		if(swept) return 1;
 	}
 
-	add_heap_block(script);
-	return get_heap_value(script);
+	script->sweep_link = NULL;
+	return 0;
 }
 
-static script_value_t* new_value(script_t* script, script_value_type_t type)
+static void finish_sweep(script_t* script)
 {
-	if(!script->in_extern && script->num_objects >= script->max_objects_until_gc) collect_garbage(script); 
-	
-	script_value_t* val = get_heap_value(script);
-	
-	val->marked = 0;
-	val->type = type;
-	
-	val->next = script->gc_head;
-	script->gc_head = val;
-	
-	++script->num_objects;
-	
-	return val;
+	while(sweep_next_block(script));
+
+	flush_dead(script);
 }
 
-static void push_value(script_t* script, script_value_t* val)
+static script_object_t* get_heap_object(script_t* script);
+
+// NOTE: Compaction (see script_gc_set_compaction). Blocks less than
+// GC_COMPACT_OCCUPANCY percent full have everything in them moved into other
+// blocks, leaving forwarding pointers behind like a minor collection does;
+// then every reference is updated and the evacuated blocks are freed.
+// Array and struct storage with a lot of unused capacity is shrunk while
+// references are being updated.
+#define GC_COMPACT_OCCUPANCY	25
+
+static inline void forward_value(script_value_t* slot)
 {
-	if(script->stack.length + 1 >= script->stack.capacity) error_exit_script(script, "Stack overflow!\n");
-	vec_push_back(&script->stack, &val);
+	if(IS_OBJECT(*slot) && AS_OBJECT(*slot)->type == VAL_FORWARDED)
+		*slot = OBJECT_VALUE(AS_OBJECT(*slot)->forward);
 }
 
-static script_value_t* pop_value(script_t* script)
+static void forward_values(vector_t* values)
+{
+	script_value_t* v = (script_value_t*)values->data;
+
+	for(int i = 0; i < values->length; ++i)
+		forward_value(&v[i]);
+}
+
+// NOTE: Gives back storage when less than half of it is used; returns
+// how many bytes that freed
+static size_t trim_values(vector_t* values)
+{
+	if(values->capacity <= 8 || values->length * 2 >= values->capacity)
+		return 0;
+
+	size_t capacity = values->length > 8 ? values->length : 8;
+	void* data = realloc(values->data, capacity * values->datum_size);
+
+	if(!data) return 0;
+
+	size_t freed = (values->capacity - capacity) * values->datum_size;
+
+	values->data = data;
+	values->capacity = capacity;
+
+	return freed;
+}
+
+static void forward_object(script_t* script, script_object_t* obj, void* data)
+{
+	size_t* freed = data;
+	vector_t* values = NULL;
+
+	if(obj->type == VAL_ARRAY)
+		values = obj->array;
+	else if(obj->type == VAL_STRUCT_INSTANCE)
+		values = &obj->ds->members;
+
+	if(!values) return;
+
+	forward_values(values);
+	*freed += trim_values(values);
+}
+
+// NOTE: Moves everything in block into other blocks
+static void evacuate_block(script_t* script, script_heap_block_t* block)
+{
+	for(int i = 0; i < (block->capacity + 31) / 32; ++i)
+	{
+		for(uint32_t live = block->live[i]; live; live &= live - 1)
+		{
+			int index = i * 32 + lowest_bit(live);
+
+			script_object_t* obj = &block->objects[index];
+			script_object_t* copy = get_heap_object(script);
+
+			*copy = *obj;
+
+			if(block->remembered[i] & (1U << (index & 31)))
+			{
+				script_heap_block_t* to = get_object_block(copy);
+				int to_index = (int)(copy - to->objects);
+
+				to->remembered[to_index >> 5] |= 1U << (to_index & 31);
+			}
+
+			obj->type = VAL_FORWARDED;
+			obj->forward = copy;
+		}
+	}
+}
+
+// NOTE: Only call this right after a full collection: nothing is gray, the
+// nursery is empty and everything allocated is live
+static void compact_heap(script_t* script)
+{
+	int num_sparse = 0;
+	int num_moving = 0;
+	int num_free_elsewhere = 0;
+
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+	{
+		int used = block->capacity - block->num_free;
+
+		block->evacuating = used > 0 && used * 100 < block->capacity * GC_COMPACT_OCCUPANCY;
+
+		if(block->evacuating)
+		{
+			++num_sparse;
+			num_moving += used;
+		}
+		else
+			num_free_elsewhere += block->num_free;
+	}
+
+	// NOTE: Moving one block's objects into a new block gets nothing back
+	if(num_sparse == 0 || (num_sparse == 1 && num_free_elsewhere < num_moving))
+	{
+		for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+			block->evacuating = 0;
+		return;
+	}
+
+	// NOTE: Nothing can be moved into a block that's being emptied
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+	{
+		if(block->evacuating)
+			remove_free_block(script, block);
+	}
+
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+	{
+		if(block->evacuating)
+			evacuate_block(script, block);
+	}
+
+	forward_value(&script->ret_val);
+	forward_values(&script->stack);
+	forward_values(&script->globals);
+	forward_values(&script->handles);
+
+	for(int i = 0; i < script->remembered.length; ++i)
+	{
+		script_object_t** obj = vec_get(&script->remembered, i);
+
+		if((*obj)->type == VAL_FORWARDED)
+			*obj = (*obj)->forward;
+	}
+
+	size_t freed = 0;
+
+	// NOTE: Objects that were moved are skipped since they're VAL_FORWARDED
+	walk_heap(script, forward_object, &freed);
+
+	script->marked_bytes = freed < script->marked_bytes ? script->marked_bytes - freed : 0;
+
+	script_heap_block_t** link = &script->heap_head;
+
+	while(*link)
+	{
+		script_heap_block_t* block = *link;
+
+		if(block->evacuating)
+		{
+			*link = block->next;
+			free_heap_block(block);
+
+			script->gc_compacted_blocks += 1;
+		}
+		else
+			link = &block->next;
+	}
+}
+
+static inline char is_young(script_t* script, script_object_t* obj)
+{
+	return script->nursery && (uintptr_t)obj - (uintptr_t)script->nursery < SCRIPT_NURSERY_SIZE * sizeof(script_object_t);
+}
+
+static void remember_object(script_t* script, script_object_t* obj)
+{
+	script_heap_block_t* block = get_object_block(obj);
+
+	int index = (int)(obj - block->objects);
+	uint32_t bit = 1U << (index & 31);
+
+	if(block->remembered[index >> 5] & bit) return;
+
+	block->remembered[index >> 5] |= bit;
+	vec_push_back(&script->remembered, &obj);
+}
+
+static inline char is_marked(script_object_t* obj)
+{
+	script_heap_block_t* block = get_object_block(obj);
+	int index = (int)(obj - block->objects);
+
+	return (block->marked[index >> 5] >> (index & 31)) & 1;
+}
+
+// NOTE: Sets obj's mark bit; returns 0 if it was already set
+static inline char set_marked(script_object_t* obj)
+{
+	script_heap_block_t* block = get_object_block(obj);
+
+	int index = (int)(obj - block->objects);
+	uint32_t bit = 1U << (index & 31);
+
+	if(block->marked[index >> 5] & bit) return 0;
+
+	block->marked[index >> 5] |= bit;
+	return 1;
+}
+
+// NOTE: Makes an object gray (marked but not scanned yet) if it's white
+static inline void shade(script_t* script, script_value_t value)
+{
+	if(!IS_OBJECT(value)) return;
+
+	gray_object_t gray = { AS_OBJECT(value), 0 };
+	if(set_marked(gray.obj))
+		vec_push_back(&script->gray, &gray);
+}
+
+// NOTE: Has to be called whenever val is stored into container (an array or
+// struct). For minor collections this lets them find the pointers from the
+// block heap into the nursery without looking at the whole heap, and while
+// incrementally marking it keeps black (marked and scanned) objects from
+// pointing at white ones the collector would never get to.
+static inline void write_barrier(script_t* script, script_object_t* container, script_value_t val)
+{
+	if(!IS_OBJECT(val)) return;
+
+	if(script->nursery)
+	{
+		if(is_young(script, AS_OBJECT(val)) && !is_young(script, container))
+			remember_object(script, container);
+	}
+	else if(script->gc_phase == GC_MARK && is_marked(container))
+		shade(script, val);
+}
+
+// NOTE: Objects allocated while marking start out black (see new_object),
+// so the values one is created with have to be shaded like any other store
+static void shade_values(script_t* script, vector_t* values)
+{
+	if(script->gc_phase != GC_MARK) return;
+
+	script_value_t* v = (script_value_t*)values->data;
+	for(int i = 0; i < values->length; ++i)
+		shade(script, v[i]);
+}
+
+// NOTE: Same thing for globals; a global can only hold a young object if it
+// was remembered when it got it, so only the first one needs remembering.
+// Globals are only shaded once per incremental cycle (when it begins), so
+// whatever is stored into one while marking is shaded here.
+static inline void global_write_barrier(script_t* script, int index, script_value_t val)
+{
+	if(!IS_OBJECT(val)) return;
+
+	if(script->gc_phase == GC_MARK)
+	{
+		shade(script, val);
+		return;
+	}
+
+	script_value_t prev = vec_get_value(&script->globals, index, script_value_t);
+
+	if(is_young(script, AS_OBJECT(val)) && !(IS_OBJECT(prev) && is_young(script, AS_OBJECT(prev))))
+		vec_push_back(&script->remembered_globals, &index);
+}
+
+// NOTE: If *slot refers to a young object it is moved into the block heap
+// (unless it was already) and *slot is updated to point at it there
+static void promote(script_t* script, script_value_t* slot)
+{
+	if(!IS_OBJECT(*slot)) return;
+
+	script_object_t* young = AS_OBJECT(*slot);
+	if(!is_young(script, young)) return;
+
+	if(young->type != VAL_FORWARDED)
+	{
+		script_object_t* obj = get_heap_object(script);
+		*obj = *young;
+		++script->num_objects;
+
+		young->type = VAL_FORWARDED;
+		young->forward = obj;
+
+		vec_push_back(&script->promoted, &obj);
+	}
+
+	*slot = OBJECT_VALUE(young->forward);
+}
+
+// NOTE: Promotes everything obj refers to
+static void promote_children(script_t* script, script_object_t* obj)
+{
+	vector_t* values = NULL;
+
+	if(obj->type == VAL_ARRAY)
+		values = obj->array;
+	else if(obj->type == VAL_STRUCT_INSTANCE)
+		values = &obj->ds->members;
+
+	if(!values) return;
+
+	for(int i = 0; i < values->length; ++i)
+		promote(script, vec_get(values, i));
+}
+
+// NOTE: Frees everything in the nursery that wasn't moved out
+static void release_nursery(script_t* script)
+{
+	for(int i = 0; i < script->nursery_top; ++i)
+	{
+		if(script->nursery[i].type == VAL_FORWARDED) continue;
+
+		// NOTE: Arrays can grow without being accounted for (e.g. by the host)
+		// so this might be more than was counted
+		size_t bytes = object_bytes(&script->nursery[i]);
+		script->heap_bytes = bytes < script->heap_bytes ? script->heap_bytes - bytes : 0;
+
+		if(script->gc_background_sweep)
+			defer_delete(script, &script->nursery[i]);
+		else
+			delete_object(script, &script->nursery[i]);
+	}
+
+	script->nursery_top = 0;
+}
+
+// NOTE: Minor collection; moves every young object which can be reached
+// from the roots or the remembered set into the block heap. Only the live
+// young objects are copied and scanned (the garbage still has to be freed
+// since strings, arrays and natives own memory).
+static void evacuate_nursery(script_t* script)
+{
+	promote(script, &script->ret_val);
+
+	for(int i = 0; i < script->stack.length; ++i)
+		promote(script, vec_get(&script->stack, i));
+
+	for(int i = 0; i < script->handles.length; ++i)
+		promote(script, vec_get(&script->handles, i));
+
+	for(int i = 0; i < script->remembered_globals.length; ++i)
+		promote(script, vec_get(&script->globals, vec_get_value(&script->remembered_globals, i, int)));
+
+	for(int i = 0; i < script->remembered.length; ++i)
+	{
+		script_object_t* obj = vec_get_value(&script->remembered, i, script_object_t*);
+		promote_children(script, obj);
+
+		script_heap_block_t* block = get_object_block(obj);
+		int index = (int)(obj - block->objects);
+
+		block->remembered[index >> 5] &= ~(1U << (index & 31));
+	}
+
+	while(script->promoted.length > 0)
+	{
+		script_object_t* obj;
+		vec_pop_back(&script->promoted, &obj);
+
+		promote_children(script, obj);
+	}
+
+	vec_clear(&script->remembered);
+	vec_clear(&script->remembered_globals);
+
+	release_nursery(script);
+	flush_dead(script);
+}
+
+// NOTE: Shades up to 'limit' of the values the object on top of the mark
+// stack refers to; it's popped once they've all been shaded (making it
+// black), otherwise it stays on the mark stack with where to pick up from.
+// Returns how much work that was.
+static int scan_gray(script_t* script, int limit)
+{
+	gray_object_t* top = vec_get(&script->gray, script->gray.length - 1);
+
+	script_object_t* obj = top->obj;
+	int start = top->index;
+
+	vector_t* values = NULL;
+
+	if(obj->type == VAL_ARRAY)
+		values = obj->array;
+	else if(obj->type == VAL_STRUCT_INSTANCE)
+		values = &obj->ds->members;
+
+	if(start == 0)
+	{
+		if(obj->type == VAL_NATIVE && obj->nat->on_mark)
+			obj->nat->on_mark(obj->nat->value);
+
+		script->marked_bytes += object_bytes(obj);
+	}
+
+	// NOTE: The array might have shrunk since the last piece was scanned;
+	// anything stored into it since then went through the write barrier
+	int end = values ? values->length : 0;
+
+	if(end - start > limit)
+	{
+		end = start + limit;
+		top->index = end;
+	}
+	else
+	{
+		--script->gray.length;
+
+		// NOTE: Hopefully the next object is in cache by the time it's scanned
+		if(script->gray.length > 0)
+			PREFETCH(((gray_object_t*)script->gray.data)[script->gray.length - 1].obj);
+	}
+
+	if(start >= end) return 1;
+
+	// NOTE: Shading can move the mark stack, so top isn't used past here
+	script_value_t* v = (script_value_t*)values->data;
+	for(int i = start; i < end; ++i)
+		shade(script, v[i]);
+
+	return 1 + end - start;
+}
+
+// NOTE: Scans until nothing is gray; the mark stack grows as needed so
+// deep structures (like long linked lists) don't use up the C stack
+static int drain_gray(script_t* script)
+{
+	int work = 0;
+
+	while(script->gray.length > 0)
+		work += scan_gray(script, INT_MAX);
+
+	return work;
+}
+
+static int shade_roots(script_t* script)
+{
+	shade(script, script->ret_val);
+
+	for(int i = 0; i < script->stack.length; ++i)
+		shade(script, vec_get_value(&script->stack, i, script_value_t));
+
+	for(int i = 0; i < script->globals.length; ++i)
+		shade(script, vec_get_value(&script->globals, i, script_value_t));
+
+	for(int i = 0; i < script->handles.length; ++i)
+		shade(script, vec_get_value(&script->handles, i, script_value_t));
+
+	return 1 + script->stack.length + script->globals.length + script->handles.length;
+}
+
+static void record_pause(script_t* script, double start_us)
+{
+	double pause = clock_us() - start_us;
+
+	script->gc_pause_total_us += pause;
+	if(pause > script->gc_pause_max_us)
+		script->gc_pause_max_us = pause;
+
+	int bucket = 0;
+	while(bucket < SCRIPT_GC_PAUSE_BUCKETS - 1 && pause >= SCRIPT_GC_PAUSE_BUCKET_US << bucket)
+		++bucket;
+
+	script->gc_pause_histogram[bucket] += 1;
+}
+
+static void gc_started(script_t* script)
+{
+	if(script->on_gc_start)
+		script->on_gc_start(script, script->gc_callback_data);
+}
+
+static void gc_finished(script_t* script)
+{
+	double now = clock_us();
+	double elapsed = now - script->gc_last_end_us;
+
+	if(elapsed > 0)
+		script->gc_allocation_rate = (script->allocated_bytes - script->gc_last_allocated_bytes) * 1000000.0 / elapsed;
+
+	script->gc_last_end_us = now;
+	script->gc_last_allocated_bytes = script->allocated_bytes;
+	script->gc_collections += 1;
+
+	if(script->alloc_profile)
+		count_survivors(script);
+
+	if(script->on_gc_end)
+		script->on_gc_end(script, script->gc_callback_data);
+}
+
+// NOTE: Where the running function's (or extern's) arguments start on the
+// stack; it can write anywhere from there up
+static inline int get_frame_base(script_t* script)
+{
+	if(script->frame_count == 0) return 0;
+
+	script_frame_t* frame = &script->frames[script->frame_count - 1];
+	return frame->stack_size - frame->nargs;
+}
+
+// NOTE: Has to be called whenever the stack might be written below the
+// running frame (i.e. a frame was popped); see finish_marking
+static inline void lower_stack_mark(script_t* script, int index)
+{
+	if(index < script->gc_stack_low)
+		script->gc_stack_low = index;
+}
+
+// NOTE: Nothing is freed until marking is over; objects allocated during
+// marking start out black (see new_object)
+static void begin_cycle(script_t* script)
+{
+	finish_sweep(script);
+	gc_started(script);
+
+	script->marked_bytes = 0;
+	shade_roots(script);
+	script->gc_stack_low = get_frame_base(script);
+	script->gc_phase = GC_MARK;
+}
+
+// NOTE: Called once nothing is gray. Globals and handles have barriers but
+// the stack doesn't, so it has to be shaded again before marking can
+// finish: everything from gc_stack_low up, which is the start of the
+// lowest frame the script returned to since the stack was last shaded (or
+// just the running frame). That's bounded by how far the stack unwound
+// rather than by the size of the heap; if it finds anything that wasn't
+// marked yet, marking carries on (in steps) and this happens again.
+static int finish_marking(script_t* script)
+{
+	int work = 1;
+
+	shade(script, script->ret_val);
+
+	for(int i = script->gc_stack_low; i < script->stack.length; ++i, ++work)
+		shade(script, vec_get_value(&script->stack, i, script_value_t));
+
+	script->gc_stack_low = get_frame_base(script);
+
+	if(script->gray.length > 0)
+		return work;
+
+	// NOTE: Whatever is allocated while sweeping is counted on top of this
+	script->heap_bytes = script->live_bytes = script->marked_bytes;
+	script->gc_threshold = next_gc_threshold(script, script->live_bytes);
+
+	begin_lazy_sweep(script);
+	script->gc_phase = GC_SWEEP;
+
+	return work;
+}
+
+// NOTE: Advances the incremental cycle by at least 'work' objects (a block
+// is always swept all at once)
+static void gc_work(script_t* script, int work)
+{
+	while(work > 0 && script->gc_phase != GC_IDLE)
+	{
+		if(script->gc_phase == GC_MARK)
+		{
+			if(script->gray.length == 0)
+			{
+				// NOTE: This is the one part of the cycle that isn't bounded
+				// by 'work', so it's what counts as its pause
+				double start = clock_us();
+				work -= finish_marking(script);
+				record_pause(script, start);
+				continue;
+			}
+
+			work -= scan_gray(script, work);
+		}
+		// NOTE: Allocating might have swept the rest (see get_heap_object)
+		else if(script->sweep_link && *script->sweep_link)
+		{
+			script_heap_block_t* block = *script->sweep_link;
+
+			// NOTE: Blocks added after marking finished (or already swept
+			// for their slots) have nothing to sweep
+			if(!block->unswept)
+			{
+				script->sweep_link = &block->next;
+				--work;
+				continue;
+			}
+
+			work -= SCRIPT_HEAP_BITMAP_WORDS + sweep_block(script, block);
+
+			if(!release_if_empty(script, script->sweep_link))
+				script->sweep_link = &block->next;
+		}
+		else
+		{
+			script->gc_phase = GC_IDLE;
+			script->sweep_link = NULL;
+
+			flush_dead(script);
+			gc_finished(script);
+		}
+	}
+}
+
+#ifdef SCRIPT_PARALLEL_MARK
+// NOTE: Parallel marking (see script_gc_set_threads). Every thread keeps
+// the gray objects it finds to itself until it has more than
+// GC_SHARE_THRESHOLD of them, then moves half into its shared deque.
+// Threads which run out of work take from their own shared deque and then
+// steal half of someone else's; marking is over once every thread is idle.
+
+// NOTE: Heaps with fewer objects than this are marked on one thread.
+// Starting and joining a thread takes tens of microseconds, while one
+// thread collects about 15 objects a microsecond (see -gcbench in test.c),
+// so a heap this big takes a few milliseconds and the threads cost around
+// a percent of that; much smaller heaps spend more on the threads than
+// they'd save.
+#define GC_PARALLEL_MIN_OBJECTS	65536
+#define GC_SHARE_THRESHOLD		256
+
+struct mark_pool;
+
+typedef struct
+{
+	struct mark_pool* pool;
+	pthread_t thread;
+	char thread_started;
+
+	vector_t local;		// NOTE: array of script_object_t*'s only this thread touches
+	vector_t shared;	// NOTE: array of script_object_t*'s anyone can steal (guarded by lock)
+	pthread_mutex_t lock;
+
+	// NOTE: shared.length, for looking at without taking the lock
+	size_t num_shared;
+
+	// NOTE: Added to script->marked_bytes once marking is done
+	size_t marked_bytes;
+} mark_worker_t;
+
+typedef struct mark_pool
+{
+	mark_worker_t* workers;
+	int num_workers;
+
+	int num_idle;
+
+	// NOTE: on_mark callbacks don't have to be thread safe
+	pthread_mutex_t native_lock;
+} mark_pool_t;
+
+static inline void shade_atomic(mark_worker_t* worker, script_value_t value)
+{
+	if(!IS_OBJECT(value)) return;
+
+	script_object_t* obj = AS_OBJECT(value);
+	script_heap_block_t* block = get_object_block(obj);
+
+	int index = (int)(obj - block->objects);
+	uint32_t bit = 1U << (index & 31);
+	uint32_t* word = &block->marked[index >> 5];
+
+	// NOTE: Only the thread which sets the bit gets to scan the object
+	if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return;
+	if(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return;
+
+	vec_push_back(&worker->local, &obj);
+}
+
+static void scan_object_atomic(mark_worker_t* worker, script_object_t* obj)
+{
+	vector_t* values = NULL;
+
+	if(obj->type == VAL_ARRAY)
+		values = obj->array;
+	else if(obj->type == VAL_STRUCT_INSTANCE)
+		values = &obj->ds->members;
+	else if(obj->type == VAL_NATIVE && obj->nat->on_mark)
+	{
+		pthread_mutex_lock(&worker->pool->native_lock);
+		obj->nat->on_mark(obj->nat->value);
+		pthread_mutex_unlock(&worker->pool->native_lock);
+	}
+
+	worker->marked_bytes += object_bytes(obj);
+
+	if(!values) return;
+
+	script_value_t* v = (script_value_t*)values->data;
+	for(int i = 0; i < values->length; ++i)
+		shade_atomic(worker, v[i]);
+}
+
+// NOTE: Moves the last n objects in from onto the end of to
+static void move_gray(vector_t* to, vector_t* from, size_t n)
+{
+	if(n == 0) return;
+
+	vec_copy_region(to, from, to->length, from->length - n, n);
+	from->length -= n;
+}
+
+static char find_work(mark_worker_t* worker)
+{
+	if(worker->local.length > 0) return 1;
+
+	mark_pool_t* pool = worker->pool;
+	int self = (int)(worker - pool->workers);
+
+	for(int i = 0; i < pool->num_workers; ++i)
+	{
+		mark_worker_t* victim = &pool->workers[(self + i) % pool->num_workers];
+
+		pthread_mutex_lock(&victim->lock);
+		if(victim == worker)
+			move_gray(&worker->local, &worker->shared, worker->shared.length);
+		else
+			move_gray(&worker->local, &victim->shared, (victim->shared.length + 1) / 2);
+		__atomic_store_n(&victim->num_shared, victim->shared.length, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&victim->lock);
+
+		if(worker->local.length > 0) return 1;
+	}
+
+	return 0;
+}
+
+static char any_shared_work(mark_pool_t* pool)
+{
+	for(int i = 0; i < pool->num_workers; ++i)
+	{
+		if(__atomic_load_n(&pool->workers[i].num_shared, __ATOMIC_RELAXED) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void* mark_worker_main(void* p)
+{
+	mark_worker_t* worker = p;
+	mark_pool_t* pool = worker->pool;
+
+	for(;;)
+	{
+		while(find_work(worker))
+		{
+			script_object_t* obj;
+			vec_pop_back(&worker->local, &obj);
+
+			if(worker->local.length > 0)
+				PREFETCH(((script_object_t**)worker->local.data)[worker->local.length - 1]);
+
+			scan_object_atomic(worker, obj);
+
+			if(worker->local.length > GC_SHARE_THRESHOLD && __atomic_load_n(&worker->num_shared, __ATOMIC_RELAXED) == 0)
+			{
+				pthread_mutex_lock(&worker->lock);
+				move_gray(&worker->shared, &worker->local, worker->local.length / 2);
+				__atomic_store_n(&worker->num_shared, worker->shared.length, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&worker->lock);
+			}
+		}
+
+		// NOTE: Only busy threads put work in the deques and they always empty
+		// their own before going idle, so once everyone is idle nothing is left
+		__atomic_add_fetch(&pool->num_idle, 1, __ATOMIC_ACQ_REL);
+
+		for(;;)
+		{
+			if(__atomic_load_n(&pool->num_idle, __ATOMIC_ACQUIRE) == pool->num_workers)
+				return NULL;
+
+			if(any_shared_work(pool))
+			{
+				__atomic_sub_fetch(&pool->num_idle, 1, __ATOMIC_ACQ_REL);
+				break;
+			}
+
+			sched_yield();
+		}
+	}
+}
+
+// NOTE: The roots are shaded on this thread and split evenly between the
+// workers; this thread is worker 0
+static void mark_parallel(script_t* script)
+{
+	mark_pool_t pool;
+
+	pool.num_workers = script->gc_threads;
+	pool.workers = emalloc(sizeof(mark_worker_t) * pool.num_workers);
+	pool.num_idle = 0;
+	pthread_mutex_init(&pool.native_lock, NULL);
+
+	shade_roots(script);
+
+	for(int i = 0; i < pool.num_workers; ++i)
+	{
+		mark_worker_t* worker = &pool.workers[i];
+
+		worker->pool = &pool;
+		vec_init(&worker->local, sizeof(script_object_t*));
+		vec_init(&worker->shared, sizeof(script_object_t*));
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->num_shared = 0;
+		worker->marked_bytes = 0;
+
+		size_t start = script->gray.length * i / pool.num_workers;
+		size_t end = script->gray.length * (i + 1) / pool.num_workers;
+
+		// NOTE: Nothing has been scanned yet so the gray objects' indices are 0
+		for(size_t j = start; j < end; ++j)
+			vec_push_back(&worker->local, &vec_get_value(&script->gray, j, gray_object_t).obj);
+	}
+
+	vec_clear(&script->gray);
+
+	for(int i = 1; i < pool.num_workers; ++i)
+	{
+		mark_worker_t* worker = &pool.workers[i];
+
+		// NOTE: If the thread can't be started this thread does its share;
+		// the worker just counts as idle from the start
+		if(pthread_create(&worker->thread, NULL, mark_worker_main, worker) != 0)
+		{
+			move_gray(&pool.workers[0].local, &worker->local, worker->local.length);
+
+			worker->thread_started = 0;
+			__atomic_add_fetch(&pool.num_idle, 1, __ATOMIC_ACQ_REL);
+		}
+		else
+			worker->thread_started = 1;
+	}
+
+	mark_worker_main(&pool.workers[0]);
+
+	for(int i = 1; i < pool.num_workers; ++i)
+	{
+		if(pool.workers[i].thread_started)
+			pthread_join(pool.workers[i].thread, NULL);
+	}
+
+	for(int i = 0; i < pool.num_workers; ++i)
+	{
+		mark_worker_t* worker = &pool.workers[i];
+
+		script->marked_bytes += worker->marked_bytes;
+
+		vec_destroy(&worker->local);
+		vec_destroy(&worker->shared);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	pthread_mutex_destroy(&pool.native_lock);
+	free(pool.workers);
+}
+#endif
+
+static void collect_garbage(script_t* script)
+{
+	double start = clock_us();
+
+	finish_sweep(script);
+	gc_started(script);
+
+	// NOTE: With the nursery empty only the block heap has to be marked
+	if(script->nursery_top > 0)
+		evacuate_nursery(script);
+
+	script->marked_bytes = 0;
+
+#ifdef SCRIPT_PARALLEL_MARK
+	if(script->gc_threads > 1 && script->num_objects >= GC_PARALLEL_MIN_OBJECTS)
+		mark_parallel(script);
+	else
+#endif
+	{
+		shade_roots(script);
+		drain_gray(script);
+	}
+
+	// NOTE: Compaction needs to know which slots are free
+	if(script->gc_background_sweep && !script->gc_compact)
+		begin_lazy_sweep(script);
+	else
+		sweep(script);
+
+	if(script->gc_compact)
+		compact_heap(script);
+
+	script->heap_bytes = script->live_bytes = script->marked_bytes;
+	script->gc_threshold = next_gc_threshold(script, script->live_bytes);
+
+	flush_dead(script);
+
+	gc_finished(script);
+	record_pause(script, start);
+}
+
+// NOTE: Only call this where nothing outside of the roots holds onto values
+static void collect_if_needed(script_t* script)
+{
+	if(script->finalize.length > 0 || script->dead.length > 0)
+		release_deferred(script, GC_RELEASE_BATCH);
+
+	if(script->gc_mode == SCRIPT_GC_INCREMENTAL)
+	{
+		if(script->gc_phase != GC_IDLE)
+			gc_work(script, GC_WORK_PER_ALLOC);
+		else if(script->heap_bytes >= script->gc_threshold)
+			begin_cycle(script);
+		return;
+	}
+
+	// NOTE: The nursery counts towards heap_bytes, so the threshold is only
+	// looked at once it's been emptied; otherwise young garbage would be
+	// what starts full collections
+	if(script->nursery)
+	{
+		if(script->nursery_top < SCRIPT_NURSERY_SIZE) return;
+
+		double start = clock_us();
+		evacuate_nursery(script);
+
+		script->gc_minor_collections += 1;
+		record_pause(script, start);
+	}
+
+	if(script->heap_bytes >= script->gc_threshold)
+		collect_garbage(script);
+}
+
+void script_set_gc_mode(script_t* script, script_gc_mode_t mode)
+{
+	if(mode == script->gc_mode) return;
+
+	// NOTE: Finish the cycle in progress
+	if(script->gc_mode == SCRIPT_GC_INCREMENTAL)
+		gc_work(script, INT_MAX);
+
+	if(mode == SCRIPT_GC_GENERATIONAL)
+		script->nursery = emalloc(SCRIPT_NURSERY_SIZE * sizeof(script_object_t));
+	else if(script->nursery)
+	{
+		evacuate_nursery(script);
+
+		free(script->nursery);
+		script->nursery = NULL;
+	}
+
+	script->gc_mode = mode;
+}
+
+void script_set_heap_block_size(script_t* script, int num_objects)
+{
+	if(num_objects < 1) num_objects = 1;
+	if(num_objects > (int)SCRIPT_HEAP_BLOCK_SIZE) num_objects = SCRIPT_HEAP_BLOCK_SIZE;
+
+	script->heap_block_size = num_objects;
+}
+
+void script_set_max_empty_blocks(script_t* script, int num_blocks)
+{
+	script->max_empty_blocks = num_blocks < 0 ? 0 : num_blocks;
+}
+
+void script_gc_get_config(script_t* script, script_gc_config_t* config)
+{
+	*config = script->gc_config;
+}
+
+void script_gc_set_config(script_t* script, const script_gc_config_t* config)
+{
+	script->gc_config = *config;
+
+	if(script->gc_config.growth_factor < 1)
+		script->gc_config.growth_factor = 1;
+
+	// NOTE: Nothing has been collected yet so there's nothing to grow from
+	if(script->live_bytes == 0)
+		script->gc_threshold = script->gc_config.initial_bytes;
+	else
+		script->gc_threshold = next_gc_threshold(script, script->live_bytes);
+}
+
+void script_set_native_size(script_t* script, script_native_t* nat, size_t bytes)
+{
+	if(bytes > nat->size)
+		count_allocated(script, bytes - nat->size);
+	else
+		script->heap_bytes = nat->size - bytes < script->heap_bytes ? script->heap_bytes - (nat->size - bytes) : 0;
+
+	nat->size = bytes;
+}
+
+void script_gc_set_compaction(script_t* script, char enabled)
+{
+	script->gc_compact = enabled;
+}
+
+void script_gc_set_callbacks(script_t* script, script_gc_callback_t on_start, script_gc_callback_t on_end, void* data)
+{
+	script->on_gc_start = on_start;
+	script->on_gc_end = on_end;
+	script->gc_callback_data = data;
+}
+
+static void clear_site(script_t* script, script_object_t* obj, void* data)
+{
+	obj->site = -1;
+}
+
+void script_set_alloc_profiling(script_t* script, char enabled)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+
+	if(enabled && !profile)
+	{
+		// NOTE: Sites from an earlier profile are gone
+		walk_heap(script, clear_site, NULL);
+
+		profile = emalloc(sizeof(alloc_profile_t));
+
+		vec_init(&profile->sites, sizeof(alloc_site_t));
+		vec_init(&profile->frames, sizeof(script_function_t));
+
+		for(int i = 0; i < ALLOC_PROFILE_BUCKETS; ++i)
+			profile->buckets[i] = -1;
+
+		script->alloc_profile = profile;
+	}
+	else if(!enabled && profile)
+	{
+		vec_destroy(&profile->sites);
+		vec_destroy(&profile->frames);
+		free(profile);
+
+		script->alloc_profile = NULL;
+	}
+}
+
+static const char* get_frame_name(script_t* script, script_function_t* frame)
+{
+	if(frame->is_extern)
+		return vec_get_value(&script->extern_names, frame->index, char*);
+	return vec_get_value(&script->function_names, frame->index, char*);
+}
+
+typedef struct
+{
+	char* name;
+	size_t count;
+	size_t bytes;
+	size_t survived_bytes;
+} alloc_summary_t;
+
+static void add_to_summary(vector_t* summary, hashmap_t* indices, const char* name, alloc_site_t* site)
+{
+	// NOTE: Indices are stored + 1 since map_get returns NULL when it's missing
+	intptr_t index = (intptr_t)map_get(indices, name) - 1;
+
+	if(index < 0)
+	{
+		alloc_summary_t entry;
+
+		entry.name = estrdup(name);
+		entry.count = entry.bytes = entry.survived_bytes = 0;
+
+		index = summary->length;
+		vec_push_back(summary, &entry);
+		map_set(indices, name, (void*)(index + 1));
+	}
+
+	alloc_summary_t* entry = vec_get(summary, index);
+
+	entry->count += site->count;
+	entry->bytes += site->bytes;
+	entry->survived_bytes += site->survived_bytes;
+}
+
+static int compare_summaries(const void* a, const void* b)
+{
+	const alloc_summary_t* sa = a;
+	const alloc_summary_t* sb = b;
+
+	return sa->bytes < sb->bytes ? 1 : (sa->bytes > sb->bytes ? -1 : 0);
+}
+
+static void write_summary(FILE* out, const char* title, vector_t* summary)
+{
+	if(summary->length > 0)
+		qsort(summary->data, summary->length, sizeof(alloc_summary_t), compare_summaries);
+
+	fprintf(out, "%s:\n%12s %14s %14s  %s\n", title, "count", "bytes", "survived", "where");
+
+	for(int i = 0; i < summary->length; ++i)
+	{
+		alloc_summary_t* entry = vec_get(summary, i);
+
+		fprintf(out, "%12zu %14zu %14zu  %s\n", entry->count, entry->bytes, entry->survived_bytes, entry->name);
+		free(entry->name);
+	}
+
+	fprintf(out, "\n");
+}
+
+void script_write_alloc_profile(script_t* script, FILE* out)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+	if(!profile) return;
+
+	vector_t lines, functions;
+	hashmap_t line_indices, function_indices;
+
+	vec_init(&lines, sizeof(alloc_summary_t));
+	vec_init(&functions, sizeof(alloc_summary_t));
+	map_init(&line_indices);
+	map_init(&function_indices);
+
+	for(int i = 0; i < profile->sites.length; ++i)
+	{
+		alloc_site_t* site = vec_get(&profile->sites, i);
+
+		const char* file;
+		int line;
+		char name[512];
+
+		get_source_position(script, site->pc, &file, &line);
+		snprintf(name, sizeof(name), "%s:%d", file, line);
+		add_to_summary(&lines, &line_indices, name, site);
+
+		if(site->num_frames > 0)
+			add_to_summary(&functions, &function_indices, get_frame_name(script, vec_get(&profile->frames, site->first_frame + site->num_frames - 1)), site);
+		else
+			add_to_summary(&functions, &function_indices, "<top level>", site);
+	}
+
+	write_summary(out, "Allocations by line", &lines);
+	write_summary(out, "Allocations by function", &functions);
+
+	map_destroy(&line_indices);
+	map_destroy(&function_indices);
+	vec_destroy(&lines);
+	vec_destroy(&functions);
+}
+
+void script_write_alloc_profile_collapsed(script_t* script, FILE* out)
+{
+	alloc_profile_t* profile = script->alloc_profile;
+	if(!profile) return;
+
+	for(int i = 0; i < profile->sites.length; ++i)
+	{
+		alloc_site_t* site = vec_get(&profile->sites, i);
+
+		for(int j = 0; j < site->num_frames; ++j)
+			fprintf(out, "%s;", get_frame_name(script, vec_get(&profile->frames, site->first_frame + j)));
+
+		const char* file;
+		int line;
+
+		get_source_position(script, site->pc, &file, &line);
+		fprintf(out, "%s:%d (%s) %zu\n", file, line, g_value_types[site->type], site->bytes);
+	}
+}
+
+static void count_object(script_t* script, script_object_t* obj, void* data)
+{
+	script_heap_stats_t* stats = data;
+
+	stats->objects[obj->type] += 1;
+	stats->bytes[obj->type] += object_bytes(obj);
+}
+
+void script_heap_stats(script_t* script, script_heap_stats_t* stats)
+{
+	// NOTE: Otherwise garbage in unswept blocks would count
+	if(script->gc_phase == GC_IDLE)
+		finish_sweep(script);
+
+	memset(stats, 0, sizeof(script_heap_stats_t));
+
+	stats->collections = script->gc_collections;
+	stats->minor_collections = script->gc_minor_collections;
+	stats->total_pause_us = script->gc_pause_total_us;
+	stats->max_pause_us = script->gc_pause_max_us;
+	memcpy(stats->pause_histogram, script->gc_pause_histogram, sizeof(stats->pause_histogram));
+
+	for(script_heap_block_t* block = script->heap_head; block; block = block->next)
+	{
+		stats->num_blocks += 1;
+		stats->num_slots += block->capacity;
+		stats->num_used_slots += block->capacity - block->num_free;
+	}
+
+	walk_heap(script, count_object, stats);
+
+	stats->occupancy = stats->num_slots > 0 ? (double)stats->num_used_slots / stats->num_slots : 0;
+	stats->num_empty_blocks = script->num_empty_blocks;
+	stats->compacted_blocks = script->gc_compacted_blocks;
+
+	stats->heap_bytes = script->heap_bytes;
+	stats->live_bytes = script->live_bytes;
+	stats->gc_threshold = script->gc_threshold;
+
+	stats->allocated_bytes = script->allocated_bytes;
+	stats->allocation_rate = script->gc_allocation_rate;
+}
+
+void script_gc_set_threads(script_t* script, int num_threads)
+{
+	script->gc_threads = num_threads < 1 ? 1 : num_threads;
+}
+
+void script_gc_set_background_sweep(script_t* script, char enabled)
+{
+	script->gc_background_sweep = enabled;
+
+	if(!enabled)
+		release_deferred(script, INT_MAX);
+}
+
+void script_gc_collect(script_t* script)
+{
+	if(script->in_extern) return;
+
+	if(script->gc_mode != SCRIPT_GC_INCREMENTAL)
+	{
+		collect_garbage(script);
+		return;
+	}
+
+	// NOTE: Finish the cycle in progress, which might have started before
+	// some of the garbage was made, and then do a whole one
+	gc_work(script, INT_MAX);
+
+	begin_cycle(script);
+	gc_work(script, INT_MAX);
+}
+
+void script_gc_step(script_t* script, int budget_us)
+{
+	if(script->in_extern) return;
+
+	// NOTE: Blocks a full collection left unswept and then the finalizers
+	// and frees left over from background sweeping are done first (in any
+	// gc mode)
+	double end = clock_us() + budget_us;
+
+	while(script->gc_phase == GC_IDLE && clock_us() < end && sweep_next_block(script))
+		flush_dead(script);
+
+	while((script->finalize.length > 0 || script->dead.length > 0) && clock_us() < end)
+		release_deferred(script, GC_STEP_WORK);
+
+	if(script->gc_mode != SCRIPT_GC_INCREMENTAL) return;
+
+	if(script->gc_phase == GC_IDLE)
+	{
+		// NOTE: Get a head start on the next cycle instead of waiting for
+		// allocation to start it
+		if(script->heap_bytes < script->gc_threshold / 4 * 3) return;
+		begin_cycle(script);
+	}
+
+	do
+		gc_work(script, GC_STEP_WORK);
+	while(script->gc_phase != GC_IDLE && clock_us() < end);
+}
+
+script_handle_scope_t script_handle_scope_open(script_t* script)
+{
+	if(script->in_extern)
+		++script->extern_handle_scopes;
+
+	return script->handles.length;
+}
+
+void script_handle_scope_close(script_t* script, script_handle_scope_t scope)
+{
+	if(scope < 0 || scope > script->handles.length)
+		error_exit_script(script, "Handle scopes have to be closed in the opposite order they were opened in\n");
+
+	if(script->in_extern && script->extern_handle_scopes > 0)
+		--script->extern_handle_scopes;
+
+	script->handles.length = scope;
+}
+
+// NOTE: Handles are only shaded when an incremental cycle begins, so
+// whatever they're given while marking is shaded right away
+script_handle_t script_new_handle(script_t* script, script_value_t val)
+{
+	if(script->gc_phase == GC_MARK)
+		shade(script, val);
+
+	vec_push_back(&script->handles, &val);
+	return script->handles.length - 1;
+}
+
+script_value_t script_get_handle(script_t* script, script_handle_t handle)
+{
+	return vec_get_value(&script->handles, handle, script_value_t);
+}
+
+void script_set_handle(script_t* script, script_handle_t handle, script_value_t val)
+{
+	if(script->gc_phase == GC_MARK)
+		shade(script, val);
+
+	vec_set(&script->handles, handle, &val);
+}
+
+void script_write_barrier(script_t* script, script_value_t container, script_value_t val)
+{
+	if(IS_OBJECT(container))
+		write_barrier(script, AS_OBJECT(container), val);
+}
+
+static script_object_t* get_heap_object(script_t* script)
+{
+	// NOTE: Unswept blocks are only swept once there's no free slot left
+	// in the swept ones (see begin_lazy_sweep)
+	while(!script->free_blocks && sweep_next_block(script))
+		flush_dead(script);
+
+	if(!script->free_blocks)
+		add_heap_block(script);
+
+	script_heap_block_t* block = script->free_blocks;
+
+	// NOTE: A block that had free slots when the heap was marked is on the
+	// free list before it's swept; it's swept before anything goes in it
+	if(block->unswept)
+	{
+		sweep_block(script, block);
+		flush_dead(script);
+	}
+
+	if(block->num_free == block->capacity)
+		--script->num_empty_blocks;
+
+	// NOTE: The lowest free bit is always a valid slot since there's
+	// a free one before the bits past the block's capacity
+	int i = 0;
+	while(block->live[i] == 0xFFFFFFFFU)
+		++i;
+
+	int bit = lowest_bit(~block->live[i]);
+
+	block->live[i] |= 1U << bit;
+
+	if(--block->num_free == 0)
+		remove_free_block(script, block);
+
+	return &block->objects[i * 32 + bit];
+}
+
+// NOTE: Externs can only collect while they (and any extern they were
+// called back from) have a handle scope open; otherwise they might be
+// holding onto values the collector can't see
+static int can_collect(script_t* script)
+{
+	return !script->in_extern || (script->extern_handle_scopes > 0 && !script->extern_unrooted);
+}
+
+static script_object_t* new_object(script_t* script, script_value_type_t type)
+{
+	if(can_collect(script)) collect_if_needed(script);
+	
+	script_object_t* obj;
+
+	if(script->nursery && script->nursery_top < SCRIPT_NURSERY_SIZE)
+		obj = &script->nursery[script->nursery_top++];
+	else
+	{
+		obj = get_heap_object(script);
+		++script->num_objects;
+
+		// NOTE: The nursery filled up inside an extern (which can't collect);
+		// whatever gets stored into this might be young
+		if(script->nursery)
+			remember_object(script, obj);
+		// NOTE: While marking, new objects are black since marking would
+		// never finish if it had to catch up with everything a script
+		// allocates
+		else if(script->gc_phase == GC_MARK)
+			set_marked(obj);
+	}
+	
+	count_allocated(script, fixed_bytes(type));
+
+	obj->type = type;
+	obj->site = script->alloc_profile ? record_alloc(script, type) : -1;
+
+	switch(type)
+	{
+		case VAL_ARRAY: obj->array = emalloc(sizeof(vector_t)); break;
+		case VAL_STRUCT_INSTANCE: obj->ds = emalloc(sizeof(script_struct_t)); break;
+		case VAL_NATIVE: obj->nat = emalloc(sizeof(script_native_t)); break;
+		default: break;
+	}
+	
+	return obj;
+}
+
+static script_value_t new_native_value(script_t* script, void* value, script_native_callback_t on_mark, script_native_callback_t on_delete)
+{
+	script_object_t* obj = new_object(script, VAL_NATIVE);
+
+	obj->nat->value = value;
+	obj->nat->on_mark = on_mark;
+	obj->nat->on_delete = on_delete;
+	obj->nat->size = 0;
+
+	return OBJECT_VALUE(obj);
+}
+
+// NOTE: String constants get an immortal object so that pushing them doesn't
+// allocate. They live in blocks of their own (constant_blocks) which are
+// never swept and have every mark bit set, so the collector never touches
+// them. Strings are never modified in place so these share their characters
+// with script->strings. Existing objects are never moved since they can
+// be referenced from anywhere.
+static void materialize_constants(script_t* script)
+{
+	while(script->string_values.length < script->strings.length)
+	{
+		script_heap_block_t* block = script->constant_blocks;
+
+		if(!block || block->num_free == 0)
+		{
+			block = alloc_heap_block(SCRIPT_HEAP_BLOCK_SIZE);
+			memset(block, 0, offsetof(script_heap_block_t, objects));
+
+			block->next = script->constant_blocks;
+			block->capacity = block->num_free = SCRIPT_HEAP_BLOCK_SIZE;
+			memset(block->marked, 0xFF, sizeof(block->marked));
+
+			script->constant_blocks = block;
+		}
+
+		script_object_t* obj = &block->objects[block->capacity - block->num_free--];
+
+		obj->type = VAL_STRING;
+		obj->site = -1;
+		obj->string = vec_get_value(&script->strings, script->string_values.length, script_string_t);
+
+		vec_push_back(&script->string_values, &obj);
+	}
+}
+
+// NOTE: Makes room for at least 'count' more values on the stack. The
+// stack moves when it grows, so the arguments of the externs running
+// right now are pointed at the new one.
+static void grow_stack(script_t* script, int count)
+{
+	size_t capacity = script->stack.capacity * 2;
+	if(capacity < script->stack.length + count)
+		capacity = script->stack.length + count;
+
+	if(capacity > MAX_STACK_SIZE)
+		error_exit_script(script, "Stack overflow!\n");
+
+	vec_reserve(&script->stack, capacity);
+
+	for(int i = 0; i < script->frame_count; ++i)
+	{
+		script_frame_t* frame = &script->frames[i];
+
+		if(frame->args)
+			frame->args->data = frame->nargs > 0 ? vec_get(&script->stack, frame->stack_size - frame->nargs) : NULL;
+	}
+}
+
+static inline void reserve_stack(script_t* script, int count)
+{
+	if(script->stack.length + count > script->stack.capacity)
+		grow_stack(script, count);
+}
+
+static void push_value(script_t* script, script_value_t val)
+{
+	reserve_stack(script, 1);
+	((script_value_t*)script->stack.data)[script->stack.length++] = val;
+}
+
+// NOTE: For the interpreter, which only pushes into the space reserved
+// when the current frame was entered (get_stack_size has to account for
+// every push, which the assert checks in debug builds)
+static inline void push_reserved(script_t* script, script_value_t val)
+{
+	assert(script->stack.length < script->stack.capacity);
+	((script_value_t*)script->stack.data)[script->stack.length++] = val;
+}
+
+static script_value_t pop_value(script_t* script)
 {
 	if(script->stack.length == 0) error_exit_script(script, "Stack underflow\n");
 	
-	script_value_t* val;
+	script_value_t val;
 	vec_pop_back(&script->stack, &val);
 	
 	return val;
@@ -5641,273 +8612,630 @@ static script_value_t* pop_value(script_t* script)
 void script_set_arg(script_t* script, int index, int nargs)
 {
 	if (script->fp == 0 || script->pc < 0) return;
-	script_value_t* val = pop_value(script);
+	script_value_t val = pop_value(script);
+	lower_stack_mark(script, script->fp + (index - nargs));
 	vec_set(&script->stack, script->fp + (index - nargs), &val);
 }
 
 void script_push_bool(script_t* script, char bv)
 {
-	// NOTE: Singleton values
-	// which never get gc'd
-	static script_value_t true_val = { 0 };
-	static script_value_t false_val = { 0 };
-
-	true_val.type = VAL_BOOL;
-	true_val.boolean = 1;
-	
-	false_val.type = VAL_BOOL;
-	false_val.boolean = 0;
-
-	push_value(script, bv ? &true_val : &false_val);
+	push_value(script, BOOL_VALUE(bv));
 }
 
 char script_pop_bool(script_t* script)
 {	
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_BOOL)
-		error_exit_script(script, "Expected bool but received %s\n", g_value_types[val->type]);
+	script_value_t val = pop_value(script);
+	if(!IS_IMMEDIATE(val, IMM_BOOL))
+		error_exit_script(script, "Expected bool but received %s\n", g_value_types[get_value_type(val)]);
 
-	return val->boolean;
+	return AS_BOOL(val);
 }
 
 void script_push_char(script_t* script, char code)
 {
-	script_value_t* val = new_value(script, VAL_CHAR);
-	val->code = code;
-	push_value(script, val);
+	push_value(script, CHAR_VALUE(code));
 }
 
 char script_pop_char(script_t* script)
 {
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_CHAR)
-		error_exit_script(script, "Expected char but received %s\n", g_value_types[val->type]);
+	script_value_t val = pop_value(script);
+	if(!IS_IMMEDIATE(val, IMM_CHAR))
+		error_exit_script(script, "Expected char but received %s\n", g_value_types[get_value_type(val)]);
+
+	return AS_CHAR(val);
+}
+
+void script_push_number(script_t* script, double number)
+{
+	push_value(script, number_value(number));
+}
+
+double script_pop_number(script_t* script)
+{
+	script_value_t val = pop_value(script);
+	if(!IS_NUMBER(val))
+		error_exit_script(script, "Expected number but received %s\n", g_value_types[get_value_type(val)]);
+	
+	return as_number(val);
+}
+
+void script_push_cstr(script_t* script, const char* string)
+{
+	script_object_t* obj = new_object(script, VAL_STRING);
+	obj->string.length = strlen(string);
+	obj->string.data = emalloc(obj->string.length + 1);
+	strcpy(obj->string.data, string);
+	account_payload(script, obj);
+	
+	push_value(script, OBJECT_VALUE(obj));
+}
+
+void script_push_string(script_t* script, script_string_t string)
+{
+	script_object_t* obj = new_object(script, VAL_STRING);
+	obj->string.length = string.length;
+	obj->string.data = emalloc(string.length + 1);
+	strcpy(obj->string.data, string.data);
+	account_payload(script, obj);
+	
+	push_value(script, OBJECT_VALUE(obj));
+}
+
+// NOTE: Returns the object if val is an object of the given type
+static script_object_t* get_object(script_value_t val, script_value_type_t type)
+{
+	if(!IS_OBJECT(val) || AS_OBJECT(val)->type != type)
+		return NULL;
+
+	return AS_OBJECT(val);
+}
+
+// NOTE: Pops an object of the given type; 'expected' is what the error calls it
+static script_object_t* pop_object(script_t* script, script_value_type_t type, const char* expected)
+{
+	script_value_t val = pop_value(script);
+	script_object_t* obj = get_object(val, type);
+	if(!obj)
+		error_exit_script(script, "Expected %s but received %s\n", expected, g_value_types[get_value_type(val)]);
+	return obj;
+}
+
+script_string_t script_pop_string(script_t* script)
+{
+	return pop_object(script, VAL_STRING, "string")->string;
+}
+
+void script_push_array(script_t* script, size_t length)
+{
+	script_object_t* obj = new_object(script, VAL_ARRAY);
+	vec_init(obj->array, sizeof(script_value_t));
+	vec_reserve(obj->array, length);
+	account_payload(script, obj);
+	push_value(script, OBJECT_VALUE(obj));
+}
+
+void script_push_premade_array(script_t* script, vector_t array)
+{
+	script_object_t* obj = new_object(script, VAL_ARRAY);
+	*obj->array = array;
+	shade_values(script, obj->array);
+	account_payload(script, obj);
+	push_value(script, OBJECT_VALUE(obj));
+}
+
+vector_t* script_pop_array(script_t* script)
+{
+	return pop_object(script, VAL_ARRAY, "array")->array;
+}
+
+static script_function_t pop_func(script_t* script)
+{
+	script_value_t val = pop_value(script);
+	if(get_value_type(val) != VAL_FUNC) error_exit_script(script, "Expected function but received %s\n", g_value_types[get_value_type(val)]);
+	return as_function(val);
+}
+
+
+void script_push_native(script_t* script, void* value, script_native_callback_t on_mark, script_native_callback_t on_delete)
+{
+	push_value(script, new_native_value(script, value, on_mark, on_delete));
+}
+
+script_native_t* script_pop_native(script_t* script)
+{
+	return pop_object(script, VAL_NATIVE, "native")->nat;
+}
+
+script_value_t script_get_arg(vector_t* args, int index)
+{
+	return vec_get_value(args, index, script_value_t);
+}
+
+script_value_type_t script_get_type(script_value_t val)
+{
+	return get_value_type(val);
+}
+
+char script_to_bool(script_value_t val)
+{
+	return AS_BOOL(val);
+}
+
+char script_to_char(script_value_t val)
+{
+	return AS_CHAR(val);
+}
+
+double script_to_number(script_value_t val)
+{
+	return as_number(val);
+}
+
+script_function_t script_to_function(script_value_t val)
+{
+	return as_function(val);
+}
+
+script_string_t script_to_string(script_value_t val)
+{
+	return AS_OBJECT(val)->string;
+}
+
+vector_t* script_to_array(script_value_t val)
+{
+	return AS_OBJECT(val)->array;
+}
+
+script_struct_t* script_to_struct(script_value_t val)
+{
+	return AS_OBJECT(val)->ds;
+}
+
+script_native_t* script_to_native(script_value_t val)
+{
+	return AS_OBJECT(val)->nat;
+}
+
+script_value_t script_bool_value(char bv)
+{
+	return BOOL_VALUE(bv);
+}
+
+script_value_t script_char_value(char code)
+{
+	return CHAR_VALUE(code);
+}
+
+script_value_t script_number_value(double number)
+{
+	return number_value(number);
+}
+
+script_value_t script_function_value(script_function_t function)
+{
+	return function_value(function.is_extern, function.index);
+}
+
+static char is_value_null(script_value_t val)
+{
+	return val == NULL_VALUE;
+}
+
+void script_push_null(script_t* script)
+{
+	push_value(script, NULL_VALUE);
+}
+
+void script_return_top(script_t* script)
+{
+	script->ret_val = pop_value(script);
+}
+
+static script_struct_t* pop_struct(script_t* script)
+{
+	return pop_object(script, VAL_STRUCT_INSTANCE, "struct")->ds;
+}
+
+// NOTE: Arguments with the dynamic type get past the declaration check
+static script_typed_value_t to_typed_value(script_t* script, script_value_t val, char type)
+{
+	script_typed_value_t typed = { 0 };
+	script_value_type_t val_type = get_value_type(val);
+
+	switch(type)
+	{
+		case 'n':
+		{
+			if(!IS_NUMBER(val)) break;
+			typed.number = as_number(val);
+		} return typed;
+
+		case 'b':
+		{
+			if(!IS_IMMEDIATE(val, IMM_BOOL)) break;
+			typed.bv = AS_BOOL(val);
+		} return typed;
+
+		case 'c':
+		{
+			if(!IS_IMMEDIATE(val, IMM_CHAR)) break;
+			typed.code = AS_CHAR(val);
+		} return typed;
+
+		case 's':
+		{
+			if(val_type != VAL_STRING && val_type != VAL_NULL) break;
+			typed.string.data = val_type == VAL_NULL ? NULL : AS_OBJECT(val)->string.data;
+			typed.string.length = val_type == VAL_NULL ? 0 : AS_OBJECT(val)->string.length;
+		} return typed;
+
+		case 'p':
+		{
+			if(val_type != VAL_NATIVE && val_type != VAL_NULL) break;
+			typed.native = val_type == VAL_NULL ? NULL : AS_OBJECT(val)->nat->value;
+		} return typed;
+	}
+
+	error_exit_script(script, "Typed extern expected '%c' but received %s\n", type, g_value_types[val_type]);
+	return typed;
+}
+
+static script_value_t from_typed_value(script_t* script, script_typed_value_t typed, char type)
+{
+	switch(type)
+	{
+		case 'n': return number_value(typed.number);
+		case 'b': return BOOL_VALUE(typed.bv);
+		case 'c': return CHAR_VALUE(typed.code);
+
+		case 's':
+		{
+			script_object_t* obj = new_object(script, VAL_STRING);
+			obj->string.length = typed.string.length;
+			obj->string.data = emalloc(typed.string.length + 1);
+			memcpy(obj->string.data, typed.string.data, typed.string.length);
+			obj->string.data[typed.string.length] = '\0';
+			account_payload(script, obj);
+
+			return OBJECT_VALUE(obj);
+		}
+
+		// NOTE: The host still owns what the pointer points to (see
+		// script_bind_extern_typed)
+		case 'p': return new_native_value(script, typed.native, NULL, NULL);
+
+		default: return NULL_VALUE;
+	}
+}
+
+static void push_frame(script_t* script, script_function_t function, word nargs);
+
+// NOTE: Unlike other externs these leave script->in_extern alone and
+// their frame has no args (it's only there for stack traces); the
+// arguments stay on the stack until the result is boxed, since boxing it
+// can collect
+static void call_typed_extern(script_t* script, script_function_t function, int nargs, const char* signature)
+{
+	push_frame(script, function, nargs);
+
+	script_typed_value_t args[SCRIPT_MAX_TYPED_ARGS];
+	script_value_t* values = (script_value_t*)script->stack.data + (script->stack.length - nargs);
+
+	for(int i = 0; i < nargs; ++i)
+		args[i] = to_typed_value(script, values[i], signature[i]);
+
+	script_typed_value_t result = vec_get_value(&script->typed_externs, function.index, script_typed_extern_t)(script, args);
+
+	script->ret_val = from_typed_value(script, result, signature[nargs + 1]);
+	script->stack.length -= nargs;
+
+	--script->frame_count;
+	lower_stack_mark(script, get_frame_base(script));
+}
+
+// NOTE: Externs get a frame too (so they show up in stack traces) but it
+// only needs popping; they don't touch pc or fp
+static void push_frame(script_t* script, script_function_t function, word nargs)
+{
+	if (script->frame_count == script->frame_capacity)
+	{
+		if (script->frame_capacity * 2 > MAX_FRAMES) error_exit_script(script, "Stack overflow!\n");
+
+		script_frame_t* frames = realloc(script->frames, sizeof(script_frame_t) * script->frame_capacity * 2);
+		if (!frames) error_exit_script(script, "Out of memory!\n");
+
+		script->frames = frames;
+		script->frame_capacity *= 2;
+	}
+
+	script_frame_t* frame = &script->frames[script->frame_count++];
+
+	frame->pc = script->pc;
+	frame->fp = script->fp;
+	frame->nargs = (int)nargs;
+	frame->stack_size = script->stack.length;
+	frame->function = function;
+	frame->args = NULL;
+}
+
+static void push_stack_frame(script_t* script, script_function_t function, word nargs)
+{
+	push_frame(script, function, nargs);
+
+	script->fp = script->stack.length;
+	++script->indir_depth;
+
+	reserve_stack(script, vec_get_value(&script->function_stack_sizes, function.index, int));
+}
+
+static void pop_stack_frame(script_t* script)
+{
+	if (script->indir_depth <= 0)
+	{
+		script->pc = -1;
+		vec_clear(&script->stack);
+		return;
+	}
+	
+	script_frame_t* frame = &script->frames[--script->frame_count];
+
+	// NOTE: Remove local values and arguments
+	script->stack.length = script->fp - frame->nargs;
 
-	return val->code;
-}
+	// NOTE: Reset pc and fp
+	script->pc = frame->pc;
+	script->fp = frame->fp;
 
-void script_push_number(script_t* script, double number)
-{
-	script_value_t* val = new_value(script, VAL_NUMBER);
-	val->number = number;
-	push_value(script, val);
-}
+	--script->indir_depth;
 
-double script_pop_number(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_NUMBER)
-		error_exit_script(script, "Expected number but received %s\n", g_value_types[val->type]);
-	
-	return val->number;
+	lower_stack_mark(script, get_frame_base(script));
 }
 
-void script_push_cstr(script_t* script, const char* string)
+// NOTE: Size in bytes of the operands which follow an opcode in script->code
+static int get_operand_size(word op)
 {
-	script_value_t* val = new_value(script, VAL_STRING);
-	val->string.length = strlen(string);
-	val->string.data = emalloc(val->string.length + 1);
-	strcpy(val->string.data, string);
-	
-	push_value(script, val);
-}
+	switch(op)
+	{
+		case OP_CALL:
+		case OP_TAIL_CALL: return 1;
+
+		case OP_REG_ADD:
+		case OP_REG_SUB:
+		case OP_REG_MUL:
+		case OP_REG_DIV:
+		case OP_REG_MOD:
+		case OP_REG_LT:
+		case OP_REG_GT:
+		case OP_REG_LTE:
+		case OP_REG_GTE: return 3 * sizeof(int);
 
-void script_push_string(script_t* script, script_string_t string)
-{
-	script_value_t* val = new_value(script, VAL_STRING);
-	val->string.length = string.length;
-	val->string.data = emalloc(string.length + 1);
-	strcpy(val->string.data, string.data);
-	
-	push_value(script, val);
-}
+		case OP_PUSH_STRUCT:
+		case OP_REG_MOVE:
+		case OP_REG_NEG:
+		case OP_REG_GOTOZ: return 2 * sizeof(int);
 
-script_string_t script_pop_string(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if (val->type != VAL_STRING)
-		error_exit_script(script, "Expected string but received %s\n", g_value_types[val->type]);
-	return val->string;
-}
+		case OP_PUSH_CHAR:
+		case OP_PUSH_NUMBER:
+		case OP_PUSH_STRING:
+		case OP_PUSH_FUNC:
+		case OP_PUSH_EXTERN_FUNC:
+		case OP_PUSH_ARRAY_BLOCK:
+		case OP_STRUCT_GET:
+		case OP_STRUCT_SET:
+		case OP_GOTO:
+		case OP_GOTOZ:
+		case OP_GOTOZ_BOOL:
+		case OP_SET:
+		case OP_GET:
+		case OP_SETLOCAL:
+		case OP_GETLOCAL:
+		case OP_RESERVE: return sizeof(int);
 
-void script_push_array(script_t* script, size_t length)
-{
-	script_value_t* val = new_value(script, VAL_ARRAY);
-	vec_init(&val->array, sizeof(script_value_t*));
-	vec_reserve(&val->array, length);
-	push_value(script, val);
+		default: return 0;
+	}
 }
 
-void script_push_premade_array(script_t* script, vector_t array)
+// NOTE: Rewrites the first instruction of common sequences into a
+// superinstruction which does the work of the whole sequence and then
+// skips over the rest of it. The rest of the sequence is left in place,
+// so jumps which land in the middle of one still work.
+// The sequences are the most frequent opcode pairs in the histogram
+// (see SCRIPT_OP_HISTOGRAM) of our scripts: loading two operands, the
+// arithmetic and the store of "x = x + 1", compare and branch, and calls
+// to known functions (which no longer have to allocate a function value).
+// Runs of OP_PUSH_NULL (a function's locals) turn into one OP_RESERVE.
+static void fuse_instructions(script_t* script)
 {
-	script_value_t* val = new_value(script, VAL_ARRAY);
-	val->array = array;
-	push_value(script, val);
-}
+	script_instr_t* code = (script_instr_t*)script->instrs.data;
+	int length = script->instrs.length;
 
-vector_t* script_pop_array(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_ARRAY) error_exit_script(script, "Expected array but received %s\n", g_value_types[val->type]);
-	return &val->array;
-}
+	for(int i = 0; i < length; )
+	{
+		script_instr_t* ip = &code[i];
+		int remaining = length - i;
+		int n = 1;
 
-static void push_func(script_t* script, char is_extern, int index)
-{
-	script_value_t* val = new_value(script, VAL_FUNC);
-	val->function.is_extern = is_extern;
-	val->function.index = index;
-	push_value(script, val);
-}
+		#define MATCH2(first, second) (remaining >= 2 && ip[0].op == (first) && ip[1].op == (second))
 
-static script_function_t pop_func(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_FUNC) error_exit_script(script, "Expected function but received %s\n", g_value_types[val->type]);
-	return val->function;
-}
+		if(remaining >= 4 && ip[0].op == OP_PUSH_NUMBER && ip[2].op == OP_ADD_NUM && ip[1].a == ip[3].a &&
+		   ((ip[1].op == OP_GETLOCAL && ip[3].op == OP_SETLOCAL) || (ip[1].op == OP_GET && ip[3].op == OP_SET)))
+		{
+			ip->op = ip[1].op == OP_GETLOCAL ? OP_ADD_LOCAL_NUM : OP_ADD_GLOBAL_NUM;
+			ip->b = ip[1].a;
+			n = 4;
+		}
+		else if(ip->op == OP_PUSH_NULL)
+		{
+			while(n < remaining && ip[n].op == OP_PUSH_NULL)
+				++n;
 
+			if(n > 1)
+			{
+				ip->op = OP_RESERVE;
+				ip->a = n;
+				ip->b = n - 1;
+			}
+		}
+		else if(MATCH2(OP_GETLOCAL, OP_GETLOCAL))
+		{
+			ip->op = OP_GETLOCAL2;
+			ip->b = ip[1].a;
+			n = 2;
+		}
+		else if(MATCH2(OP_PUSH_NUMBER, OP_GETLOCAL) || MATCH2(OP_PUSH_NUMBER, OP_GET))
+		{
+			ip->op = ip[1].op == OP_GETLOCAL ? OP_PUSH_NUMBER_GETLOCAL : OP_PUSH_NUMBER_GET;
+			ip->b = ip[1].a;
+			n = 2;
+		}
+		else if(MATCH2(OP_ADD_NUM, OP_SETLOCAL) || MATCH2(OP_ADD_NUM, OP_SET))
+		{
+			ip->op = ip[1].op == OP_SETLOCAL ? OP_ADD_NUM_SETLOCAL : OP_ADD_NUM_SET;
+			ip->a = ip[1].a;
+			n = 2;
+		}
+		else if(MATCH2(OP_LT_NUM, OP_GOTOZ_BOOL))
+		{
+			ip->op = OP_LT_NUM_GOTOZ;
+			ip->a = ip[1].a;
+			n = 2;
+		}
+		else if(MATCH2(OP_PUSH_FUNC, OP_CALL) || MATCH2(OP_PUSH_EXTERN_FUNC, OP_CALL) || MATCH2(OP_PUSH_EXTERN_FUNC, OP_TAIL_CALL))
+		{
+			ip->op = ip->op == OP_PUSH_FUNC ? OP_CALL_FUNC : OP_CALL_EXTERN;
+			ip->b = ip[1].a;
+			n = 2;
+		}
+		else if(MATCH2(OP_PUSH_FUNC, OP_TAIL_CALL))
+		{
+			ip->op = OP_TAIL_CALL_FUNC;
+			ip->b = ip[1].a;
+			n = 2;
+		}
 
-void script_push_native(script_t* script, void* value, script_native_callback_t on_mark, script_native_callback_t on_delete)
-{
-	script_value_t* val = new_value(script, VAL_NATIVE);
-	val->nat.value = value;
-	val->nat.on_mark = on_mark;
-	val->nat.on_delete = on_delete;
-	push_value(script, val);
-}
+		#undef MATCH2
 
-script_native_t* script_pop_native(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_NATIVE) error_exit_script(script, "Expected native but received %s\n", g_value_types[val->type]);
-	return &val->nat;
+		i += n;
+	}
 }
 
-script_value_t* script_get_arg(vector_t* args, int index)
+// NOTE: Decodes script->code into script->instrs. Jump targets and
+// function pcs are remapped from byte offsets to instruction indices.
+// Linking the same code prefix always produces the same instruction
+// indices, so pcs saved in call frames stay valid when more code
+// gets compiled (and linked) while the script is running.
+static void link_code(script_t* script)
 {
-	return vec_get_value(args, index, script_value_t*);
-}
+	if(script->linked) return;
 
-static char is_value_null(script_value_t* val)
-{
-	return val->type == VAL_NULL;
-}
+	vec_clear(&script->instrs);
+	vec_clear(&script->instr_offsets);
 
-void script_push_null(script_t* script)
-{
-	static script_value_t null_value;
-	null_value.type = VAL_NULL;
-	push_value(script, &null_value);
-}
+	// NOTE: offset in code -> instruction index (only valid at the start of instructions)
+	int* offset_map = emalloc((script->code.length + 1) * sizeof(int));
 
-void script_return_top(script_t* script)
-{
-	script->ret_val = pop_value(script);
-}
+	int offset = 0;
+	while(offset < script->code.length)
+	{
+		const word* code = &script->code.data[offset];
+		int size = get_operand_size(code[0]);
 
-static void push_struct(script_t* script, vector_t members)
-{
-	script_value_t* val = new_value(script, VAL_STRUCT_INSTANCE);
-	val->ds.members = members;
-	push_value(script, val);
-}
+		int operands[3] = { 0 };
 
-static script_struct_t* pop_struct(script_t* script)
-{
-	script_value_t* val = pop_value(script);
-	if(val->type != VAL_STRUCT_INSTANCE) error_exit_script(script, "Expected struct but received %s\n", g_value_types[val->type]);
-	return &val->ds;
-}
+		if(code[0] == OP_CALL || code[0] == OP_TAIL_CALL)
+			operands[0] = code[1];
+		else
+			memcpy(operands, &code[1], size);
 
-// TODO: Check for overflows/underflows here (esp. the s
-static void push_stack_frame(script_t* script, word nargs)
-{
-	int i_nargs = (int)nargs;
+		script_instr_t instr = { code[0], operands[0], operands[1], operands[2] };
 
-	vec_push_back(&script->indir, &i_nargs);
-	vec_push_back(&script->indir, &script->fp);
-	vec_push_back(&script->indir, &script->pc);
-	
-	script->fp = script->stack.length;
-	++script->indir_depth;
-}
+		offset_map[offset] = script->instrs.length;
 
-static void push_call_record(script_t* script, script_function_t function, word nargs)
-{
-	script_call_record_t record;
+		vec_push_back(&script->instrs, &instr);
+		vec_push_back(&script->instr_offsets, &offset);
 
-	record.stack_size = script->stack.length;
-	record.pc = script->pc - 1;
-	record.fp = script->fp;
-	record.nargs = nargs;
-	record.function = function;
-	record.file = script->cur_file;
-	record.line = script->cur_line;
+		offset += 1 + size;
+	}
 
-	vec_push_back(&script->call_records, &record);
-}
+	offset_map[script->code.length] = script->instrs.length;
 
-static void pop_call_record(script_t* script)
-{
-	script_call_record_t record;
+	// NOTE: Running off the end of the code halts the script
+	script_instr_t halt = { OP_HALT, 0, 0, 0 };
+	vec_push_back(&script->instrs, &halt);
+	vec_push_back(&script->instr_offsets, &offset);
 
-	if(script->call_records.length > 0)
-		vec_pop_back(&script->call_records, &record);
-}
+	for(int i = 0; i < script->instrs.length; ++i)
+	{
+		script_instr_t* instr = vec_get(&script->instrs, i);
+		if(instr->op == OP_GOTO || instr->op == OP_GOTOZ || instr->op == OP_GOTOZ_BOOL)
+			instr->a = offset_map[instr->a];
+		else if(instr->op == OP_REG_GOTOZ)
+			instr->b = offset_map[instr->b];
+	}
 
-static void pop_stack_frame(script_t* script)
-{
-	if (script->indir_depth <= 0)
+	vec_resize(&script->linked_function_pcs, script->function_pcs.length, NULL);
+	for(int i = 0; i < script->function_pcs.length; ++i)
 	{
-		script->pc = -1;
-		vec_clear(&script->stack);
-		return;
+		int pc = vec_get_value(&script->function_pcs, i, int);
+		if(pc >= 0)
+			pc = offset_map[pc];
+
+		vec_set(&script->linked_function_pcs, i, &pc);
 	}
-	
-	// NOTE: Remove local values
-	vec_resize(&script->stack, script->fp, NULL);
 
-	// NOTE: Reset pc and fp
-	vec_pop_back(&script->indir, &script->pc);
-	vec_pop_back(&script->indir, &script->fp);
+	free(offset_map);
+
+	fuse_instructions(script);
+	materialize_constants(script);
 	
-	int nargs;
-	vec_pop_back(&script->indir, &nargs);
+	script->linked = 1;
+}
+
+// NOTE: Converts an offset into script->code (like a module's start_pc)
+// into an index into script->instrs
+static int get_linked_pc(script_t* script, int offset)
+{
+	link_code(script);
 
-	// NOTE: Remove arguments
-	vec_resize(&script->stack, script->stack.length - nargs, NULL);
+	int lo = 0;
+	int hi = script->instr_offsets.length - 1;
 
-	--script->indir_depth;
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(vec_get_value(&script->instr_offsets, mid, int) < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static int read_int_at(script_t* script, int pc)
+static void write_reg_operand(script_t* script, int operand, FILE* out)
 {
-	int value = 0;
-	word* vp = (word*)(&value);
-	
-	for(int i = 0; i < sizeof(int) / sizeof(word); ++i)
-		*vp++ = vec_get_value(&script->code, pc + i, word);
-		
-	return value;
+	if(operand >= SCRIPT_REG_CONST)
+		fprintf(out, "%g", vec_get_value(&script->numbers, operand - SCRIPT_REG_CONST, double));
+	else
+		fprintf(out, "r%d", operand);
 }
 
 static void disassemble(script_t* script, FILE* out)
 {
-	int pc = 0;
+	link_code(script);
 	
-	const char* file = "unknown";
-	int line = 0;
-	
-	while(pc < script->code.length)
+	// NOTE: The last instruction is the OP_HALT sentinel added by link_code
+	for(int pc = 0; pc + 1 < script->instrs.length; ++pc)
 	{
-		word code = vec_get_value(&script->code, pc, word);
-		++pc;
-		
-		if(code != OP_FILE && code != OP_LINE)
-			fprintf(out, "%d (%s:%i): ", pc, file, line);
+		script_instr_t* instr = vec_get(&script->instrs, pc);
 
-		switch(code)
+		const char* file;
+		int line;
+
+		get_source_position(script, pc, &file, &line);
+		fprintf(out, "%d (%s:%i): ", pc, file, line);
+
+		switch(instr->op)
 		{
 			case OP_PUSH_NULL: fprintf(out, "push_null\n"); break;
 			
@@ -5916,37 +9244,32 @@ static void disassemble(script_t* script, FILE* out)
 			
 			case OP_PUSH_CHAR:
 			{
-				int c = read_int_at(script, pc);
+				int c = instr->a;
 				fprintf(out, "push_char '%c'\n", c);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_PUSH_NUMBER:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "push_number %g\n", vec_get_value(&script->numbers, index, double));
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_PUSH_STRING:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "push_string '%s'\n", vec_get_value(&script->strings, index, script_string_t).data);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_PUSH_FUNC:
 			{
-				int index = read_int_at(script, pc);
-				fprintf(out, "push_func %d (pc = %d)\n", index, vec_get_value(&script->function_pcs, index, int));
-				pc += sizeof(int) / sizeof(word);
+				int index = instr->a;
+				fprintf(out, "push_func %d (pc = %d)\n", index, vec_get_value(&script->linked_function_pcs, index, int));
 			} break;
 			
 			case OP_PUSH_EXTERN_FUNC:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "push_extern_func %s (id=%d)\n", vec_get_value(&script->extern_names, index, char*), index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_PUSH_ARRAY:
@@ -5956,9 +9279,8 @@ static void disassemble(script_t* script, FILE* out)
 			
 			case OP_PUSH_ARRAY_BLOCK:
 			{
-				int length = read_int_at(script, pc);
+				int length = instr->a;
 				fprintf(out, "push_array_block %d\n", length);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 		
 			case OP_PUSH_RETVAL:
@@ -5968,11 +9290,8 @@ static void disassemble(script_t* script, FILE* out)
 
 			case OP_PUSH_STRUCT:
 			{
-				int nmem = read_int_at(script, pc);
-				pc += sizeof(int) / sizeof(word);
-				
-				int ninit = read_int_at(script, pc);
-				pc += sizeof(int) / sizeof(word);
+				int nmem = instr->a;
+				int ninit = instr->b;
 				
 				fprintf(out, "push_struct num_members=%d num_init=%d\n", nmem, ninit);
 			} break;
@@ -6004,16 +9323,14 @@ static void disassemble(script_t* script, FILE* out)
 			
 			case OP_STRUCT_GET:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "struct_get %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_STRUCT_SET:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "struct_set %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_ADD: fprintf(out, "add\n"); break;
@@ -6034,57 +9351,77 @@ static void disassemble(script_t* script, FILE* out)
 			case OP_NOT: fprintf(out, "not\n"); break;
 			
 			case OP_EQU: fprintf(out, "equ\n"); break;
+
+			case OP_ADD_NUM: fprintf(out, "add_num\n"); break;
+			case OP_SUB_NUM: fprintf(out, "sub_num\n"); break;
+			case OP_MUL_NUM: fprintf(out, "mul_num\n"); break;
+			case OP_DIV_NUM: fprintf(out, "div_num\n"); break;
+			case OP_MOD_NUM: fprintf(out, "mod_num\n"); break;
+
+			case OP_LT_NUM: fprintf(out, "lt_num\n"); break;
+			case OP_GT_NUM: fprintf(out, "gt_num\n"); break;
+			case OP_LTE_NUM: fprintf(out, "lte_num\n"); break;
+			case OP_GTE_NUM: fprintf(out, "gte_num\n"); break;
+
+			case OP_EQU_NUM: fprintf(out, "equ_num\n"); break;
+			case OP_EQU_STR: fprintf(out, "equ_str\n"); break;
 			
 			case OP_READ: fprintf(out, "read\n"); break;
 			case OP_WRITE: fprintf(out, "write\n"); break;
 		
 			case OP_SET:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "set %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_GET:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "get %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_SETLOCAL:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "setlocal %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_GETLOCAL:
 			{
-				int index = read_int_at(script, pc);
+				int index = instr->a;
 				fprintf(out, "getlocal %d\n", index);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 		
 			case OP_GOTO:
 			{
-				int g = read_int_at(script, pc);
+				int g = instr->a;
 				fprintf(out, "goto %d\n", g);
-				pc += sizeof(int) / sizeof(word);
 			} break;
 			
 			case OP_GOTOZ:
 			{
-				int g = read_int_at(script, pc);
+				int g = instr->a;
 				fprintf(out, "gotoz %d\n", g);
-				pc += sizeof(int) / sizeof(word);
+			} break;
+
+			case OP_GOTOZ_BOOL:
+			{
+				int g = instr->a;
+				fprintf(out, "gotoz_bool %d\n", g);
 			} break;
 			
 			case OP_CALL:
 			{
-				word nargs = vec_get_value(&script->code, pc++, word);
+				int nargs = instr->a;
 				fprintf(out, "call nargs=%d\n", nargs);
 			} break;
+
+			case OP_TAIL_CALL:
+			{
+				int nargs = instr->a;
+				fprintf(out, "tail_call nargs=%d\n", nargs);
+			} break;
 			
 			case OP_RETURN:
 			{
@@ -6096,22 +9433,6 @@ static void disassemble(script_t* script, FILE* out)
 				fprintf(out, "return_value\n");
 			} break;
 			
-			case OP_FILE:
-			{
-				int index = read_int_at(script, pc);
-				const char* str = vec_get_value(&script->strings, index, script_string_t).data;
-				pc += sizeof(int) / sizeof(word);
-				
-				file = str;
-			} break;
-			
-			case OP_LINE:
-			{
-				int line_no = read_int_at(script, pc);
-				pc += sizeof(int) / sizeof(word);
-				line = line_no;
-			} break;
-			
 			case OP_ATOMIC_ENABLE:
 			{
 				fprintf(out, "atomic_enable\n");
@@ -6122,6 +9443,59 @@ static void disassemble(script_t* script, FILE* out)
 				fprintf(out, "atomic_disable\n");
 			} break;
 
+			case OP_RESERVE:
+			{
+				fprintf(out, "reserve %d\n", instr->a);
+			} break;
+
+			case OP_GETLOCAL2: fprintf(out, "getlocal2 %d, %d\n", instr->a, instr->b); break;
+			case OP_PUSH_NUMBER_GETLOCAL: fprintf(out, "push_number_getlocal %g, %d\n", vec_get_value(&script->numbers, instr->a, double), instr->b); break;
+			case OP_PUSH_NUMBER_GET: fprintf(out, "push_number_get %g, %d\n", vec_get_value(&script->numbers, instr->a, double), instr->b); break;
+			case OP_ADD_NUM_SETLOCAL: fprintf(out, "add_num_setlocal %d\n", instr->a); break;
+			case OP_ADD_NUM_SET: fprintf(out, "add_num_set %d\n", instr->a); break;
+			case OP_ADD_LOCAL_NUM: fprintf(out, "add_local_num %d, %g\n", instr->b, vec_get_value(&script->numbers, instr->a, double)); break;
+			case OP_ADD_GLOBAL_NUM: fprintf(out, "add_global_num %d, %g\n", instr->b, vec_get_value(&script->numbers, instr->a, double)); break;
+			case OP_LT_NUM_GOTOZ: fprintf(out, "lt_num_gotoz %d\n", instr->a); break;
+			case OP_CALL_FUNC: fprintf(out, "call_func %s nargs=%d\n", vec_get_value(&script->function_names, instr->a, char*), instr->b); break;
+			case OP_CALL_EXTERN: fprintf(out, "call_extern %s nargs=%d\n", vec_get_value(&script->extern_names, instr->a, char*), instr->b); break;
+			case OP_TAIL_CALL_FUNC: fprintf(out, "tail_call_func %s nargs=%d\n", vec_get_value(&script->function_names, instr->a, char*), instr->b); break;
+
+			case OP_REG_MOVE:
+			{
+				fprintf(out, "reg_move r%d, r%d\n", instr->a, instr->b);
+			} break;
+
+			case OP_REG_ADD:
+			case OP_REG_SUB:
+			case OP_REG_MUL:
+			case OP_REG_DIV:
+			case OP_REG_MOD:
+			case OP_REG_LT:
+			case OP_REG_GT:
+			case OP_REG_LTE:
+			case OP_REG_GTE:
+			{
+				static const char* names[] = { "reg_add", "reg_sub", "reg_mul", "reg_div", "reg_mod", "reg_lt", "reg_gt", "reg_lte", "reg_gte" };
+
+				fprintf(out, "%s r%d, ", names[instr->op - OP_REG_ADD], instr->a);
+				write_reg_operand(script, instr->b, out);
+				fprintf(out, ", ");
+				write_reg_operand(script, instr->c, out);
+				fprintf(out, "\n");
+			} break;
+
+			case OP_REG_NEG:
+			{
+				fprintf(out, "reg_neg r%d, ", instr->a);
+				write_reg_operand(script, instr->b, out);
+				fprintf(out, "\n");
+			} break;
+
+			case OP_REG_GOTOZ:
+			{
+				fprintf(out, "reg_gotoz r%d, %d\n", instr->a, instr->b);
+			} break;
+
 			case OP_HALT:
 			{
 				fprintf(out, "halt\n");
@@ -6130,24 +9504,29 @@ static void disassemble(script_t* script, FILE* out)
 	}
 }
 
-static char compare_values(script_value_t* a, script_value_t* b)
+static char compare_values(script_value_t a, script_value_t b)
 {
-	if(a->type != b->type) return 0;
-	switch(a->type)
+	// NOTE: Numbers have to be compared as doubles (0 == -0, NaN != NaN)
+	if(IS_NUMBER(a) && IS_NUMBER(b)) return as_number(a) == as_number(b);
+
+	// NOTE: Identical immediates (and identical objects) are always equal
+	if(a == b) return 1;
+	if(!IS_OBJECT(a) || !IS_OBJECT(b)) return 0;
+
+	script_object_t* oa = AS_OBJECT(a);
+	script_object_t* ob = AS_OBJECT(b);
+
+	if(oa->type != ob->type) return 0;
+	switch(oa->type)
 	{
-		case VAL_NATIVE: return a->nat.value == b->nat.value;
-		case VAL_BOOL: return a->boolean == b->boolean;
-		case VAL_CHAR: return a->code == b->code;
-		case VAL_NUMBER: return a->number == b->number;
-		case VAL_STRING: return strcmp(a->string.data, b->string.data) == 0;
-		case VAL_NULL: return 1;
-		case VAL_FUNC: return (a->function.is_extern == b->function.is_extern) && (a->function.index == b->function.index);
+		case VAL_NATIVE: return oa->nat->value == ob->nat->value;
+		case VAL_STRING: return strcmp(oa->string.data, ob->string.data) == 0;
 		case VAL_ARRAY:
 		{
-			int min_index = (int)(a->array.length < b->array.length ? a->array.length : b->array.length);
+			int min_index = (int)(oa->array->length < ob->array->length ? oa->array->length : ob->array->length);
 			for(int i = 0; i < min_index; ++i)
 			{
-				if(!compare_values(vec_get_value(&a->array, i, script_value_t*), vec_get_value(&b->array, i, script_value_t*)))
+				if(!compare_values(vec_get_value(oa->array, i, script_value_t), vec_get_value(ob->array, i, script_value_t)))
 					return 0;
 			}
 			
@@ -6155,383 +9534,994 @@ static char compare_values(script_value_t* a, script_value_t* b)
 		} break;
 		case VAL_STRUCT_INSTANCE:
 		{
-			if(a->ds.members.length != b->ds.members.length) return 0;
-			for(int i = 0; i < a->ds.members.length; ++i)
+			if(oa->ds->members.length != ob->ds->members.length) return 0;
+			for(int i = 0; i < oa->ds->members.length; ++i)
 			{
-				if(!compare_values(vec_get_value(&a->ds.members, i, script_value_t*), vec_get_value(&b->ds.members, i, script_value_t*)))
+				if(!compare_values(vec_get_value(&oa->ds->members, i, script_value_t), vec_get_value(&ob->ds->members, i, script_value_t)))
 					return 0;
 			}
 			
 			return 1;
 		} break;
+		default: break;
 	}
 	
 	return 0;
 }
 
-static void execute_cycle(script_t* script)
+// NOTE: Typed code still has to check its numbers: a number typed variable,
+// struct member or array element can hold null (e.g. a member that was never
+// initialized). The tag is all that's checked.
+static inline double expect_number(script_t* script, script_value_t val)
+{
+	if(!IS_NUMBER(val))
+		error_exit_script(script, "Expected number but received %s\n", g_value_types[get_value_type(val)]);
+
+	return as_number(val);
+}
+
+// NOTE: Reads a register form source operand; either a frame slot or
+// a number constant (see SCRIPT_REG_CONST)
+static double get_reg_number(script_t* script, int operand)
+{
+	if(operand >= SCRIPT_REG_CONST)
+		return vec_get_value(&script->numbers, operand - SCRIPT_REG_CONST, double);
+
+	return expect_number(script, vec_get_value(&script->stack, script->fp + operand, script_value_t));
+}
+
+static void set_reg_number(script_t* script, int index, double number)
+{
+	script_value_t val = number_value(number);
+	vec_set(&script->stack, script->fp + index, &val);
+}
+
+static void set_reg_bool(script_t* script, int index, char bv)
+{
+	script_value_t val = BOOL_VALUE(bv);
+	vec_set(&script->stack, script->fp + index, &val);
+}
+
+#ifdef SCRIPT_OP_HISTOGRAM
+// NOTE: Counts of opcode pairs executed back to back (without a jump in
+// between) across all scripts; this is what the superinstructions were
+// picked from
+static unsigned long long g_op_pairs[OP_HALT + 1][OP_HALT + 1];
+
+static const char* g_op_names[OP_HALT + 1] = {
+	[OP_PUSH_NULL] = "push_null",
+	[OP_PUSH_TRUE] = "push_true",
+	[OP_PUSH_FALSE] = "push_false",
+	[OP_PUSH_CHAR] = "push_char",
+	[OP_PUSH_NUMBER] = "push_number",
+	[OP_PUSH_STRING] = "push_string",
+	[OP_PUSH_FUNC] = "push_func",
+	[OP_PUSH_EXTERN_FUNC] = "push_extern_func",
+	[OP_PUSH_ARRAY] = "push_array",
+	[OP_PUSH_ARRAY_BLOCK] = "push_array_block",
+	[OP_PUSH_RETVAL] = "push_retval",
+	[OP_PUSH_STRUCT] = "push_struct",
+	[OP_STRING_LEN] = "string_len",
+	[OP_ARRAY_LEN] = "array_len",
+	[OP_STRING_GET] = "string_get",
+	[OP_ARRAY_GET] = "array_get",
+	[OP_ARRAY_SET] = "array_set",
+	[OP_STRUCT_GET] = "struct_get",
+	[OP_STRUCT_SET] = "struct_set",
+	[OP_ADD] = "add",
+	[OP_SUB] = "sub",
+	[OP_MUL] = "mul",
+	[OP_DIV] = "div",
+	[OP_MOD] = "mod",
+	[OP_LT] = "lt",
+	[OP_GT] = "gt",
+	[OP_LTE] = "lte",
+	[OP_GTE] = "gte",
+	[OP_LAND] = "land",
+	[OP_LOR] = "lor",
+	[OP_NEG] = "neg",
+	[OP_NOT] = "not",
+	[OP_EQU] = "equ",
+	[OP_ADD_NUM] = "add_num",
+	[OP_SUB_NUM] = "sub_num",
+	[OP_MUL_NUM] = "mul_num",
+	[OP_DIV_NUM] = "div_num",
+	[OP_MOD_NUM] = "mod_num",
+	[OP_LT_NUM] = "lt_num",
+	[OP_GT_NUM] = "gt_num",
+	[OP_LTE_NUM] = "lte_num",
+	[OP_GTE_NUM] = "gte_num",
+	[OP_EQU_NUM] = "equ_num",
+	[OP_EQU_STR] = "equ_str",
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_GOTO] = "goto",
+	[OP_GOTOZ] = "gotoz",
+	[OP_GOTOZ_BOOL] = "gotoz_bool",
+	[OP_SET] = "set",
+	[OP_GET] = "get",
+	[OP_SETLOCAL] = "setlocal",
+	[OP_GETLOCAL] = "getlocal",
+	[OP_CALL] = "call",
+	[OP_TAIL_CALL] = "tail_call",
+	[OP_RETURN] = "return",
+	[OP_RETURN_VALUE] = "return_value",
+	[OP_ATOMIC_ENABLE] = "atomic_enable",
+	[OP_ATOMIC_DISABLE] = "atomic_disable",
+	[OP_RESERVE] = "reserve",
+	[OP_REG_MOVE] = "reg_move",
+	[OP_REG_ADD] = "reg_add",
+	[OP_REG_SUB] = "reg_sub",
+	[OP_REG_MUL] = "reg_mul",
+	[OP_REG_DIV] = "reg_div",
+	[OP_REG_MOD] = "reg_mod",
+	[OP_REG_LT] = "reg_lt",
+	[OP_REG_GT] = "reg_gt",
+	[OP_REG_LTE] = "reg_lte",
+	[OP_REG_GTE] = "reg_gte",
+	[OP_REG_NEG] = "reg_neg",
+	[OP_REG_GOTOZ] = "reg_gotoz",
+	[OP_GETLOCAL2] = "getlocal2",
+	[OP_PUSH_NUMBER_GETLOCAL] = "push_number_getlocal",
+	[OP_PUSH_NUMBER_GET] = "push_number_get",
+	[OP_ADD_NUM_SETLOCAL] = "add_num_setlocal",
+	[OP_ADD_NUM_SET] = "add_num_set",
+	[OP_ADD_LOCAL_NUM] = "add_local_num",
+	[OP_ADD_GLOBAL_NUM] = "add_global_num",
+	[OP_LT_NUM_GOTOZ] = "lt_num_gotoz",
+	[OP_CALL_FUNC] = "call_func",
+	[OP_CALL_EXTERN] = "call_extern",
+	[OP_TAIL_CALL_FUNC] = "tail_call_func",
+	[OP_HALT] = "halt",
+};
+
+typedef struct
+{
+	int first, second;
+	unsigned long long count;
+} op_pair_t;
+
+static int compare_op_pairs(const void* a, const void* b)
+{
+	const op_pair_t* pa = a;
+	const op_pair_t* pb = b;
+	
+	if(pa->count == pb->count) return 0;
+	return pa->count < pb->count ? 1 : -1;
+}
+
+void script_dump_op_histogram(FILE* out)
 {
-	if(script->pc < 0) return;
-	if (script->pc >= script->code.length)
+	vector_t pairs;
+	vec_init(&pairs, sizeof(op_pair_t));
+
+	unsigned long long total = 0;
+	
+	for(int i = 0; i <= OP_HALT; ++i)
 	{
-		script->pc = -1;
-		return;
+		for(int j = 0; j <= OP_HALT; ++j)
+		{
+			if(g_op_pairs[i][j] > 0)
+			{
+				op_pair_t pair = { i, j, g_op_pairs[i][j] };
+				vec_push_back(&pairs, &pair);
+				
+				total += pair.count;
+			}
+		}
 	}
 
-	word code = vec_get_value(&script->code, script->pc, word);
-	++script->pc;
-	
-	switch(code)
+	qsort(pairs.data, pairs.length, sizeof(op_pair_t), compare_op_pairs);
+
+	for(int i = 0; i < pairs.length; ++i)
 	{
-		case OP_PUSH_NULL:
+		op_pair_t* pair = vec_get(&pairs, i);
+		fprintf(out, "%12llu %5.2f%% %s %s\n", pair->count, pair->count * 100.0 / total, g_op_names[pair->first], g_op_names[pair->second]);
+	}
+
+	vec_destroy(&pairs);
+}
+
+#define COUNT_OP_PAIR() do { if(&code[pc] == ip + 1) ++g_op_pairs[ip->op][code[pc].op]; } while(0)
+#else
+#define COUNT_OP_PAIR()
+#endif
+
+// NOTE: The interpreter loop. Every instruction handler is a label; with
+// SCRIPT_COMPUTED_GOTO each handler jumps straight to the next one through
+// the dispatch table (threaded dispatch), otherwise the labels are plain
+// switch cases and DISPATCH goes back around the loop.
+// When 'single' is set exactly one instruction is executed (this is what
+// script_execute_cycle uses so the debugger and the cycle-limited calls
+// still work). Otherwise instructions are executed until the script halts,
+// the frame depth drops to 'depth' or the debugger requests stepping.
+static void execute(script_t* script, int depth, char single)
+{
+	link_code(script);
+
+	// NOTE: 'pc' lives in a local for the duration of the loop; it is written
+	// back to script->pc before every instruction so that errors, externs
+	// and the debugger always see the correct value.
+	// There's no need to bounds check it since the linked code always
+	// ends in an OP_HALT.
+	int pc = script->pc;
+	const script_instr_t* code = (const script_instr_t*)script->instrs.data;
+	const script_instr_t* ip;
+
+	// NOTE: Set by the call instructions before they jump to the shared call code
+	script_function_t function;
+	word nargs;
+
+	#define SYNC_PC() (script->pc = pc)
+	#define POP() (((script_value_t*)script->stack.data)[--script->stack.length])
+	#define REG(index) (((script_value_t*)script->stack.data)[script->fp + (index)])
+	#define RELOAD_PC() (pc = script->pc)
+	#define RELOAD_CODE() (link_code(script), code = (const script_instr_t*)script->instrs.data)
+
+	if(pc < 0) return;
+
+	// NOTE: Functions reserve their stack space when they're called
+	reserve_stack(script, script->global_stack_size);
+
+#ifdef SCRIPT_COMPUTED_GOTO
+	static const void* dispatch_table[] = {
+		[OP_PUSH_NULL] = &&op_push_null,
+		[OP_PUSH_TRUE] = &&op_push_true,
+		[OP_PUSH_FALSE] = &&op_push_false,
+		[OP_PUSH_CHAR] = &&op_push_char,
+		[OP_PUSH_NUMBER] = &&op_push_number,
+		[OP_PUSH_STRING] = &&op_push_string,
+		[OP_PUSH_FUNC] = &&op_push_func,
+		[OP_PUSH_EXTERN_FUNC] = &&op_push_extern_func,
+		[OP_PUSH_ARRAY] = &&op_push_array,
+		[OP_PUSH_ARRAY_BLOCK] = &&op_push_array_block,
+		[OP_PUSH_RETVAL] = &&op_push_retval,
+		[OP_PUSH_STRUCT] = &&op_push_struct,
+		[OP_STRING_LEN] = &&op_string_len,
+		[OP_ARRAY_LEN] = &&op_array_len,
+		[OP_STRING_GET] = &&op_string_get,
+		[OP_ARRAY_GET] = &&op_array_get,
+		[OP_ARRAY_SET] = &&op_array_set,
+		[OP_STRUCT_GET] = &&op_struct_get,
+		[OP_STRUCT_SET] = &&op_struct_set,
+		[OP_ADD] = &&op_add,
+		[OP_SUB] = &&op_sub,
+		[OP_MUL] = &&op_mul,
+		[OP_DIV] = &&op_div,
+		[OP_MOD] = &&op_mod,
+		[OP_LT] = &&op_lt,
+		[OP_GT] = &&op_gt,
+		[OP_LTE] = &&op_lte,
+		[OP_GTE] = &&op_gte,
+		[OP_LAND] = &&op_land,
+		[OP_LOR] = &&op_lor,
+		[OP_NEG] = &&op_neg,
+		[OP_NOT] = &&op_not,
+		[OP_EQU] = &&op_equ,
+		[OP_ADD_NUM] = &&op_add_num,
+		[OP_SUB_NUM] = &&op_sub_num,
+		[OP_MUL_NUM] = &&op_mul_num,
+		[OP_DIV_NUM] = &&op_div_num,
+		[OP_MOD_NUM] = &&op_mod_num,
+		[OP_LT_NUM] = &&op_lt_num,
+		[OP_GT_NUM] = &&op_gt_num,
+		[OP_LTE_NUM] = &&op_lte_num,
+		[OP_GTE_NUM] = &&op_gte_num,
+		[OP_EQU_NUM] = &&op_equ_num,
+		[OP_EQU_STR] = &&op_equ_str,
+		[OP_READ] = &&op_read,
+		[OP_WRITE] = &&op_write,
+		[OP_GOTO] = &&op_goto,
+		[OP_GOTOZ] = &&op_gotoz,
+		[OP_GOTOZ_BOOL] = &&op_gotoz_bool,
+		[OP_SET] = &&op_set,
+		[OP_GET] = &&op_get,
+		[OP_SETLOCAL] = &&op_setlocal,
+		[OP_GETLOCAL] = &&op_getlocal,
+		[OP_CALL] = &&op_call,
+		[OP_TAIL_CALL] = &&op_tail_call,
+		[OP_RETURN] = &&op_return,
+		[OP_RETURN_VALUE] = &&op_return_value,
+		[OP_ATOMIC_ENABLE] = &&op_atomic_enable,
+		[OP_ATOMIC_DISABLE] = &&op_atomic_disable,
+		[OP_RESERVE] = &&op_reserve,
+		[OP_REG_MOVE] = &&op_reg_move,
+		[OP_REG_ADD] = &&op_reg_add,
+		[OP_REG_SUB] = &&op_reg_sub,
+		[OP_REG_MUL] = &&op_reg_mul,
+		[OP_REG_DIV] = &&op_reg_div,
+		[OP_REG_MOD] = &&op_reg_mod,
+		[OP_REG_LT] = &&op_reg_lt,
+		[OP_REG_GT] = &&op_reg_gt,
+		[OP_REG_LTE] = &&op_reg_lte,
+		[OP_REG_GTE] = &&op_reg_gte,
+		[OP_REG_NEG] = &&op_reg_neg,
+		[OP_REG_GOTOZ] = &&op_reg_gotoz,
+		[OP_GETLOCAL2] = &&op_getlocal2,
+		[OP_PUSH_NUMBER_GETLOCAL] = &&op_push_number_getlocal,
+		[OP_PUSH_NUMBER_GET] = &&op_push_number_get,
+		[OP_ADD_NUM_SETLOCAL] = &&op_add_num_setlocal,
+		[OP_ADD_NUM_SET] = &&op_add_num_set,
+		[OP_ADD_LOCAL_NUM] = &&op_add_local_num,
+		[OP_ADD_GLOBAL_NUM] = &&op_add_global_num,
+		[OP_LT_NUM_GOTOZ] = &&op_lt_num_gotoz,
+		[OP_CALL_FUNC] = &&op_call_func,
+		[OP_CALL_EXTERN] = &&op_call_extern,
+		[OP_TAIL_CALL_FUNC] = &&op_tail_call_func,
+		[OP_HALT] = &&op_halt
+	};
+
+	#define CASE(op, label) label:
+	#define DISPATCH() do { if(single) goto done; COUNT_OP_PAIR(); SYNC_PC(); ip = &code[pc++]; goto *dispatch_table[ip->op]; } while(0)
+
+	SYNC_PC();
+	ip = &code[pc++];
+	goto *dispatch_table[ip->op];
+#else
+	#define CASE(op, label) case op:
+	#define DISPATCH() do { if(single) goto done; COUNT_OP_PAIR(); goto next; } while(0)
+
+next:
+	SYNC_PC();
+	ip = &code[pc++];
+	switch(ip->op)
+	{
+#endif
+		CASE(OP_PUSH_NULL, op_push_null)
 		{
-			script_push_null(script);
-		} break;
-		
-		case OP_PUSH_TRUE:
+			push_reserved(script, NULL_VALUE);
+		} DISPATCH();
+
+		CASE(OP_PUSH_TRUE, op_push_true)
 		{
-			script_push_bool(script, 1);
-		} break;
-		
-		case OP_PUSH_FALSE:
+			push_reserved(script, BOOL_VALUE(1));
+		} DISPATCH();
+
+		CASE(OP_PUSH_FALSE, op_push_false)
 		{
-			script_push_bool(script, 0);
-		} break;
-		
-		case OP_PUSH_CHAR:
+			push_reserved(script, BOOL_VALUE(0));
+		} DISPATCH();
+
+		CASE(OP_PUSH_CHAR, op_push_char)
 		{
-			char c = (char)read_int(script);
-			script_push_char(script, c);
-		} break;
-		
-		case OP_PUSH_NUMBER:
+			int c = ip->a;
+			push_reserved(script, CHAR_VALUE((char)c));
+		} DISPATCH();
+
+		CASE(OP_PUSH_NUMBER, op_push_number)
 		{
-			int index = read_int(script);
-			script_push_number(script, vec_get_value(&script->numbers, index, double));
-		} break;
-		
-		case OP_PUSH_STRING:
+			int index = ip->a;
+			push_reserved(script, number_value(vec_get_value(&script->numbers, index, double)));
+		} DISPATCH();
+
+		CASE(OP_PUSH_STRING, op_push_string)
 		{
-			int index = read_int(script);
-			script_push_string(script, vec_get_value(&script->strings, index, script_string_t));
-		} break;
-		
-		case OP_PUSH_FUNC:
+			int index = ip->a;
+			push_reserved(script, OBJECT_VALUE(vec_get_value(&script->string_values, index, script_object_t*)));
+		} DISPATCH();
+
+		CASE(OP_PUSH_FUNC, op_push_func)
 		{
-			int index = read_int(script);
-			push_func(script, 0, index);
-		} break;
-		
-		case OP_PUSH_EXTERN_FUNC:
+			int index = ip->a;
+			push_reserved(script, function_value(0, index));
+		} DISPATCH();
+
+		CASE(OP_PUSH_EXTERN_FUNC, op_push_extern_func)
 		{
-			int index = read_int(script);
-			push_func(script, 1, index);
-		} break;
-	
-		case OP_PUSH_ARRAY:
+			int index = ip->a;
+			push_reserved(script, function_value(1, index));
+		} DISPATCH();
+
+		CASE(OP_PUSH_ARRAY, op_push_array)
 		{
 			size_t length = (size_t)script_pop_number(script);
 			script_push_array(script, length);
-		} break;
-		
-		case OP_PUSH_ARRAY_BLOCK:
+		} DISPATCH();
+
+		CASE(OP_PUSH_ARRAY_BLOCK, op_push_array_block)
 		{
-			int length = read_int(script);
-			vector_t array;
+			int length = ip->a;
+
+			// NOTE: The elements have to stay on the stack until the array
+			// exists since creating it can collect
+			script_object_t* obj = new_object(script, VAL_ARRAY);
 
-			vec_init(&array, sizeof(script_value_t*));
-			vec_copy_region(&array, &script->stack, 0, script->stack.length - length, length);
+			vec_init(obj->array, sizeof(script_value_t));
+			vec_copy_region(obj->array, &script->stack, 0, script->stack.length - length, length);
 			script->stack.length -= length;
-			
-			script_push_premade_array(script, array);
-		} break;
-				
-		case OP_PUSH_RETVAL:
+			shade_values(script, obj->array);
+			account_payload(script, obj);
+
+			push_reserved(script, OBJECT_VALUE(obj));
+		} DISPATCH();
+
+		CASE(OP_PUSH_RETVAL, op_push_retval)
 		{
-			if(script->ret_val)
-				push_value(script, script->ret_val);
-			else
-				script_push_null(script);
-		} break;
-		
-		case OP_PUSH_STRUCT:
+			push_reserved(script, script->ret_val);
+		} DISPATCH();
+
+		CASE(OP_PUSH_STRUCT, op_push_struct)
 		{
-			int length = read_int(script);
-			int n_init = read_int(script);
-			
-			vector_t members;
-			vec_init(&members, sizeof(script_value_t*));
-			
+			int length = ip->a;
+			int n_init = ip->b;
+
+			// NOTE: Created before the initializers are popped since
+			// creating it can collect
+			script_object_t* obj = new_object(script, VAL_STRUCT_INSTANCE);
+			vector_t* members = &obj->ds->members;
+
+			vec_init(members, sizeof(script_value_t));
+
 			// initialize all members to null
-			script_value_t* init_value = NULL;
-			vec_resize(&members, length, &init_value);
-			
+			script_value_t init_value = NULL_VALUE;
+			vec_resize(members, length, &init_value);
+
 			for(int i = 0; i < n_init; ++i)
 			{
-				script_value_t* val = pop_value(script);
+				script_value_t val = pop_value(script);
 				int index = (int)script_pop_number(script);
-				
-				vec_set(&members, index, &val);
+
+				vec_set(members, index, &val);
 			}
-			
-			// NOTE: not destroying members because 
-			// the data should not be destroyed
-			push_struct(script, members);
-		} break;
-		
-		case OP_STRING_LEN:
+
+			shade_values(script, members);
+			account_payload(script, obj);
+			push_reserved(script, OBJECT_VALUE(obj));
+		} DISPATCH();
+
+		CASE(OP_STRING_LEN, op_string_len)
 		{
 			script_string_t string = script_pop_string(script);
-			script_push_number(script, string.length);
-		} break;
-		
-		case OP_ARRAY_LEN:
+			push_reserved(script, number_value(string.length));
+		} DISPATCH();
+
+		CASE(OP_ARRAY_LEN, op_array_len)
 		{
 			vector_t* array = script_pop_array(script);
-			script_push_number(script, array->length);
-		} break;
-		
-		case OP_STRING_GET:
+			push_reserved(script, number_value(array->length));
+		} DISPATCH();
+
+		CASE(OP_STRING_GET, op_string_get)
 		{
 			script_string_t string = script_pop_string(script);
 			int index = (int)script_pop_number(script);
-			
+
 			if(index < 0 || index >= string.length) error_exit_script(script, "String index out of bounds\n");
-			
-			script_push_char(script, string.data[index]);
-		} break;
-		
-		case OP_ARRAY_GET:
+
+			push_reserved(script, CHAR_VALUE(string.data[index]));
+		} DISPATCH();
+
+		CASE(OP_ARRAY_GET, op_array_get)
 		{
 			vector_t* array = script_pop_array(script);
 			int index = (int)script_pop_number(script);
-			
-			script_value_t* val = vec_get_value(array, index, script_value_t*);
-			if(!val) script_push_null(script);
-			else push_value(script, val);
-		} break;
-		
-		case OP_ARRAY_SET:
+
+			push_reserved(script, vec_get_value(array, index, script_value_t));
+		} DISPATCH();
+
+		CASE(OP_ARRAY_SET, op_array_set)
 		{
-			vector_t* array = script_pop_array(script);
+			script_object_t* obj = pop_object(script, VAL_ARRAY, "array");
 			int index = (int)script_pop_number(script);
-			script_value_t* value = pop_value(script);
-			
-			vec_set(array, index, &value);
-		} break;
-		
-		case OP_STRUCT_GET:
+			script_value_t value = pop_value(script);
+
+			write_barrier(script, obj, value);
+			vec_set(obj->array, index, &value);
+		} DISPATCH();
+
+		CASE(OP_STRUCT_GET, op_struct_get)
 		{
-			int index = read_int(script);
+			int index = ip->a;
 			script_struct_t* s = pop_struct(script);
-			
-			script_value_t* val = vec_get_value(&s->members, index, script_value_t*);
-			if(!val) script_push_null(script);
-			else push_value(script, val);
-		} break;
-		
-		case OP_STRUCT_SET:
+
+			push_reserved(script, vec_get_value(&s->members, index, script_value_t));
+		} DISPATCH();
+
+		CASE(OP_STRUCT_SET, op_struct_set)
 		{
-			int index = read_int(script);
-			script_struct_t* s = pop_struct(script);
-			script_value_t* val = pop_value(script);
-			
-			vec_set(&s->members, index, &val);
-		} break;
-		
-		#define BOP_TYPE(name, op, type) case name: { type a = (type)script_pop_number(script), b = (type)script_pop_number(script); script_push_number(script, a op b); } break;
-		#define BOP(name, op) BOP_TYPE(name, op, double)
-		
-		#define BOP_REL(name, op) case name: { double a = script_pop_number(script), b = script_pop_number(script); script_push_bool(script, a op b); } break;
-		
-		BOP(OP_ADD, +)
-		BOP(OP_SUB, -)
-		BOP(OP_MUL, *)
-		BOP(OP_DIV, /)
-		BOP_TYPE(OP_MOD, %, int)
+			int index = ip->a;
+			script_object_t* obj = pop_object(script, VAL_STRUCT_INSTANCE, "struct");
+			script_value_t val = pop_value(script);
+
+			write_barrier(script, obj, val);
+			vec_set(&obj->ds->members, index, &val);
+		} DISPATCH();
+
+		#define BOP_TYPE(name, label, op, type) CASE(name, label) { type a = (type)script_pop_number(script), b = (type)script_pop_number(script); push_reserved(script, number_value(a op b)); } DISPATCH();
+		#define BOP(name, label, op) BOP_TYPE(name, label, op, double)
+
+		#define BOP_REL(name, label, op) CASE(name, label) { double a = script_pop_number(script), b = script_pop_number(script); push_reserved(script, BOOL_VALUE(a op b)); } DISPATCH();
+
+		BOP(OP_ADD, op_add, +)
+		BOP(OP_SUB, op_sub, -)
+		BOP(OP_MUL, op_mul, *)
+		BOP(OP_DIV, op_div, /)
+		BOP_TYPE(OP_MOD, op_mod, %, int)
+
+		BOP_REL(OP_LT, op_lt, <)
+		BOP_REL(OP_GT, op_gt, >)
+		BOP_REL(OP_LTE, op_lte, <=)
+		BOP_REL(OP_GTE, op_gte, >=)
 
-		BOP_REL(OP_LT, <)
-		BOP_REL(OP_GT, >)
-		BOP_REL(OP_LTE, <=)
-		BOP_REL(OP_GTE, >=)
-		
 		#undef BOP_TYPE
 		#undef BOP
-		
-		case OP_LAND:
+		#undef BOP_REL
+
+		CASE(OP_LAND, op_land)
 		{
-			script_push_bool(script, script_pop_bool(script) && script_pop_bool(script));
-		} break;
-		
-		case OP_LOR:
+			push_reserved(script, BOOL_VALUE(script_pop_bool(script) && script_pop_bool(script)));
+		} DISPATCH();
+
+		CASE(OP_LOR, op_lor)
 		{
-			script_push_bool(script, script_pop_bool(script) || script_pop_bool(script));
-		} break;
-		
-		case OP_NEG:
+			push_reserved(script, BOOL_VALUE(script_pop_bool(script) || script_pop_bool(script)));
+		} DISPATCH();
+
+		CASE(OP_NEG, op_neg)
 		{
-			script_push_number(script, -script_pop_number(script));
-		} break;
-		
-		case OP_NOT:
+			push_reserved(script, number_value(-script_pop_number(script)));
+		} DISPATCH();
+
+		CASE(OP_NOT, op_not)
 		{
-			script_push_bool(script, !script_pop_bool(script));
-		} break;
+			push_reserved(script, BOOL_VALUE(!script_pop_bool(script)));
+		} DISPATCH();
 
-		// TODO: this should be specialized (OP_NUMBER_EQU, OP_STRING_EQU, OP_FUNC_EQU, OP_ARRAY_EQU)
-		case OP_EQU:
+		CASE(OP_EQU, op_equ)
 		{
-			script_value_t* a = pop_value(script);
-			script_value_t* b = pop_value(script);
-			
-			script_push_bool(script, compare_values(a, b));
-		} break;
+			script_value_t a = pop_value(script);
+			script_value_t b = pop_value(script);
+
+			push_reserved(script, BOOL_VALUE(compare_values(a, b)));
+		} DISPATCH();
+
+		// NOTE: The compiler knows the operands are typed number for these, so
+		// they skip the generic pop; the values can still be null though (see
+		// expect_number)
+		#define BOP_NUM_TYPE(name, label, op, type) CASE(name, label) { type a = (type)expect_number(script, POP()), b = (type)expect_number(script, POP()); push_reserved(script, number_value(a op b)); } DISPATCH();
+		#define BOP_NUM(name, label, op) BOP_NUM_TYPE(name, label, op, double)
+
+		#define BOP_NUM_REL(name, label, op) CASE(name, label) { double a = expect_number(script, POP()), b = expect_number(script, POP()); push_reserved(script, BOOL_VALUE(a op b)); } DISPATCH();
+
+		BOP_NUM(OP_ADD_NUM, op_add_num, +)
+		BOP_NUM(OP_SUB_NUM, op_sub_num, -)
+		BOP_NUM(OP_MUL_NUM, op_mul_num, *)
+		BOP_NUM(OP_DIV_NUM, op_div_num, /)
+		BOP_NUM_TYPE(OP_MOD_NUM, op_mod_num, %, int)
+
+		BOP_NUM_REL(OP_LT_NUM, op_lt_num, <)
+		BOP_NUM_REL(OP_GT_NUM, op_gt_num, >)
+		BOP_NUM_REL(OP_LTE_NUM, op_lte_num, <=)
+		BOP_NUM_REL(OP_GTE_NUM, op_gte_num, >=)
+
+		#undef BOP_NUM_TYPE
+		#undef BOP_NUM
+		#undef BOP_NUM_REL
+
+		CASE(OP_EQU_NUM, op_equ_num)
+		{
+			script_value_t a = POP();
+			script_value_t b = POP();
 
-		case OP_READ:
+			// NOTE: Comparing against null is fine, it's just not equal
+			if(IS_NUMBER(a) && IS_NUMBER(b))
+				push_reserved(script, BOOL_VALUE(as_number(a) == as_number(b)));
+			else
+				push_reserved(script, BOOL_VALUE(compare_values(a, b)));
+		} DISPATCH();
+
+		CASE(OP_EQU_STR, op_equ_str)
+		{
+			script_value_t a = POP();
+			script_value_t b = POP();
+
+			// NOTE: A string typed variable can still hold null, which has no data
+			if(IS_OBJECT(a) && IS_OBJECT(b) && AS_OBJECT(a)->type == VAL_STRING && AS_OBJECT(b)->type == VAL_STRING)
+			{
+				script_string_t* sa = &AS_OBJECT(a)->string;
+				script_string_t* sb = &AS_OBJECT(b)->string;
+
+				push_reserved(script, BOOL_VALUE(sa->length == sb->length && strcmp(sa->data, sb->data) == 0));
+			}
+			else
+				push_reserved(script, BOOL_VALUE(compare_values(a, b)));
+		} DISPATCH();
+
+		CASE(OP_READ, op_read)
 		{
 			vector_t buf;
 			int c = getchar();
-			
+
 			vec_init(&buf, sizeof(char));
-			
+
 			while(c != '\n')
 			{
 				vec_push_back(&buf, &c);
 				c = getchar();
 			}
-			
+
 			// NOTE: not destroying vector because that will free the memory
 			// of the string
 			script_string_t str = { buf.length, (char*)buf.data };
 			script_push_string(script, str);
-		} break;
-		
-		case OP_WRITE:
+		} DISPATCH();
+
+		CASE(OP_WRITE, op_write)
 		{
 			write_value(pop_value(script), 0);
 			printf("\n");
-		} break;
-		
-		case OP_GOTO:
+		} DISPATCH();
+
+		CASE(OP_GOTO, op_goto)
 		{
-			int pc = read_int(script);
-			script->pc = pc;
-		} break;
-		
-		case OP_GOTOZ:
+			int target = ip->a;
+			pc = target;
+		} DISPATCH();
+
+		CASE(OP_GOTOZ, op_gotoz)
 		{
-			int pc = read_int(script);
+			int target = ip->a;
 			char cond = script_pop_bool(script);
 			if(cond == 0)
-				script->pc = pc;
-		} break;
-		
-		case OP_SET:
+				pc = target;
+		} DISPATCH();
+
+		CASE(OP_GOTOZ_BOOL, op_gotoz_bool)
 		{
-			int index = read_int(script);
-			script_value_t* val = pop_value(script);
+			script_value_t val = POP();
+
+			// NOTE: A bool typed variable can still hold null
+			if(!IS_IMMEDIATE(val, IMM_BOOL))
+				error_exit_script(script, "Expected bool but received %s\n", g_value_types[get_value_type(val)]);
+
+			if(AS_BOOL(val) == 0)
+				pc = ip->a;
+		} DISPATCH();
+
+		CASE(OP_SET, op_set)
+		{
+			int index = ip->a;
+			script_value_t val = pop_value(script);
+
+			global_write_barrier(script, index, val);
 			vec_set(&script->globals, index, &val);
-		} break;
-		
-		case OP_GET:
+		} DISPATCH();
+
+		CASE(OP_GET, op_get)
 		{
-			int index = read_int(script);
-			push_value(script, vec_get_value(&script->globals, index, script_value_t*));
-		} break;
-		
-		case OP_SETLOCAL:
+			int index = ip->a;
+			push_reserved(script, vec_get_value(&script->globals, index, script_value_t));
+		} DISPATCH();
+
+		CASE(OP_SETLOCAL, op_setlocal)
 		{
-			int index = read_int(script);
-			script_value_t* val = pop_value(script);
+			int index = ip->a;
+			script_value_t val = pop_value(script);
 			vec_set(&script->stack, script->fp + index, &val);
-		} break;
-		
-		case OP_GETLOCAL:
+		} DISPATCH();
+
+		CASE(OP_GETLOCAL, op_getlocal)
 		{
-			int index = read_int(script);
-			script_value_t* val = vec_get_value(&script->stack, script->fp + index, script_value_t*);
-			push_value(script, val);
-		} break;
-		
-		case OP_CALL:
+			int index = ip->a;
+			script_value_t val = vec_get_value(&script->stack, script->fp + index, script_value_t);
+			push_reserved(script, val);
+		} DISPATCH();
+
+		CASE(OP_CALL, op_call)
+		{
+			nargs = (word)ip->a;
+			function = pop_func(script);
+		} goto call;
+
+		CASE(OP_CALL_FUNC, op_call_func)
+		{
+			function.is_extern = 0;
+			function.index = ip->a;
+			nargs = (word)ip->b;
+
+			// NOTE: Skip the OP_CALL
+			++pc;
+		} goto call;
+
+		CASE(OP_CALL_EXTERN, op_call_extern)
 		{
-			word nargs = vec_get_value(&script->code, script->pc++, word);
-			script_function_t function = pop_func(script);
+			function.is_extern = 1;
+			function.index = ip->a;
+			nargs = (word)ip->b;
 			
-			if(function.is_extern)
+			++pc;
+		} goto call;
+
+		call:
+		{
+			SYNC_PC();
+
+			const char* signature = function.is_extern ? vec_get_value(&script->extern_signatures, function.index, char*) : NULL;
+
+			if(signature)
+				call_typed_extern(script, function, nargs, signature);
+			else if(function.is_extern)
 			{
 				int new_stack_length = script->stack.length - nargs;
-				
+
 				vector_t args;
-				vec_init(&args, sizeof(script_value_t*));
-				
+				vec_init(&args, sizeof(script_value_t));
+
 				args.data = nargs > 0 ? vec_get(&script->stack, script->stack.length - nargs) : NULL;
 				args.capacity = args.length = nargs;
-				
-				push_call_record(script, function, nargs);
+
+				push_frame(script, function, nargs);
+				script->frames[script->frame_count - 1].args = &args;
+
+				// NOTE: Externs can call back into the script (which may run
+				// other externs), so the state of the one running is kept here
+				// and each extern only has its own handle scopes counted
+				char outer_in_extern = script->in_extern;
+				char outer_unrooted = script->extern_unrooted;
+				int outer_handle_scopes = script->extern_handle_scopes;
+
+				script->extern_unrooted = outer_unrooted || (outer_in_extern && outer_handle_scopes == 0);
+				script->extern_handle_scopes = 0;
 
 				script->in_extern = 1;
 				vec_get_value(&script->externs, function.index, script_extern_t)(script, &args);
-				script->in_extern = 0;
 
-				pop_call_record(script);
+				if(script->extern_handle_scopes > 0)
+					error_exit_script(script, "Extern '%s' returned without closing its handle scope\n", vec_get_value(&script->extern_names, function.index, char*));
+
+				script->in_extern = outer_in_extern;
+				script->extern_unrooted = outer_unrooted;
+				script->extern_handle_scopes = outer_handle_scopes;
+
+				// NOTE: Externs can't collect (the values they're holding onto
+				// aren't rooted) and with numbers no longer allocating, a loop
+				// might only ever allocate inside of them; so check here too
+				if(can_collect(script)) collect_if_needed(script);
+
+				--script->frame_count;
+				lower_stack_mark(script, get_frame_base(script));
 
 				script->stack.length = new_stack_length;
+
+				// NOTE: Externs may run or compile code (which can move the code
+				// buffer) and the debugger may have asked to step from here
+				RELOAD_CODE();
+				RELOAD_PC();
+				if(pc < 0 || (!single && script->debug_env.step))
+					goto done;
 			}
 			else
 			{
-				push_stack_frame(script, nargs);
-				push_call_record(script, function, nargs);
-				script->pc = vec_get_value(&script->function_pcs, function.index, int);
+				push_stack_frame(script, function, nargs);
+				pc = vec_get_value(&script->linked_function_pcs, function.index, int);
 			}
-		} break;
-		
-		case OP_RETURN:
+		} DISPATCH();
+
+		CASE(OP_TAIL_CALL, op_tail_call)
+		{
+			nargs = (word)ip->a;
+			function = pop_func(script);
+		} goto tail_call;
+
+		CASE(OP_TAIL_CALL_FUNC, op_tail_call_func)
+		{
+			function.is_extern = 0;
+			function.index = ip->a;
+			nargs = (word)ip->b;
+
+			// NOTE: Skip the OP_TAIL_CALL
+			++pc;
+		} goto tail_call;
+
+		// NOTE: The arguments replace the current function's arguments and
+		// locals and its frame is reused, so the callee returns straight to
+		// our caller. Externs are called normally; the OP_PUSH_RETVAL and
+		// OP_RETURN_VALUE after the tail call return what they return.
+		tail_call:
+		{
+			if(function.is_extern || script->indir_depth <= 0)
+				goto call;
+
+			script_frame_t* frame = &script->frames[script->frame_count - 1];
+			script_value_t* stack = (script_value_t*)script->stack.data;
+			int base = script->fp - frame->nargs;
+
+			memmove(&stack[base], &stack[script->stack.length - nargs], nargs * sizeof(script_value_t));
+
+			script->stack.length = base + nargs;
+			script->fp = script->stack.length;
+
+			frame->nargs = nargs;
+			frame->stack_size = script->stack.length;
+			frame->function = function;
+
+			reserve_stack(script, vec_get_value(&script->function_stack_sizes, function.index, int));
+
+			pc = vec_get_value(&script->linked_function_pcs, function.index, int);
+		} DISPATCH();
+
+		CASE(OP_RETURN, op_return)
 		{
-			script->ret_val = NULL;
+			script->ret_val = NULL_VALUE;
 			pop_stack_frame(script);
-			pop_call_record(script);
-		} break;
-		
-		case OP_RETURN_VALUE:
+
+			RELOAD_PC();
+			if(pc < 0 || script->indir_depth <= depth)
+				goto done;
+		} DISPATCH();
+
+		CASE(OP_RETURN_VALUE, op_return_value)
 		{
 			script->ret_val = pop_value(script);
 			pop_stack_frame(script);
-			pop_call_record(script);
-		} break;
 
-		case OP_FILE:
-		{
-			int index = read_int(script);
-			script->cur_file = vec_get_value(&script->strings, index, script_string_t).data; 
-		} break;
-		
-		case OP_LINE:
-		{
-			int line = read_int(script);
-			script->cur_line = line;
-		} break;
+			RELOAD_PC();
+			if(pc < 0 || script->indir_depth <= depth)
+				goto done;
+		} DISPATCH();
 
-		case OP_ATOMIC_ENABLE:
+		CASE(OP_ATOMIC_ENABLE, op_atomic_enable)
 		{
 			++script->atomic_depth;
-		} break;
+		} DISPATCH();
 
-		case OP_ATOMIC_DISABLE:
+		CASE(OP_ATOMIC_DISABLE, op_atomic_disable)
 		{
 			--script->atomic_depth;
 			if (script->atomic_depth < 0)
 				script->atomic_depth = 0;
-		} break;
+		} DISPATCH();
 
-		case OP_HALT:
+		CASE(OP_RESERVE, op_reserve)
 		{
-			script->pc = -1;
-		} break;
+			int count = ip->a;
+			for(int i = 0; i < count; ++i)
+				push_reserved(script, NULL_VALUE);
+
+			// NOTE: When fused from OP_PUSH_NULLs this skips the rest of them
+			pc += ip->b;
+		} DISPATCH();
+
+		CASE(OP_GETLOCAL2, op_getlocal2)
+		{
+			push_reserved(script, REG(ip->a));
+			push_reserved(script, REG(ip->b));
+			++pc;
+		} DISPATCH();
+
+		CASE(OP_PUSH_NUMBER_GETLOCAL, op_push_number_getlocal)
+		{
+			push_reserved(script, number_value(vec_get_value(&script->numbers, ip->a, double)));
+			push_reserved(script, REG(ip->b));
+			++pc;
+		} DISPATCH();
+
+		CASE(OP_PUSH_NUMBER_GET, op_push_number_get)
+		{
+			push_reserved(script, number_value(vec_get_value(&script->numbers, ip->a, double)));
+			push_reserved(script, vec_get_value(&script->globals, ip->b, script_value_t));
+			++pc;
+		} DISPATCH();
+
+		CASE(OP_ADD_NUM_SETLOCAL, op_add_num_setlocal)
+		{
+			double a = expect_number(script, POP()), b = expect_number(script, POP());
+			set_reg_number(script, ip->a, a + b);
+			++pc;
+		} DISPATCH();
+
+		CASE(OP_ADD_NUM_SET, op_add_num_set)
+		{
+			double a = expect_number(script, POP()), b = expect_number(script, POP());
+			script_value_t val = number_value(a + b);
+			
+			vec_set(&script->globals, ip->a, &val);
+			++pc;
+		} DISPATCH();
+
+		CASE(OP_ADD_LOCAL_NUM, op_add_local_num)
+		{
+			set_reg_number(script, ip->b, expect_number(script, REG(ip->b)) + vec_get_value(&script->numbers, ip->a, double));
+			pc += 3;
+		} DISPATCH();
+
+		CASE(OP_ADD_GLOBAL_NUM, op_add_global_num)
+		{
+			double number = expect_number(script, vec_get_value(&script->globals, ip->b, script_value_t)) + vec_get_value(&script->numbers, ip->a, double);
+			script_value_t val = number_value(number);
+			
+			vec_set(&script->globals, ip->b, &val);
+			pc += 3;
+		} DISPATCH();
+
+		CASE(OP_LT_NUM_GOTOZ, op_lt_num_gotoz)
+		{
+			double a = expect_number(script, POP()), b = expect_number(script, POP());
+			if(a < b)
+				++pc;
+			else
+				pc = ip->a;
+		} DISPATCH();
+
+		CASE(OP_REG_MOVE, op_reg_move)
+		{
+			REG(ip->a) = REG(ip->b);
+		} DISPATCH();
+
+		#define REG_BOP_TYPE(name, label, op, type) CASE(name, label) { type a = (type)get_reg_number(script, ip->b), b = (type)get_reg_number(script, ip->c); set_reg_number(script, ip->a, a op b); } DISPATCH();
+		#define REG_BOP(name, label, op) REG_BOP_TYPE(name, label, op, double)
+
+		#define REG_BOP_REL(name, label, op) CASE(name, label) { double a = get_reg_number(script, ip->b), b = get_reg_number(script, ip->c); set_reg_bool(script, ip->a, a op b); } DISPATCH();
+
+		REG_BOP(OP_REG_ADD, op_reg_add, +)
+		REG_BOP(OP_REG_SUB, op_reg_sub, -)
+		REG_BOP(OP_REG_MUL, op_reg_mul, *)
+		REG_BOP(OP_REG_DIV, op_reg_div, /)
+		REG_BOP_TYPE(OP_REG_MOD, op_reg_mod, %, int)
+
+		REG_BOP_REL(OP_REG_LT, op_reg_lt, <)
+		REG_BOP_REL(OP_REG_GT, op_reg_gt, >)
+		REG_BOP_REL(OP_REG_LTE, op_reg_lte, <=)
+		REG_BOP_REL(OP_REG_GTE, op_reg_gte, >=)
+
+		#undef REG_BOP_TYPE
+		#undef REG_BOP
+		#undef REG_BOP_REL
+
+		CASE(OP_REG_NEG, op_reg_neg)
+		{
+			set_reg_number(script, ip->a, -get_reg_number(script, ip->b));
+		} DISPATCH();
+
+		CASE(OP_REG_GOTOZ, op_reg_gotoz)
+		{
+			script_value_t val = REG(ip->a);
+			if(!IS_IMMEDIATE(val, IMM_BOOL))
+				error_exit_script(script, "Expected bool but received %s\n", g_value_types[get_value_type(val)]);
+
+			if(AS_BOOL(val) == 0)
+				pc = ip->b;
+		} DISPATCH();
+
+		CASE(OP_HALT, op_halt)
+		{
+			pc = -1;
+			goto done;
+		} DISPATCH();
+
+#ifndef SCRIPT_COMPUTED_GOTO
 	}
+#endif
 
-	if(script->pc >= script->code.length)
-		script->pc = -1;
+done:
+	SYNC_PC();
+
+	#undef CASE
+	#undef DISPATCH
+	#undef SYNC_PC
+	#undef POP
+	#undef REG
+	#undef RELOAD_PC
+	#undef RELOAD_CODE
+}
+
+static void execute_cycle(script_t* script)
+{
+	execute(script, -1, 1);
+}
+
+// NOTE: Runs the script until it halts or until the frame depth
+// drops to 'depth'. While the debugger is stepping, instructions are
+// executed one at a time so the step checks in script_execute_cycle apply.
+static void execute_until(script_t* script, int depth)
+{
+	while(script->pc >= 0 && script->indir_depth > depth)
+	{
+		if(script->debug_env.step)
+			script_execute_cycle(script);
+		else
+			execute(script, depth, 0);
+	}
 }
 
 void script_load_parse_file(script_t* script, const char* filename, const char* module_name)
@@ -6620,6 +10610,27 @@ void script_disable_warning(script_warning_t warning, char disabled)
 	g_warning_disabled[(int)warning] = disabled;
 }
 
+void script_set_codegen(script_t* script, script_codegen_t codegen)
+{
+	script->codegen = codegen;
+}
+
+// NOTE: Compiles code at the top level of a module, keeping track of how much
+// stack space global code needs (functions keep track of their own)
+static void compile_global_expr(script_t* script, expr_t* exp)
+{
+	int start = script->code.length;
+	
+	compile_expr(script, exp);
+
+	if (exp->type != EXP_FUNC)
+	{
+		int stack_size = get_stack_size(script, start, script->code.length);
+		if (stack_size > script->global_stack_size)
+			script->global_stack_size = stack_size;
+	}
+}
+
 static void compile_module(script_t* script, script_module_t* module)
 {
 	char symbol_error = 0;
@@ -6668,7 +10679,7 @@ static void compile_module(script_t* script, script_module_t* module)
 				for (int expr_index = 0; expr_index < module->expr_list.length; ++expr_index)
 				{
 					expr_t* node = vec_get_value(&module->expr_list, expr_index, expr_t*);
-					compile_expr(script, node);
+					compile_global_expr(script, node);
 				}
 
 				module->end_pc = script->code.length;
@@ -6715,7 +10726,7 @@ static void compile_module(script_t* script, script_module_t* module)
 					//printf("\n");
 
 					if (!g_has_error)
-						compile_expr(script, exp);
+						compile_global_expr(script, exp);
 					else
 						error_exit("Found errors in compile-time code. Stopping compilation\n");
 				}
@@ -6730,16 +10741,27 @@ static void compile_module(script_t* script, script_module_t* module)
 				vec_clear(&script->stack);
 				allocate_globals(script);
 
+				// NOTE: Parsing left this at whichever module was parsed last
+				g_cur_module_index = (int)(module - (script_module_t*)script->modules.data);
+
 				printf("Executing compile-time code...\n");
 
-				script->pc = ct_start_pc;
-				while (script->pc >= 0)
-					script_execute_cycle(script);
+				script->pc = get_linked_pc(script, ct_start_pc);
+				execute_until(script, -1);
 
 				printf("Finished compile-time execution.\n");
 
 				// NOTE: Reset the script code so it doesn't include the compile time code
 				vec_resize(&script->code, module->start_pc, NULL);
+				script->linked = 0;
+
+				while(script->line_info.length > 0 && 
+					vec_get_value(&script->line_info, script->line_info.length - 1, script_line_info_t).pc >= module->start_pc)
+					vec_pop_back(&script->line_info, NULL);
+
+				// NOTE: The code which follows has to record its position again
+				g_last_compiled_file = NULL;
+				g_last_compiled_line = 0;
 			}
 		}
 		module->compiled = 1;
@@ -6783,8 +10805,7 @@ void script_run(script_t* script)
 	g_cur_module_index = -1;
 	
 	script->pc = 0;
-	while(script->pc >= 0)
-		script_execute_cycle(script);
+	execute_until(script, -1);
 }
 
 void script_start(script_t* script)
@@ -6799,14 +10820,16 @@ void script_start(script_t* script)
 	// NOTE: All global code needs to be run at startup
 	// because otherwise globals remain uninitialized
 	// etc
-	while (script->pc >= 0)
-		script_execute_cycle(script);
+	execute_until(script, -1);
 	
 	script->pc = 0;
 }
 
 void script_execute_cycle(script_t* script)
 {
+	if (script->debug_env.step)
+		update_source_position(script);
+
 	if (script->debug_env.step && 
 		(script->cur_line != script->debug_env.step_line ||
 		 strcmp(script->cur_file, script->debug_env.step_file) != 0))
@@ -6862,17 +10885,20 @@ char script_get_function_by_name(script_t* script, const char* name, script_func
 void script_call_function(script_t* script, script_function_t function, int nargs)
 {
 	int depth = script->indir_depth;
-	push_stack_frame(script, (word)nargs);
-	script->pc = vec_get_value(&script->function_pcs, function.index, int);
+	push_stack_frame(script, function, (word)nargs);
+
+	link_code(script);
+	script->pc = vec_get_value(&script->linked_function_pcs, function.index, int);
 	
-	while (script->indir_depth > depth && script->pc >= 0)
-		script_execute_cycle(script);
+	execute_until(script, depth);
 }
 
 void script_goto_function(script_t * script, script_function_t function, int nargs)
 {
-	push_stack_frame(script, (word)nargs);
-	script->pc = vec_get_value(&script->function_pcs, function.index, int);
+	push_stack_frame(script, function, (word)nargs);
+
+	link_code(script);
+	script->pc = vec_get_value(&script->linked_function_pcs, function.index, int);
 }
 
 static void destroy_string(void* p_str)
@@ -6894,15 +10920,40 @@ void script_destroy(script_t* script)
 	vec_destroy(&script->modules);
 	
 	destroy_all_values(script);
+	stop_sweeper(script);
+	script_set_alloc_profiling(script, 0);
+
+	free(script->nursery);
+	vec_destroy(&script->remembered);
+	vec_destroy(&script->remembered_globals);
+	vec_destroy(&script->promoted);
+	vec_destroy(&script->gray);
+	vec_destroy(&script->handles);
+	vec_destroy(&script->dead);
+	vec_destroy(&script->finalize);
 	
 	vec_destroy(&script->globals);
 	
 	vec_destroy(&script->code);
+
+	vec_destroy(&script->instrs);
+	vec_destroy(&script->instr_offsets);
+	vec_destroy(&script->linked_function_pcs);
+	vec_destroy(&script->line_info);
 	
 	vec_destroy(&script->stack);
-	vec_destroy(&script->indir);
+	free(script->frames);
 	
 	vec_destroy(&script->numbers);
+
+	vec_destroy(&script->string_values);
+
+	while(script->constant_blocks)
+	{
+		script_heap_block_t* next = script->constant_blocks->next;
+		free_heap_block(script->constant_blocks);
+		script->constant_blocks = next;
+	}
 	
 	vec_traverse(&script->strings, destroy_string);
 	vec_destroy(&script->strings);
@@ -6911,11 +10962,16 @@ void script_destroy(script_t* script)
 	vec_destroy(&script->extern_names);
 	
 	vec_destroy(&script->externs);
+
+	vec_traverse(&script->extern_signatures, destroy_cstring);
+	vec_destroy(&script->extern_signatures);
+	vec_destroy(&script->typed_externs);
 	
 	vec_traverse(&script->function_names, destroy_cstring);
 	vec_destroy(&script->function_names);
 	
 	vec_destroy(&script->function_pcs);
+	vec_destroy(&script->function_stack_sizes);
 }
 
 #ifdef __cplusplus
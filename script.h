@@ -6,11 +6,30 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include "vector.h"
 #include "hashmap.h"
 
-#define SCRIPT_HEAP_BLOCK_SIZE		(4096U / sizeof(script_value_t))
+// NOTE: Heap blocks are at most SCRIPT_HEAP_BLOCK_BYTES big (a power of two)
+// and aligned to that, so the block an object is in is found from its address.
+// SCRIPT_HEAP_BLOCK_SIZE is the most objects a block can hold (see
+// script_set_heap_block_size); the rest of the block is its header.
+#define SCRIPT_HEAP_BLOCK_BYTES		16384U
+#define SCRIPT_HEAP_BLOCK_SIZE		((SCRIPT_HEAP_BLOCK_BYTES - 512U) / sizeof(script_object_t))
+#define SCRIPT_HEAP_BITMAP_WORDS	((SCRIPT_HEAP_BLOCK_SIZE + 31) / 32)
+
+// NOTE: Default for script_set_max_empty_blocks
+#define SCRIPT_MAX_EMPTY_BLOCKS		4
+
+// NOTE: Pause histogram in script_heap_stats_t; bucket i counts pauses
+// under SCRIPT_GC_PAUSE_BUCKET_US << i microseconds and the last one
+// counts everything longer
+#define SCRIPT_GC_PAUSE_BUCKETS		10
+#define SCRIPT_GC_PAUSE_BUCKET_US	100
+
+// NOTE: Number of objects in the nursery (see SCRIPT_GC_GENERATIONAL)
+#define SCRIPT_NURSERY_SIZE			8192
 #define SCRIPT_DEBUG_CMD_BUF_SIZE	256
 
 typedef enum script_op
@@ -56,12 +75,31 @@ typedef enum script_op
 	OP_NOT,
 
 	OP_EQU,
+
+	// NOTE: Type specialized versions of the above which skip the
+	// dispatch on operand types; the compiler only emits these when the
+	// operands' type tags say what the types are, and since a dynamic
+	// value can still disagree they check the operands and report a type
+	// error if they're wrong
+	OP_ADD_NUM,
+	OP_SUB_NUM,
+	OP_MUL_NUM,
+	OP_DIV_NUM,
+	OP_MOD_NUM,
+	OP_LT_NUM,
+	OP_GT_NUM,
+	OP_LTE_NUM,
+	OP_GTE_NUM,
+	
+	OP_EQU_NUM,
+	OP_EQU_STR,
 	
 	OP_READ,
 	OP_WRITE,
 	
 	OP_GOTO,
 	OP_GOTOZ,
+	OP_GOTOZ_BOOL,
 	
 	OP_SET,
 	OP_GET,
@@ -70,19 +108,117 @@ typedef enum script_op
 	OP_GETLOCAL,
 	
 	OP_CALL,
+	OP_TAIL_CALL,
 	
 	OP_RETURN,
 	OP_RETURN_VALUE,
 	
-	OP_FILE,
-	OP_LINE,
-
 	OP_ATOMIC_ENABLE,
 	OP_ATOMIC_DISABLE,
+
+	// NOTE: Register form instructions (see SCRIPT_CODEGEN_REGISTER).
+	// These operate on frame slots directly (locals and temporaries
+	// addressed relative to fp) rather than the top of the stack.
+	// Source operands >= SCRIPT_REG_CONST refer to number constants.
+	OP_RESERVE,
+	
+	OP_REG_MOVE,
+	
+	OP_REG_ADD,
+	OP_REG_SUB,
+	OP_REG_MUL,
+	OP_REG_DIV,
+	OP_REG_MOD,
+	OP_REG_LT,
+	OP_REG_GT,
+	OP_REG_LTE,
+	OP_REG_GTE,
+	
+	OP_REG_NEG,
+	
+	OP_REG_GOTOZ,
+
+	// NOTE: Superinstructions. These are never compiled; link_code fuses
+	// common instruction sequences into them (see fuse_instructions)
+	OP_GETLOCAL2,
+	OP_PUSH_NUMBER_GETLOCAL,
+	OP_PUSH_NUMBER_GET,
+	OP_ADD_NUM_SETLOCAL,
+	OP_ADD_NUM_SET,
+	OP_ADD_LOCAL_NUM,
+	OP_ADD_GLOBAL_NUM,
+	OP_LT_NUM_GOTOZ,
+	OP_CALL_FUNC,
+	OP_CALL_EXTERN,
+	OP_TAIL_CALL_FUNC,
 	
 	OP_HALT
 } script_op_t;
 
+#define SCRIPT_REG_CONST			(1 << 24)
+
+// NOTE: Which kind of code the compiler generates for function bodies.
+// SCRIPT_CODEGEN_STACK is pure stack code. SCRIPT_CODEGEN_REGISTER
+// compiles arithmetic, comparisons and local assignments inside functions
+// into three-address instructions on frame slots, falling back to stack
+// code for everything else.
+typedef enum
+{
+	SCRIPT_CODEGEN_STACK,
+	SCRIPT_CODEGEN_REGISTER
+} script_codegen_t;
+
+// NOTE: How the heap is collected. SCRIPT_GC_MARK_SWEEP allocates straight
+// into the block heap and marks and sweeps all of it. SCRIPT_GC_GENERATIONAL
+// bump allocates into a nursery; when it fills up the objects still
+// reachable are moved into the block heap (a minor collection) and the
+// block heap is only marked and swept once it has grown enough.
+// SCRIPT_GC_INCREMENTAL marks and sweeps a little at a time as objects are
+// allocated (and in script_gc_step) instead of stopping the script for
+// the whole collection.
+typedef enum
+{
+	SCRIPT_GC_MARK_SWEEP,
+	SCRIPT_GC_GENERATIONAL,
+	SCRIPT_GC_INCREMENTAL
+} script_gc_mode_t;
+
+// NOTE: When the heap gets collected (see script_gc_set_config). Sizes are
+// in bytes and count objects along with what they hold (string data,
+// array/struct storage and natives' sizes).
+// initial_bytes = heap size that triggers the first collection
+// growth_factor = after a collection, the heap can grow to this times what
+// survived before the next one (at least 1)
+// min_bytes = the heap is allowed to grow to at least this much
+// max_bytes = the heap isn't allowed to grow past this (0 for no limit);
+// if more than that is live, it can still grow by min_bytes
+typedef struct
+{
+	size_t initial_bytes;
+	double growth_factor;
+	size_t min_bytes;
+	size_t max_bytes;
+} script_gc_config_t;
+
+// NOTE: A linked instruction; before code is run, the bytecode in
+// script->code is decoded into an array of these so the interpreter
+// never has to reassemble operands byte by byte
+typedef struct script_instr
+{
+	int op;
+	int a, b, c;
+} script_instr_t;
+
+// NOTE: Source position of the code starting at offset 'pc' in
+// script->code (up until the next entry). 'file' is an index into
+// script->strings, or -1 if it isn't known.
+typedef struct script_line_info
+{
+	int pc;
+	int file;
+	int line;
+} script_line_info_t;
+
 typedef enum
 {
 	WARN_DYNAMIC_ARRAY_LITERAL,
@@ -105,6 +241,44 @@ typedef enum script_value_type
 	NUM_VALUE_TYPES
 } script_value_type_t;
 
+// NOTE: Filled in by script_heap_stats. Times are in microseconds of cpu
+// time (clock()). A pause is a full collection, a minor collection or the
+// final marking of an incremental cycle; the rest of an incremental cycle is
+// spread over allocations and script_gc_step.
+// collections = full collections (incremental cycles count once finished)
+// objects/bytes = allocated objects by script_value_type_t and their sizes
+// (see script_gc_config_t); right after a collection that's what's live,
+// otherwise it includes garbage that hasn't been collected yet
+// compacted_blocks = blocks freed by compaction (see script_gc_set_compaction)
+// num_slots/num_used_slots/occupancy = object slots in heap blocks
+// allocated_bytes = everything allocated since the script was created
+// allocation_rate = bytes allocated per second between the last two collections
+typedef struct
+{
+	int collections;
+	int minor_collections;
+	double total_pause_us;
+	double max_pause_us;
+	int pause_histogram[SCRIPT_GC_PAUSE_BUCKETS];
+
+	int objects[NUM_VALUE_TYPES];
+	size_t bytes[NUM_VALUE_TYPES];
+
+	int num_blocks;
+	int num_empty_blocks;
+	int compacted_blocks;
+	int num_slots;
+	int num_used_slots;
+	double occupancy;
+
+	size_t heap_bytes;
+	size_t live_bytes;
+	size_t gc_threshold;
+
+	size_t allocated_bytes;
+	double allocation_rate;
+} script_heap_stats_t;
+
 typedef struct script_string
 {
 	unsigned int length;
@@ -131,30 +305,41 @@ typedef struct script_native
 	void* value;
 	script_native_callback_t on_mark;
 	script_native_callback_t on_delete;
+
+	// NOTE: How much memory value holds onto (see script_set_native_size)
+	size_t size;
 } script_native_t;
 
-struct script_heap_block;
-typedef struct script_value
+// NOTE: Values are 8 bytes and are passed around by value. Numbers are
+// the bits of the double plus 2^49 (NaNs are made canonical first),
+// bools, chars and functions are immediates with bit 48 set and everything
+// below that is a pointer to a gc'd script_object_t (strings, arrays,
+// structs and natives). 0 is null, so zeroed memory is full of nulls.
+// Use the script_to_* accessors rather than decoding these by hand.
+typedef uint64_t script_value_t;
+
+// NOTE: Only strings, arrays, structs and natives live on the heap.
+// Everything but strings is kept behind a pointer to keep objects small;
+// gc state lives in the block (see script_heap_block_t).
+typedef struct script_object
 {
-	struct script_heap_block* block;
-	int block_index;
-
 	script_value_type_t type;
-	struct script_value* next;
-	char marked;
+
+	// NOTE: Where it was allocated (see script_set_alloc_profiling); -1 if
+	// profiling was off
+	int site;
 	
 	union
 	{
-		char boolean;
-		char code;
-		double number;
 		script_string_t string;
-		script_function_t function;
-		vector_t array;
-		script_struct_t ds;
-		script_native_t nat;
+		vector_t* array;
+		script_struct_t* ds;
+		script_native_t* nat;
+
+		// NOTE: Where a nursery object was moved to during a minor collection
+		struct script_object* forward;
 	};
-} script_value_t;
+} script_object_t;
 
 typedef struct script_module
 {
@@ -181,24 +366,47 @@ typedef struct script_heap_block
 {
 	struct script_heap_block* next;
 
+	// NOTE: Neighbours in script->free_blocks (while on_free_list is set)
+	struct script_heap_block* next_free;
+	struct script_heap_block* prev_free;
+	int on_free_list;
+
+	// NOTE: How many objects this block holds; objects past that don't exist
+	int capacity;
 	int num_free;
-	int free_indices[SCRIPT_HEAP_BLOCK_SIZE];
 
-	script_value_t values[SCRIPT_HEAP_BLOCK_SIZE];
+	// NOTE: Set while an incremental sweep hasn't gotten to this block
+	int unswept;
+
+	// NOTE: Set while compaction is moving everything out of this block
+	int evacuating;
+
+	// NOTE: Bit i of live is set while objects[i] is allocated and
+	// bit i of marked is set when the collector reaches it
+	uint32_t live[SCRIPT_HEAP_BITMAP_WORDS];
+	uint32_t marked[SCRIPT_HEAP_BITMAP_WORDS];
+
+	// NOTE: Bit i is set while objects[i] is in script->remembered
+	uint32_t remembered[SCRIPT_HEAP_BITMAP_WORDS];
+
+	script_object_t objects[SCRIPT_HEAP_BLOCK_SIZE];
 } script_heap_block_t;
 
-// NOTE: For stack traces
-typedef struct script_call_record
+// NOTE: One for every active call (externs included). These are all the
+// interpreter saves on a call; stack traces are built from them on demand.
+typedef struct script_frame
 {
-	size_t stack_size;
-	int pc, fp;
+	int pc;				// NOTE: pc to return to (the call is at pc - 1)
+	int fp;				// NOTE: fp of the caller
 	int nargs;
+	int stack_size;		// NOTE: Length of the stack at the call (arguments included)
 
 	script_function_t function;
 
-	const char* file;
-	int line;
-} script_call_record_t;
+	// NOTE: An extern's arguments; they point into the stack, so they're
+	// updated when it moves
+	vector_t* args;
+} script_frame_t;
 
 typedef struct
 {
@@ -211,8 +419,13 @@ typedef struct
 	char step;
 } script_debug_env_t;
 
+// NOTE: Called at the start and end of every full collection (or
+// incremental cycle); these can't allocate script values or call into the script
+struct script;
+typedef void (*script_gc_callback_t)(struct script* script, void* data);
+
 // TODO: ATOMIC STACK
-typedef struct
+typedef struct script
 {
 	// NOTE: This is a pointer you can use to store your own structures
 	// for access in external function calls 
@@ -226,54 +439,232 @@ typedef struct
 	// this is 0
 	char atomic_depth;
 	char in_extern;
+
+	// NOTE: An extern that called back into the script is running without a
+	// handle scope open (so its values aren't rooted)
+	char extern_unrooted;
+
+	// NOTE:
+	// handles = array of script_value_t's the host is holding onto (see script_new_handle)
+	// extern_handle_scopes = handle scopes the innermost running extern has open
+	vector_t handles;
+	int extern_handle_scopes;
 	int pc, fp;
+
+	// NOTE: Set with script_set_codegen before compiling
+	script_codegen_t codegen;
 	
 	// NOTE:
 	// cur_line = line info for current instruction pointer
 	// cur_file = file name for current instruction pointer
+	// These are looked up from line_info on demand (for errors and the
+	// debugger), they aren't kept up to date while the script runs
 	int cur_line;
 	const char* cur_file;
 
-	// NOTE: Array of script_call_record_t's
-	vector_t call_records;
+	// NOTE: Call frames, innermost last. The array grows by doubling, so
+	// pointers into it don't survive a call.
+	script_frame_t* frames;
+	int frame_count;
+	int frame_capacity;
 	
 	script_heap_block_t* heap_head;
+
+	// NOTE:
+	// free_blocks = list of blocks with free slots (see script_heap_block_t)
+	// num_empty_blocks = blocks with nothing allocated in them
+	// heap_block_size = capacity of new blocks (see script_set_heap_block_size)
+	// max_empty_blocks = see script_set_max_empty_blocks
+	script_heap_block_t* free_blocks;
+	int num_empty_blocks;
+	int heap_block_size;
+	int max_empty_blocks;
+
+	// NOTE: Immortal string objects (never collected) so that pushing string
+	// constants doesn't allocate; this is an array of script_object_t*'s which
+	// parallels strings and is filled in when the code is linked. They live in
+	// constant_blocks, which aren't part of the heap. Numbers, chars and
+	// functions are immediates so they don't need any.
+	vector_t string_values;
+	script_heap_block_t* constant_blocks;
+
+	// NOTE: Set with script_set_gc_mode
+	// nursery = SCRIPT_NURSERY_SIZE objects (NULL unless generational)
+	// nursery_top = number of objects allocated in the nursery
+	// remembered = array of script_object_t*'s in the block heap which
+	// may point into the nursery (see script_write_barrier)
+	// remembered_globals = array of int indices of globals which may
+	// point into the nursery
+	// promoted = array of script_object_t*'s which were moved out of the
+	// nursery and haven't been scanned yet (only used during a collection)
+	script_gc_mode_t gc_mode;
+	script_object_t* nursery;
+	int nursery_top;
+	vector_t remembered;
+	vector_t remembered_globals;
+	vector_t promoted;
+
+	// NOTE: Incremental collection state
+	// gc_phase = where the current cycle is at (see GC_IDLE in script.c)
+	// gray = objects which are marked but haven't been scanned (all the way)
+	// gc_stack_low = the stack below this hasn't changed since it was last shaded
+	// sweep_link = link (heap_head or some block's next) to the next block to sweep
+	char gc_phase;
+	vector_t gray;
+	int gc_stack_low;
+	script_heap_block_t** sweep_link;
+
+	// NOTE: Set with script_gc_set_threads
+	int gc_threads;
+
+	// NOTE: Set with script_gc_set_compaction
+	char gc_compact;
+
+	// NOTE: Set with script_gc_set_background_sweep
+	// dead = array of script_object_t's (copies) which were collected but
+	// whose strings/vectors haven't been freed yet
+	// finalize = array of script_native_t*'s which were collected but
+	// haven't had on_delete called yet
+	// sweeper = background thread (only with SCRIPT_BACKGROUND_SWEEP)
+	char gc_background_sweep;
+	vector_t dead;
+	vector_t finalize;
+	void* sweeper;
 	
-	script_value_t* gc_head;
-	script_value_t* ret_val;
+	script_value_t ret_val;
 	
 	int num_objects;
-	int max_objects_until_gc;
+
+	// NOTE:
+	// gc_config = see script_gc_set_config
+	// heap_bytes = size of the heap (see script_gc_config_t), exact after a
+	// collection and grown by whatever is allocated after that
+	// live_bytes = what was reachable as of the last collection
+	// marked_bytes = what's been marked so far in the current collection
+	// gc_threshold = heap_bytes at which the next collection starts
+	script_gc_config_t gc_config;
+	size_t heap_bytes;
+	size_t live_bytes;
+	size_t marked_bytes;
+	size_t gc_threshold;
+
+	// NOTE: Telemetry (see script_heap_stats_t)
+	// gc_last_end_us/gc_last_allocated_bytes = clock and allocated_bytes at
+	// the end of the last collection, for gc_allocation_rate
+	int gc_collections;
+	int gc_minor_collections;
+	int gc_compacted_blocks;
+	double gc_pause_total_us;
+	double gc_pause_max_us;
+	int gc_pause_histogram[SCRIPT_GC_PAUSE_BUCKETS];
+	size_t allocated_bytes;
+	double gc_allocation_rate;
+	double gc_last_end_us;
+	size_t gc_last_allocated_bytes;
+
+	// NOTE: Set with script_gc_set_callbacks
+	script_gc_callback_t on_gc_start;
+	script_gc_callback_t on_gc_end;
+	void* gc_callback_data;
+
+	// NOTE: Set with script_set_alloc_profiling (see alloc_profile_t in script.c)
+	void* alloc_profile;
 
 	vector_t globals;
 	
 	// NOTE:
-	// Number of stack frames
+	// Number of script function frames (frame_count minus the externs)
 	int indir_depth;
 
+	// NOTE: Grows as needed (up to MAX_STACK_SIZE in script.c). Every
+	// function reserves the most it can use on entry, the same goes for
+	// global code whenever execution starts.
 	vector_t stack;
-	vector_t indir;
+	int global_stack_size;
 	
 	vector_t code;
+
+	// NOTE: 'code' linked into script_instr_t's; script->pc indexes into this
+	// array. instr_offsets holds the offset in 'code' of every instruction
+	// and linked_function_pcs are the function_pcs remapped to instructions.
+	// 'linked' is cleared whenever the compiler touches 'code'.
+	char linked;
+	vector_t instrs;
+	vector_t instr_offsets;
+	vector_t linked_function_pcs;
+
+	// NOTE: Array of script_line_info_t's sorted by pc
+	vector_t line_info;
 	
 	vector_t numbers;
 	vector_t strings;
 	
 	vector_t extern_names;
 	vector_t externs;
+
+	// NOTE: For externs bound with script_bind_extern_typed: their signature
+	// and function (NULL for the others)
+	vector_t extern_signatures;
+	vector_t typed_externs;
 	
 	vector_t function_names;
 	vector_t function_pcs;
+	vector_t function_stack_sizes;
 	
 	vector_t modules;
 } script_t;
 
+// NOTE: 'args' points into the stack, which can move (when anything is
+// pushed or a script function is called); always get arguments with
+// script_get_arg rather than holding onto pointers to them.
 typedef void (*script_extern_t)(script_t* script, vector_t* args);
 
+// NOTE: Most arguments a typed extern can take
+#define SCRIPT_MAX_TYPED_ARGS		8
+
+// NOTE: Unboxed argument or return value of a typed extern; the member
+// used is picked by the extern's signature (see script_bind_extern_typed)
+typedef union script_typed_value
+{
+	double number;		// 'n'
+	char bv;			// 'b'
+	char code;			// 'c'
+
+	// 's'; not null terminated, and only valid until the extern returns
+	struct
+	{
+		const char* data;
+		unsigned int length;
+	} string;
+
+	void* native;		// 'p'; the value of the native (NULL for null)
+} script_typed_value_t;
+
+typedef script_typed_value_t (*script_typed_extern_t)(script_t* script, const script_typed_value_t* args);
+
+// NOTE: Handles keep values the host is holding onto alive; they're
+// indices into script->handles rather than the values themselves since
+// collecting can move a value (see SCRIPT_GC_GENERATIONAL).
+typedef int script_handle_t;
+typedef int script_handle_scope_t;
+
 void script_init(script_t* script);
 
 void script_bind_extern(script_t* script, const char* name, script_extern_t ext);
 
+// NOTE: Binds an extern which is called with unboxed arguments and returns
+// an unboxed value, so calling it costs about as much as a native call.
+// The signature has a character for each argument ('n' number, 'b' bool,
+// 'c' char, 's' string, 'p' native), then '>' and the return type (one of
+// those or 'v' for void); "nn>n" is number(number, number). The extern's
+// declaration in the script has to match it. Typed externs can't push
+// values, call script functions or allocate handles. A 'p' return is put
+// in a new native without on_mark or on_delete callbacks, so the host
+// still owns (and has to free) what it points to; natives that need
+// callbacks have to come from script_bind_extern externs (see
+// script_push_native).
+void script_bind_extern_typed(script_t* script, const char* name, script_typed_extern_t ext, const char* signature);
+
 void script_reset(script_t* script);
 
 void script_load_parse_file(script_t* script, const char* filename, const char* module_name);
@@ -285,6 +676,91 @@ void script_parse_code(script_t* script, const char* code, const char* local_pat
 
 void script_disable_warning(script_warning_t warning, char disabled);
 
+// NOTE: Only affects code compiled after this call
+void script_set_codegen(script_t* script, script_codegen_t codegen);
+
+// NOTE: Don't call this while an extern is running
+void script_set_gc_mode(script_t* script, script_gc_mode_t mode);
+
+// NOTE: How many objects new heap blocks hold (at most and by default
+// SCRIPT_HEAP_BLOCK_SIZE); smaller blocks waste less memory on small heaps
+void script_set_heap_block_size(script_t* script, int num_objects);
+
+// NOTE: After a collection, empty heap blocks beyond this many are given back
+// to the system (SCRIPT_MAX_EMPTY_BLOCKS by default); keeping some around saves
+// allocating them again when the heap grows back
+void script_set_max_empty_blocks(script_t* script, int num_blocks);
+
+// NOTE: Defaults are 256KB initial_bytes and min_bytes, a growth_factor
+// of 2 and no max_bytes. Setting the config takes effect right away.
+void script_gc_get_config(script_t* script, script_gc_config_t* config);
+void script_gc_set_config(script_t* script, const script_gc_config_t* config);
+
+// NOTE: Tells the collector how much memory a native's value holds so that
+// it's paced by it; call it whenever that changes
+void script_set_native_size(script_t* script, script_native_t* nat, size_t bytes);
+
+// NOTE: Walks the whole heap for the per type counts, so it's not free on
+// a big heap; scripts get the same numbers from the gc_* externs
+void script_heap_stats(script_t* script, script_heap_stats_t* stats);
+
+void script_gc_set_callbacks(script_t* script, script_gc_callback_t on_start, script_gc_callback_t on_end, void* data);
+
+// NOTE: When enabled, every allocation is recorded along with the line
+// and call stack that made it; disabling it throws away what was recorded.
+// script_write_alloc_profile writes how many objects and bytes each source
+// line and function allocated and how many of those bytes survived the last
+// full collection, biggest first. script_write_alloc_profile_collapsed
+// writes the bytes allocated per call stack in the collapsed format flame
+// graph tools take ("f;g;file:line (type) bytes" per line).
+void script_set_alloc_profiling(script_t* script, char enabled);
+void script_write_alloc_profile(script_t* script, FILE* out);
+void script_write_alloc_profile_collapsed(script_t* script, FILE* out);
+
+// NOTE: How many threads mark the heap during a full collection. This only
+// does anything if script.c was compiled with SCRIPT_PARALLEL_MARK (which
+// needs pthreads), and only for heaps of at least 65536 objects (smaller
+// ones don't take long enough to make up for starting the threads);
+// incremental cycles are always marked on one thread. Natives' on_mark
+// callbacks are never called on two threads at once. "test N -gcbench"
+// times full collections with 1 to N threads.
+void script_gc_set_threads(script_t* script, int num_threads);
+
+// NOTE: When enabled, sweeping only takes back the slots of unreachable
+// values; their memory is freed afterwards, on a separate thread if script.c
+// was compiled with SCRIPT_BACKGROUND_SWEEP (which needs pthreads) or a few
+// at a time as the script allocates otherwise. Natives' on_delete callbacks
+// always run on the script's thread, a few at a time as the script
+// allocates or in script_gc_step. Full collections (other than compacting
+// ones) don't sweep at all; each heap block is swept once the script needs
+// its slots, or in script_gc_step.
+void script_gc_set_background_sweep(script_t* script, char enabled);
+
+// NOTE: When enabled, full collections (other than SCRIPT_GC_INCREMENTAL's)
+// finish by moving everything out of mostly empty heap blocks and freeing
+// them, and by shrinking array and struct storage that's mostly unused, so
+// a long running script's memory doesn't stay fragmented. Like the nursery,
+// it moves values, so the host can only hold onto values across
+// allocations through handles (see script_new_handle).
+void script_gc_set_compaction(script_t* script, char enabled);
+
+// NOTE: Collects the whole heap right away (in any gc mode); don't call
+// this while an extern is running
+void script_gc_collect(script_t* script);
+
+// NOTE: Spends up to about budget_us microseconds of wall clock time (e.g.
+// whatever is left of a frame) on sweeping and finalizers left over from
+// background sweeping and, with SCRIPT_GC_INCREMENTAL, on collection; it
+// starts the next incremental cycle early if the heap is close to needing
+// one.
+void script_gc_step(script_t* script, int budget_us);
+
+#ifdef SCRIPT_OP_HISTOGRAM
+// NOTE: Writes out how often each pair of opcodes was executed back to back,
+// most frequent first
+void script_dump_op_histogram(FILE* out);
+#endif
+
 void script_compile(script_t* script);
 void script_dissassemble(script_t* script, FILE* out);
 void script_run(script_t* script);
@@ -305,7 +781,7 @@ do \
 { \
 	static bool inFunction = false; \
 	static int startDepth = 0; \
-	static script_value_t* retVal = NULL; \
+	static script_value_t retVal = 0; \
 	(script)->ret_val = retVal; \
 	if(!inFunction) \
 	{ \
@@ -352,10 +828,53 @@ vector_t* script_pop_array(script_t* script);
 void script_push_native(script_t* script, void* value, script_native_callback_t on_mark, script_native_callback_t on_delete);
 script_native_t* script_pop_native(script_t* script);
 
-script_value_t* script_get_arg(vector_t* args, int index);
+script_value_t script_get_arg(vector_t* args, int index);
+
+// NOTE: Accessors for values (arguments, array elements, etc); the value
+// has to be of the type asked for
+script_value_type_t script_get_type(script_value_t val);
+
+char script_to_bool(script_value_t val);
+char script_to_char(script_value_t val);
+double script_to_number(script_value_t val);
+script_function_t script_to_function(script_value_t val);
+script_string_t script_to_string(script_value_t val);
+vector_t* script_to_array(script_value_t val);
+script_struct_t* script_to_struct(script_value_t val);
+script_native_t* script_to_native(script_value_t val);
+
+// NOTE: For building arrays (see script_push_premade_array); null is 0
+script_value_t script_bool_value(char bv);
+script_value_t script_char_value(char code);
+script_value_t script_number_value(double number);
+script_value_t script_function_value(script_function_t function);
 
 void script_push_null(script_t* script);
 
+// NOTE: Allocating inside an extern doesn't collect, so an extern building
+// up a big result can grow the heap as much as it wants. While an extern has
+// a handle scope open, allocating can collect: the extern's arguments, what
+// it pushed onto the stack and its handles are kept alive (and updated if
+// they move), anything else it's holding onto isn't. Arguments should be
+// gotten again with script_get_arg after allocating. Scopes are closed in
+// the opposite order they were opened in, in the same extern; closing one
+// releases every handle made since it was opened. An extern calling back
+// into the script (see script_call_function) needs a scope open for
+// anything run from there to collect, externs included. Hosts can also use
+// them outside of externs to keep values alive between runs.
+script_handle_scope_t script_handle_scope_open(script_t* script);
+void script_handle_scope_close(script_t* script, script_handle_scope_t scope);
+
+script_handle_t script_new_handle(script_t* script, script_value_t val);
+script_value_t script_get_handle(script_t* script, script_handle_t handle);
+void script_set_handle(script_t* script, script_handle_t handle, script_value_t val);
+
+// NOTE: If you store a value into an array or struct yourself (rather than
+// through the script) call this afterwards; with SCRIPT_GC_GENERATIONAL
+// the collector has to know about old objects pointing at new ones and with
+// SCRIPT_GC_INCREMENTAL about marked objects pointing at unmarked ones
+void script_write_barrier(script_t* script, script_value_t container, script_value_t val);
+
 void script_return_top(script_t* script);
 
 void script_destroy(script_t* script);
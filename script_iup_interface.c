@@ -56,7 +56,7 @@ static int iup_self_callback(Ihandle* self)
 	script_push_native(data->script, self, NULL, NULL);
 	script_call_function(data->script, data->functions[CB_SELF], 1);
 	
-	return (int)data->script->ret_val->number;
+	return (int)script_to_number(data->script->ret_val);
 }
 
 static Icallback g_callbacks[NUM_CB] = {
@@ -97,7 +97,7 @@ static void iup_handle_free(void* vhandle)
 
 static void ext_iup_label(script_t* script, vector_t* args)
 {
-	script_string_t name = script_get_arg(args, 0)->string;
+	script_string_t name = script_to_string(script_get_arg(args, 0));
 	Ihandle* label = IupLabel(name.data);
 	script_push_native(script, label, NULL, iup_handle_free);
 	script_return_top(script);
@@ -105,7 +105,7 @@ static void ext_iup_label(script_t* script, vector_t* args)
 
 static void ext_iup_button(script_t* script, vector_t* args)
 {
-	script_string_t name = script_get_arg(args, 0)->string;
+	script_string_t name = script_to_string(script_get_arg(args, 0));
 	Ihandle* button = IupButton(name.data, NULL);
 	script_push_native(script, button, NULL, iup_handle_free);
 	script_return_top(script);
@@ -113,7 +113,7 @@ static void ext_iup_button(script_t* script, vector_t* args)
 
 static void ext_iup_vbox(script_t* script, vector_t* args)
 {
-	vector_t* array = &script_get_arg(args, 0)->array;
+	vector_t* array = script_to_array(script_get_arg(args, 0));
 	vector_t handle_array;
 	
 	vec_init(&handle_array, sizeof(Ihandle*));
@@ -121,8 +121,8 @@ static void ext_iup_vbox(script_t* script, vector_t* args)
 	
 	for(int i = 0; i < array->length; ++i)
 	{
-		script_value_t* val = vec_get_value(array, i, script_value_t*);
-		vec_push_back(&handle_array, &val->nat.value);
+		script_value_t val = vec_get_value(array, i, script_value_t);
+		vec_push_back(&handle_array, &script_to_native(val)->value);
 	}
 	Ihandle* null_handle = NULL;
 	vec_push_back(&handle_array, &null_handle); 
@@ -136,15 +136,15 @@ static void ext_iup_vbox(script_t* script, vector_t* args)
 
 static void ext_iup_append(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
-	Ihandle* new_child = script_get_arg(args, 1)->nat.value;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
+	Ihandle* new_child = script_to_native(script_get_arg(args, 1))->value;
 	
 	IupAppend(handle, new_child);
 }
 
 static void ext_iup_dialog(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
 	Ihandle* dlg = IupDialog(handle);
 	
 	script_push_native(script, dlg, NULL, iup_handle_free);
@@ -153,19 +153,19 @@ static void ext_iup_dialog(script_t* script, vector_t* args)
 
 static void ext_iup_set_attribute(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
-	script_string_t attr_name = script_get_arg(args, 1)->string;
-	script_string_t attr_value = script_get_arg(args, 2)->string;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
+	script_string_t attr_name = script_to_string(script_get_arg(args, 1));
+	script_string_t attr_value = script_to_string(script_get_arg(args, 2));
 	
 	IupSetAttribute(handle, attr_name.data, estrdup(attr_value.data));
 }
 
 static void ext_iup_set_callback(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
-	script_string_t cb_name = script_get_arg(args, 1)->string;
-	script_function_t cb_func = script_get_arg(args, 2)->function;
-	int cb_type = (int)script_get_arg(args, 3)->number;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
+	script_string_t cb_name = script_to_string(script_get_arg(args, 1));
+	script_function_t cb_func = script_to_function(script_get_arg(args, 2));
+	int cb_type = (int)script_to_number(script_get_arg(args, 3));
 	
 	// TODO: check if cb_type is valid
 	cb_data_t* data = create_cb_data(script);
@@ -177,22 +177,22 @@ static void ext_iup_set_callback(script_t* script, vector_t* args)
 
 static void ext_iup_map(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
 	IupMap(handle);
 }
 
 static void ext_iup_show_xy(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
-	int x = (int)script_get_arg(args, 1)->number;
-	int y = (int)script_get_arg(args, 2)->number;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
+	int x = (int)script_to_number(script_get_arg(args, 1));
+	int y = (int)script_to_number(script_get_arg(args, 2));
 	
 	IupShowXY(handle, x, y);
 }
 
 static void ext_iup_refresh(script_t* script, vector_t* args)
 {
-	Ihandle* handle = script_get_arg(args, 0)->nat.value;
+	Ihandle* handle = script_to_native(script_get_arg(args, 0))->value;
 	IupRefresh(handle);
 }
 
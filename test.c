@@ -1,15 +1,152 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "script.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+
+#define GC_BENCH_RUNS 5
+
+// NOTE: A complete binary tree of about 2 million structs (none of them
+// garbage) for -gcbench to mark
+static const char* g_gc_bench_code =
+	"struct node { left : node right : node }\n"
+	"func tree(depth : number) : node {\n"
+	"	if depth == 0 { return new node { left = null, right = null } }\n"
+	"	return new node { left = tree(depth - 1), right = tree(depth - 1) }\n"
+	"}\n"
+	"var root = tree(20)\n";
+
+// NOTE: For -externtest: each outer extern calls back into callback, which
+// makes garbage and then runs inner
+static const char* g_extern_test_code =
+	"extern\n"
+	"{\n"
+	"	outer_scoped() : void\n"
+	"	outer_unscoped() : void\n"
+	"	inner() : void\n"
+	"	make_array_of_length(number) : array-dynamic\n"
+	"}\n"
+	"func callback() : void {\n"
+	"	for var i = 0, i < 100000, i = i + 1 { make_array_of_length(8) }\n"
+	"	inner()\n"
+	"	for var i = 0, i < 100000, i = i + 1 { make_array_of_length(8) }\n"
+	"}\n"
+	"outer_scoped()\n"
+	"outer_unscoped()\n";
+
+static double wall_us(void)
+{
+#ifdef _WIN32
+	// NOTE: clock() is wall time on Windows
+	return (double)clock() * 1000000 / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#endif
+}
+
+// NOTE: Times full collections of a big heap with 1 to max_threads marking
+// threads (see script_gc_set_threads; build with "make bench" so script.c
+// has SCRIPT_PARALLEL_MARK). Everything survives, so it's mostly marking.
+static void gc_bench(script_t* script, int max_threads)
+{
+	script_parse_code(script, g_gc_bench_code, "", "gcbench");
+	script_compile(script);
+	script_run(script);
+
+	printf("%d objects\n", script->num_objects);
+	printf("threads   best ms    avg ms   objects/ms\n");
+
+	for(int threads = 1; threads <= max_threads; ++threads)
+	{
+		script_gc_set_threads(script, threads);
+
+		double best = 0, total = 0;
+
+		for(int i = 0; i < GC_BENCH_RUNS; ++i)
+		{
+			double start = wall_us();
+			script_gc_collect(script);
+			double ms = (wall_us() - start) / 1000;
+
+			if(i == 0 || ms < best) best = ms;
+			total += ms;
+		}
+
+		printf("%7d %9.2f %9.2f %12.0f\n", threads, best, total / GC_BENCH_RUNS, script->num_objects / best);
+	}
+}
+
+static void call_back(script_t* script)
+{
+	script_function_t callback;
+
+	if(!script_get_function_by_name(script, "callback", &callback))
+	{
+		fprintf(stderr, "No callback function\n");
+		exit(1);
+	}
+
+	script_call_function(script, callback, 0);
+}
+
+static void ext_inner(script_t* script, vector_t* args)
+{
+}
+
+// NOTE: inner has no handle scope open, and returning from it mustn't be
+// mistaken for this extern returning
+static void ext_outer_scoped(script_t* script, vector_t* args)
+{
+	script_handle_scope_t scope = script_handle_scope_open(script);
+	call_back(script);
+	script_handle_scope_close(script, scope);
+}
+
+// NOTE: Nothing can be collected while this is running, even after inner
+// returns
+static void ext_outer_unscoped(script_t* script, vector_t* args)
+{
+	int collections = script->gc_collections + script->gc_minor_collections;
+	call_back(script);
+
+	if(script->gc_collections + script->gc_minor_collections != collections)
+	{
+		fprintf(stderr, "Collected while outer_unscoped was running\n");
+		exit(1);
+	}
+}
+
+// NOTE: Runs externs from within externs (see g_extern_test_code); it exits
+// with an error if their handle scopes or collection get mixed up
+static void extern_test(script_t* script)
+{
+	script_bind_extern(script, "outer_scoped", ext_outer_scoped);
+	script_bind_extern(script, "outer_unscoped", ext_outer_unscoped);
+	script_bind_extern(script, "inner", ext_inner);
+
+	script_parse_code(script, g_extern_test_code, "", "externtest");
+	script_compile(script);
+	script_run(script);
+
+	printf("Nested externs ok\n");
+}
 
 int main(int argc, char* argv[])
 {
 	if(argc < 2)
 	{
 		fprintf(stderr, "%s [execution amount]\n", argv[0]);
+		fprintf(stderr, "%s [max threads] -gcbench\n", argv[0]);
+		fprintf(stderr, "%s 1 -externtest\n", argv[0]);
 		return 1;
 	}
 	
@@ -20,6 +157,26 @@ int main(int argc, char* argv[])
 	script_disable_warning(WARN_DYNAMIC_ARRAY_LITERAL, 1);
 	script_disable_warning(WARN_ARRAY_DYNAMIC_TO_SPECIFIC, 1);
 	
+	for(int i = 2; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-reg") == 0)
+			script_set_codegen(&script, SCRIPT_CODEGEN_REGISTER);
+		else if(strcmp(argv[i], "-gcbench") == 0)
+		{
+			gc_bench(&script, (int)strtol(argv[1], NULL, 10));
+			script_destroy(&script);
+
+			return 0;
+		}
+		else if(strcmp(argv[i], "-externtest") == 0)
+		{
+			extern_test(&script);
+			script_destroy(&script);
+
+			return 0;
+		}
+	}
+	
 	script_load_parse_file(&script, "test.txt", "test");
 	script_compile(&script);
 	